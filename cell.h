@@ -0,0 +1,70 @@
+/*
+ * cell.h: term's grid cell layout
+ *
+ * Each cell is a uint128_t:
+ *    0-31: code point (or grapheme pool index, see POOL_TAG)
+ *   32-55: foreground
+ *   56-79: background
+ *   80-87: modifiers
+ *   88-95: flags (enum term_cell_flags)
+ *  96-127: combining mark
+ */
+
+#ifndef __CELL_H
+#define __CELL_H
+
+#include <stdint.h>
+#include <wchar.h>
+
+#include "width.h"
+
+typedef __uint128_t uint128_t;
+
+#define CELL_PACK(wc, fg, bg, mod) \
+  (((((((uint128_t)(uint8_t)(mod) << 24) | (bg)) << 24) | (fg)) << 32) | (uint32_t)(wc))
+
+#define CELL_CHAR(cell) ((uint32_t)((cell) & 0xffffffff))
+#define CELL_FG(cell) ((uint32_t)((cell) >> 32) & 0xffffff)
+#define CELL_BG(cell) ((uint32_t)((cell) >> 56) & 0xffffff)
+#define CELL_FLAGS(cell) ((int)((cell) >> 88) & 0xff)
+#define CELL_COMB(cell) ((wchar_t)((cell) >> 96))
+#define CELL_SET_COMB(cell, wc) cell=((cell) & (((uint128_t)1 << 96)-1))|((uint128_t)(wc) << 96)
+#define CELL_ATTRS(cell) ((cell) & ((((uint128_t)1 << 88)-1) ^ 0xffffffff))
+
+enum term_cell_flags {
+  /* Left half of a double-width character */
+  TERM_CELL_WIDE
+    = 1,
+  /* Right half of a double-width character */
+  TERM_CELL_DUMMY
+    = 2,
+  /* Last cell of a row which was soft-wrapped */
+  TERM_CELL_WRAP
+    = 4
+};
+
+/*
+ * Cells a printable character takes
+ * (everything below U+0300 is a single
+ * cell wide, so the table is only
+ * consulted for non-Latin text)
+ */
+static inline int cell_width(uint32_t wc){
+  return (wc < 0x300 ? 1 : width_lookup(wc));
+}
+
+/*
+ * Write a character of width 1 or 2
+ * into cell (and, if wide, the dummy
+ * cell after it)
+ */
+static inline void cell_put(uint128_t *cell, uint32_t wc, int width, uint32_t fg, uint32_t bg, char mod){
+  cell[0] = CELL_PACK(wc, fg, bg, mod);
+
+  if(width == 2){
+    cell[1] = CELL_ATTRS(cell[0]) | ((uint128_t)TERM_CELL_DUMMY << 88);
+    cell[0] |= (uint128_t)TERM_CELL_WIDE << 88;
+  }
+}
+
+#endif
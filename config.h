@@ -9,9 +9,35 @@
 
 #define FONT_STRING "-*-*-*-*-*-*-12-*-*-*-*-*-iso10646-*"
 
-#define CHAR_W   6
-#define CHAR_H   12
-#define TOPMOST  10
+/* Characters FONT_STRING lacks are drawn with
+ *   the first of these which has them (each is
+ *   only opened, and asked which characters it
+ *   has, once one is needed)
+ */
+static const char *font_fallbacks[] = {
+  "-misc-fixed-medium-r-*-*-13-*-*-*-*-*-iso10646-1",
+  "-*-unifont-medium-r-*-*-16-*-*-*-*-*-iso10646-1",
+  "-*-*-*-*-*-*-*-*-*-*-*-*-iso10646-1"
+};
+
+/* Cell metrics are measured from FONT_STRING
+ *   and cached in $HOME/METRICS_CACHE, with
+ *   the grid's size when last closed (delete
+ *   the file after changing installed fonts)
+ */
+#define METRICS_CACHE ".cache/term/metrics"
+
+/* Queue drawing and send it a band of rows at a
+ *   time: cells' backgrounds as a request per
+ *   color, and their text as one per color and
+ *   row, without redrawing backgrounds already
+ *   showing. This saves the most where every
+ *   request crosses a network (ssh -X, Xpra).
+ *   Set to 0 to send each cell's drawing as
+ *   drawn, for comparison with -b
+ */
+#define LOW_BANDWIDTH 1
+
 #define LEFTMOST 2
 
 #define TABWIDTH 4
@@ -19,9 +45,123 @@
 #define FG_DEFAULT 0xa6a28c
 #define BG_DEFAULT 0x20201d
 
-#define SCROLLBACK_SIZE 2
+#define SCROLLBACK_LINES 10000
+
+/* With -S dir, rows older than SCROLLBACK_LINES are
+ *   spilled to memory-mapped files in dir (tmpfs or
+ *   a local disk) rather than dropped, up to
+ *   SPILL_LINES of them, after which the spill starts
+ *   over. Only about the last SPILL_HOT_BYTES written
+ *   are kept resident
+ */
+#define SPILL_LINES     50000000
+#define SPILL_HOT_BYTES (16 << 20)
+
+/* Use io_uring (where the kernel allows it) for
+ *   talking to the shell, rather than select(),
+ *   read() and write(): the wait, the shell's
+ *   output and everything typed since the last
+ *   wakeup then take one system call
+ */
+#define IO_URING 1
+
+/* With -s file, the screen and scrollback are saved
+ *   to file (at most every SNAPSHOT_INTERVAL_MS, and
+ *   only the rows which changed) and restored from it
+ *   on the next start
+ */
+#define SNAPSHOT_INTERVAL_MS 2000
+
+/* Dragging the window's edge resizes the grid at
+ *   most once a frame, but the shell is only told
+ *   (TIOCSWINSZ, after which it and whatever runs
+ *   in it redraw) once the size has held for
+ *   RESIZE_SETTLE_MS
+ */
+#define RESIZE_SETTLE_MS 100
 
+/* With -r file, the shell's output is recorded to
+ *   file (asciicast v2) by a thread of its own,
+ *   through a buffer of RECORD_BUFFER bytes: any
+ *   output arriving while it is full is left out
+ *   (and marked as such) rather than holding up
+ *   term. -p file plays a recording back in place
+ *   of the shell (-P as fast as it can), with
+ *   pauses cut to REPLAY_IDLE_MAX_MS
+ */
+#define RECORD_BUFFER      (4 << 20)
+#define REPLAY_IDLE_MAX_MS 2000
+
+/* TERM_CURSOR_LINE, TERM_CURSOR_BLOCK or
+ *   TERM_CURSOR_UNDERLINE, or'd with
+ *   TERM_CURSOR_BLINK to blink every
+ *   CURSOR_BLINK_MS (programs can change
+ *   it with DECSCUSR)
+ */
 #define CURSOR_STYLE TERM_CURSOR_LINE
+#define CURSOR_BLINK_MS 500
+
+/* Search (Ctrl+Shift+F, Tab toggles regex) */
+#define SEARCH_FG         0x20201d
+#define SEARCH_BG         0xae9513
+#define SEARCH_CURRENT_BG 0xd73737
+#define SEARCH_SLICE_US   4000
+
+/* Selection (drag with the left button, Ctrl+Shift+C
+ *   copies it to the clipboard, Ctrl+Shift+V pastes
+ *   the clipboard and the middle button the selection).
+ *   Anything larger than SELECTION_CHUNK bytes is sent
+ *   and received in chunks of that size, and a paste
+ *   stops asking for more while PASTE_QUEUE_MAX bytes
+ *   are still waiting to be written to the shell
+ */
+#define SELECTION_FG    0x20201d
+#define SELECTION_BG    0xa6a28c
+#define SELECTION_CHUNK 65536
+#define PASTE_QUEUE_MAX (1 << 20)
+
+/* Programs can set the clipboard with OSC 52
+ *   (but never read it back), decoded as it
+ *   arrives into a buffer of at most
+ *   CLIPBOARD_MAX bytes, and the window's title
+ *   with OSC 0 or 2, cut to TITLE_MAX bytes and
+ *   sent at most once a frame
+ */
+#define CLIPBOARD_MAX (1 << 20)
+#define TITLE_MAX     256
+
+/* Hints: text matching one of hint_patterns (see
+ *   dfa.h for the syntax) is underlined under the
+ *   pointer, and Ctrl+click runs its command from
+ *   hint_commands through sh, with the text as $1
+ *   and the shell's directory as the current one.
+ *   Ctrl+Shift+U labels those on screen a to z, and
+ *   typing a label opens it. Rows are only scanned
+ *   when needed, or (HINT_SLICE_US at a time) once
+ *   the shell has been quiet for HINT_IDLE_MS
+ */
+#define HINT_FG       0x20201d
+#define HINT_BG       0x1fad83
+#define HINT_IDLE_MS  250
+#define HINT_SLICE_US 2000
+
+static const char *hint_patterns[] = {
+  "(https?|ftp|file)://[^ \t<>\"'`]+",                 /* URLs       */
+  "[A-Za-z0-9_./~-]+\\.[A-Za-z0-9]+:[0-9]+(:[0-9]+)?", /* file:line  */
+  "[A-Z][A-Z0-9]+-[0-9]+"                              /* Ticket ids */
+};
+
+static const char *hint_commands[] = {
+  "xdg-open \"$1\"",
+  "xdg-open \"${1%%:*}\"",
+  "xdg-open \"https://issues.example.com/browse/$1\""
+};
+
+/* Images (kitty graphics protocol) are kept on the
+ *   X server, and the least recently drawn are
+ *   dropped once they take up more than this
+ */
+#define IMAGE_CACHE_BYTES (64 << 20)
 
 /* Base16 Atelier Dune Theme */
 static int esc_palette_8[] = {
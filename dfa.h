@@ -0,0 +1,452 @@
+/*
+ * dfa.h: compiles a handful of small regular expressions into one DFA
+ *
+ * Example usage:
+ *
+ *  const char *patterns[] = { "https?://[^ ]+", "[A-Z]+-[0-9]+" };
+ *  struct dfa d;
+ *  int pattern, len;
+ *
+ *  if(dfa_compile(&d, patterns, 2) == DFA_SUCCESS){
+ *    len = dfa_match(&d, text, text_len, &pattern); // Longest match at text[0]
+ *    dfa_free(&d);
+ *  }
+ *
+ * Text is matched as symbols (see dfa_symbol()): ASCII stands for
+ *   itself, and everything else is one "non-ASCII" symbol, which
+ *   only . and negated classes match.
+ *
+ * Patterns support literals, . (anything), [classes] (with ranges
+ *   and ^), grouping with ( ), alternation with |, the * + and ?
+ *   repetitions, and \ to escape the next character.
+ */
+
+#ifndef __DFA_H
+#define __DFA_H
+
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/* ASCII, plus one for everything else */
+#define DFA_SYMBOLS 129
+#define DFA_OTHER   128
+
+#ifndef DFA_NFA_MAX
+#  define DFA_NFA_MAX 1024
+#endif
+#ifndef DFA_STATES_MAX
+#  define DFA_STATES_MAX 1024
+#endif
+
+/* State 0 is dead, and state 1 the start */
+#define DFA_DEAD  0
+#define DFA_START 1
+
+struct dfa {
+  int states;
+  int16_t (*next)[DFA_SYMBOLS];
+  int16_t *accept;  /* Pattern matched on reaching each state, or -1 */
+};
+
+enum dfa_return_codes {
+  DFA_SUCCESS
+    = 0,
+  DFA_FAIL_SYNTAX
+    = 1,
+  DFA_FAIL_TOO_BIG
+    = 2,
+  DFA_FAIL_ALLOC
+    = 3
+};
+
+int dfa_compile(struct dfa *d, const char **patterns, int count);
+void dfa_free(struct dfa *d);
+int dfa_match(struct dfa *d, const uint8_t *text, int len, int *pattern);
+
+#define dfa_symbol(cp) ((cp) < 0x80 ? (uint8_t)(cp) : DFA_OTHER)
+
+/* Thompson NFA nodes: a symbol set
+ *   leading to out, or an epsilon
+ *   move to out (and out1, if set)
+ */
+enum dfa_node_types {
+  DFA_NODE_SET,
+  DFA_NODE_EPS,
+  DFA_NODE_MATCH
+};
+
+struct dfa_node {
+  int type,
+      out,
+      out1,
+      pattern;
+  uint8_t set[(DFA_SYMBOLS+7)/8];
+};
+
+/* A fragment under construction,
+ *   which always ends in an epsilon
+ *   node to be pointed onwards
+ */
+struct dfa_frag {
+  int start,
+      end;
+};
+
+struct dfa_parser {
+  const char *p;
+  struct dfa_node *nodes;
+  int len,
+      err;
+};
+
+int dfa_node(struct dfa_parser *ps, int type){
+  struct dfa_node *n;
+
+  if(ps->len == DFA_NFA_MAX){
+    ps->err = DFA_FAIL_TOO_BIG;
+    return 0;
+  }
+  n = &ps->nodes[ps->len];
+  memset(n, 0, sizeof(struct dfa_node));
+  n->type = type;
+  n->out = n->out1 = -1;
+  return ps->len++;
+}
+
+struct dfa_frag dfa_parse_alt(struct dfa_parser *ps);
+
+struct dfa_frag dfa_frag_set(struct dfa_parser *ps, const uint8_t *set){
+  struct dfa_frag f;
+
+  f.start = dfa_node(ps, DFA_NODE_SET);
+  f.end = dfa_node(ps, DFA_NODE_EPS);
+  if(ps->err){ return f; }
+  memcpy(ps->nodes[f.start].set, set, sizeof(ps->nodes[f.start].set));
+  ps->nodes[f.start].out = f.end;
+  return f;
+}
+
+#define DFA_SET_ADD(set, c) ((set)[(c) >> 3] |= 1 << ((c) & 7))
+#define DFA_SET_HAS(set, c) ((set)[(c) >> 3] & (1 << ((c) & 7)))
+
+/*
+ * Parse the inside of [...],
+ * with p just past the [
+ */
+void dfa_parse_class(struct dfa_parser *ps, uint8_t *set){
+  uint8_t c, hi;
+  int negate = 0,
+      first = 1,
+      i;
+
+  memset(set, 0, (DFA_SYMBOLS+7)/8);
+  if(*ps->p == '^'){
+    negate = 1;
+    ps->p++;
+  }
+
+  while(*ps->p != '\0' && (*ps->p != ']' || first)){
+    first = 0;
+    c = *ps->p++;
+    if(c == '\\' && *ps->p != '\0'){ c = *ps->p++; }
+    hi = c;
+    if(ps->p[0] == '-' && ps->p[1] != ']' && ps->p[1] != '\0'){
+      hi = ps->p[1];
+      ps->p += 2;
+      if(hi == '\\' && *ps->p != '\0'){ hi = *ps->p++; }
+    }
+    for(i=c;i<=hi && i<DFA_OTHER;i++){
+      DFA_SET_ADD(set, i);
+    }
+  }
+  if(*ps->p != ']'){
+    ps->err = DFA_FAIL_SYNTAX;
+    return;
+  }
+  ps->p++;
+
+  if(negate){
+    for(i=0;i<(DFA_SYMBOLS+7)/8;i++){
+      set[i] = ~set[i];
+    }
+  }
+}
+
+struct dfa_frag dfa_parse_atom(struct dfa_parser *ps){
+  uint8_t set[(DFA_SYMBOLS+7)/8];
+  struct dfa_frag f = { 0, 0 };
+  int c;
+
+  switch(*ps->p){
+    case '(':
+      ps->p++;
+      f = dfa_parse_alt(ps);
+      if(*ps->p != ')'){
+        ps->err = DFA_FAIL_SYNTAX;
+        return f;
+      }
+      ps->p++;
+      return f;
+    case '[':
+      ps->p++;
+      dfa_parse_class(ps, set);
+      break;
+    case '.':
+      ps->p++;
+      memset(set, 0xff, sizeof(set));
+      break;
+    case '\\':
+      ps->p++;
+      if(*ps->p == '\0'){
+        ps->err = DFA_FAIL_SYNTAX;
+        return f;
+      }
+      /* fall through */
+    default:
+      c = (uint8_t)*ps->p++;
+      memset(set, 0, sizeof(set));
+      DFA_SET_ADD(set, (c < DFA_OTHER ? c : DFA_OTHER));
+      break;
+  }
+  return dfa_frag_set(ps, set);
+}
+
+struct dfa_frag dfa_parse_repeat(struct dfa_parser *ps){
+  struct dfa_frag f = dfa_parse_atom(ps),
+                  r;
+
+  while(!ps->err && (*ps->p == '*' || *ps->p == '+' || *ps->p == '?')){
+    r.start = dfa_node(ps, DFA_NODE_EPS);
+    r.end = dfa_node(ps, DFA_NODE_EPS);
+    if(ps->err){ break; }
+
+    ps->nodes[r.start].out = f.start;
+    ps->nodes[r.start].out1 = r.end;
+    ps->nodes[f.end].out = (*ps->p == '?' ? r.end : r.start);
+    if(*ps->p == '+'){
+      r.start = f.start;
+    }
+    f = r;
+    ps->p++;
+  }
+  return f;
+}
+
+struct dfa_frag dfa_parse_concat(struct dfa_parser *ps){
+  struct dfa_frag f,
+                  next;
+
+  /* Empty fragments are a lone epsilon */
+  f.start = f.end = dfa_node(ps, DFA_NODE_EPS);
+
+  while(!ps->err && *ps->p != '\0' && *ps->p != '|' && *ps->p != ')'){
+    next = dfa_parse_repeat(ps);
+    if(ps->err){ break; }
+    ps->nodes[f.end].out = next.start;
+    f.end = next.end;
+  }
+  return f;
+}
+
+struct dfa_frag dfa_parse_alt(struct dfa_parser *ps){
+  struct dfa_frag f = dfa_parse_concat(ps),
+                  next,
+                  r;
+
+  while(!ps->err && *ps->p == '|'){
+    ps->p++;
+    next = dfa_parse_concat(ps);
+    r.start = dfa_node(ps, DFA_NODE_EPS);
+    r.end = dfa_node(ps, DFA_NODE_EPS);
+    if(ps->err){ break; }
+
+    ps->nodes[r.start].out = f.start;
+    ps->nodes[r.start].out1 = next.start;
+    ps->nodes[f.end].out = r.end;
+    ps->nodes[next.end].out = r.end;
+    f = r;
+  }
+  return f;
+}
+
+/*
+ * Add node n and everything
+ * reachable from it by epsilon
+ * moves to a set of NFA nodes
+ */
+void dfa_closure(struct dfa_node *nodes, uint8_t *set, int n, int *stack){
+  int top = 0;
+
+  stack[top++] = n;
+  while(top > 0){
+    n = stack[--top];
+    if(n < 0 || DFA_SET_HAS(set, n)){ continue; }
+    DFA_SET_ADD(set, n);
+    if(nodes[n].type == DFA_NODE_EPS){
+      stack[top++] = nodes[n].out;
+      stack[top++] = nodes[n].out1;
+    }
+  }
+}
+
+uint64_t dfa_set_hash(const uint8_t *set, int len){
+  uint64_t h = 0xcbf29ce484222325;
+  int i;
+
+  for(i=0;i<len;i++){
+    h = (h ^ set[i]) * 0x100000001b3;
+  }
+  return h;
+}
+
+/*
+ * Compile patterns into d (by
+ * subset construction from one
+ * Thompson NFA), where an earlier
+ * pattern wins a tie
+ */
+int dfa_compile(struct dfa *d, const char **patterns, int count){
+  struct dfa_parser ps;
+  struct dfa_frag f;
+  uint8_t *sets = NULL,
+          *cur;
+  uint64_t *hashes = NULL,
+           h;
+  int *stack = NULL,
+      *starts = NULL,
+      *members = NULL,
+      members_len,
+      set_len,
+      state, sym, n, s, i;
+
+  memset(d, 0, sizeof(struct dfa));
+  memset(&ps, 0, sizeof(ps));
+
+  ps.nodes = malloc(DFA_NFA_MAX*sizeof(struct dfa_node));
+  starts = malloc((count > 0 ? count : 1)*sizeof(int));
+  stack = malloc(((DFA_NFA_MAX*2)+1)*sizeof(int));
+  members = malloc(DFA_NFA_MAX*sizeof(int));
+  hashes = malloc((DFA_STATES_MAX+1)*sizeof(uint64_t));
+  d->next = malloc(DFA_STATES_MAX*sizeof(*d->next));
+  d->accept = malloc(DFA_STATES_MAX*sizeof(int16_t));
+  if(ps.nodes == NULL || starts == NULL || stack == NULL || members == NULL ||
+     hashes == NULL || d->next == NULL || d->accept == NULL){
+    ps.err = DFA_FAIL_ALLOC;
+    goto done;
+  }
+
+  for(i=0;i<count && !ps.err;i++){
+    ps.p = patterns[i];
+    f = dfa_parse_alt(&ps);
+    if(!ps.err && *ps.p != '\0'){
+      ps.err = DFA_FAIL_SYNTAX;
+    }
+    if(ps.err){ break; }
+
+    n = dfa_node(&ps, DFA_NODE_MATCH);
+    if(ps.err){ break; }
+    ps.nodes[n].pattern = i;
+    ps.nodes[f.end].out = n;
+    starts[i] = f.start;
+  }
+  if(ps.err){ goto done; }
+
+  /* One set of NFA nodes per state */
+  set_len = (ps.len+7)/8;
+  if((sets=calloc((size_t)DFA_STATES_MAX+1, set_len)) == NULL){
+    ps.err = DFA_FAIL_ALLOC;
+    goto done;
+  }
+
+  /* Dead state, then the start */
+  d->states = 2;
+  hashes[DFA_DEAD] = dfa_set_hash(&sets[0], set_len);
+  for(i=0;i<count;i++){
+    dfa_closure(ps.nodes, &sets[set_len], starts[i], stack);
+  }
+  hashes[DFA_START] = dfa_set_hash(&sets[set_len], set_len);
+
+  for(state=0;state<d->states;state++){
+    /* Which pattern it accepts, and which
+     *   of its nodes consume a symbol
+     */
+    d->accept[state] = -1;
+    members_len = 0;
+    for(n=0;n<ps.len;n++){
+      if(!DFA_SET_HAS(&sets[state*set_len], n)){ continue; }
+      if(ps.nodes[n].type == DFA_NODE_SET){
+        members[members_len++] = n;
+      } else if(ps.nodes[n].type == DFA_NODE_MATCH &&
+                (d->accept[state] == -1 || ps.nodes[n].pattern < d->accept[state])){
+        d->accept[state] = ps.nodes[n].pattern;
+      }
+    }
+
+    for(sym=0;sym<DFA_SYMBOLS;sym++){
+      /* Built in the slot after the last state */
+      cur = &sets[d->states*set_len];
+      memset(cur, 0, set_len);
+      for(i=0;i<members_len;i++){
+        n = members[i];
+        if(DFA_SET_HAS(ps.nodes[n].set, sym)){
+          dfa_closure(ps.nodes, cur, ps.nodes[n].out, stack);
+        }
+      }
+
+      h = dfa_set_hash(cur, set_len);
+      for(s=0;s<d->states;s++){
+        if(hashes[s] == h && memcmp(&sets[s*set_len], cur, set_len) == 0){ break; }
+      }
+      if(s == d->states){
+        if(d->states == DFA_STATES_MAX){
+          ps.err = DFA_FAIL_TOO_BIG;
+          goto done;
+        }
+        hashes[d->states++] = h;
+      }
+      d->next[state][sym] = s;
+    }
+  }
+
+done:
+  free(ps.nodes);
+  free(starts);
+  free(stack);
+  free(members);
+  free(sets);
+  free(hashes);
+  if(ps.err){
+    dfa_free(d);
+  }
+  return ps.err;
+}
+
+void dfa_free(struct dfa *d){
+  free(d->next);
+  free(d->accept);
+  memset(d, 0, sizeof(struct dfa));
+}
+
+/*
+ * Return the length of the longest
+ * match at the start of text (0 if
+ * none), and which pattern it is
+ */
+int dfa_match(struct dfa *d, const uint8_t *text, int len, int *pattern){
+  int state = DFA_START,
+      best = 0,
+      i;
+
+  *pattern = -1;
+  for(i=0;i<len && state != DFA_DEAD;i++){
+    state = d->next[state][text[i]];
+    if(d->accept[state] != -1){
+      best = i+1;
+      *pattern = d->accept[state];
+    }
+  }
+  return best;
+}
+
+#endif
@@ -13,6 +13,14 @@
  *  #include "esc.h"
  *
  *  esc_parse("5;15H"); // Will execute my_escape_handler(ESC_FUNC_CURSOR_POS, [5, 15], 2, "5;15H");
+ *
+ * String sequences (OSC, APC and DCS) are collected
+ *   a character at a time into a fixed buffer:
+ *
+ *  struct esc_string seq;
+ *
+ *  esc_string_start(&seq, ESC_STR_APC);
+ *  while(!esc_string_put(&seq, c)){ ... } // seq.buf now holds the payload
  */
 
 #ifndef __ESC_H
@@ -28,6 +36,13 @@
 /* Arbitrary value useful for initializing a static char array */
 #define ESC_MAX 256
 
+/* Longest string sequence payload kept (anything
+ *   past it is dropped, and the overflow flag set)
+ */
+#ifndef ESC_STRING_MAX
+#  define ESC_STRING_MAX 8192
+#endif
+
 /* Useful for determining if the end of an escape sequence has been reached */
 #define ESC_IS_FUNCTION(c) ((c >= 'A' && c <= 'z') || c == '\x7f')
 #define ESC_IS_ARG(c) (c >= '0' && c <= '9')
@@ -35,6 +50,17 @@
 int esc_parse(char *str);
 void esc_parse_gfx(char func, int args[ESC_MAX], int num, char *str);
 
+struct esc_string {
+  char type,
+       buf[ESC_STRING_MAX];
+  int len,
+      overflow,
+      esc;       /* Last character was ESC */
+};
+
+void esc_string_start(struct esc_string *seq, char type);
+int esc_string_put(struct esc_string *seq, char c);
+
 enum esc_functions {
   /* Cursor functions */
   ESC_FUNC_CURSOR_POS
@@ -63,6 +89,8 @@ enum esc_functions {
     = 's',
   ESC_FUNC_CURSOR_RESTORE
     = 'u',
+  ESC_FUNC_CURSOR_STYLE
+    = 'q',
 
   /* Erase functions */
   ESC_FUNC_ERASE_SCREEN
@@ -86,6 +114,20 @@ enum esc_functions {
     = '\x7f'
 };
 
+/* Characters which (after ESC)
+ *   introduce a string sequence
+ */
+enum esc_strings {
+  ESC_STR_OSC
+    = ']',
+  ESC_STR_APC
+    = '_',
+  ESC_STR_DCS
+    = 'P'
+};
+
+#define ESC_IS_STRING(c) (c == ESC_STR_OSC || c == ESC_STR_APC || c == ESC_STR_DCS)
+
 enum esc_arguments {
   ESC_QUESTION = -20200905,
   ESC_EQUAL    = -20200906,
@@ -174,6 +216,37 @@ int esc_parse(char *str){
   return ESC_SUCCESS;
 }
 
+void esc_string_start(struct esc_string *seq, char type){
+  seq->type = type;
+  seq->len = 0;
+  seq->overflow = 0;
+  seq->esc = 0;
+}
+
+/*
+ * Add a character to a string
+ * sequence, returning 1 once it
+ * has been terminated (by BEL,
+ * or by ST, which is ESC \)
+ */
+int esc_string_put(struct esc_string *seq, char c){
+  if(seq->esc || c == '\a'){
+    seq->buf[seq->len] = '\0';
+    return 1;
+  }
+  if(c == '\x1b'){
+    seq->esc = 1;
+    return 0;
+  }
+
+  if(seq->len+1 < ESC_STRING_MAX){
+    seq->buf[seq->len++] = c;
+  } else {
+    seq->overflow = 1;
+  }
+  return 0;
+}
+
 /*
  * Parse a graphics escape
  * sequence, called automatically
@@ -3,7 +3,6 @@
  *
  * Specific TODO list:
  *  - Fix TODOs littered throughout
- *  - Add functioning scrollback
  *  - Fix backspace in bash
  *      when current line has
  *      more than one type
@@ -23,27 +22,192 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
 #include <pty.h>
 #include <locale.h>
 #include <wchar.h>
+#include <ctype.h>
+#include <regex.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/select.h>
+#include <sys/wait.h>
+#include <pthread.h>
+
+#ifdef __SSE2__
+#  include <emmintrin.h>
+#endif
 
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
+#include <X11/Xatom.h>
+
+/* Set by the Makefile when the
+ *   Xlib/XCB bridge is installed
+ */
+#ifdef TERM_XCB
+#  include <xcb/xcb.h>
+#  include <X11/Xlib-xcb.h>
+#endif
 
 //////////////////////////////
 // CONFIG FILE
 //
 #include "config.h"
 
+//////////////////////////////
+// GENERATED WIDTH TABLE
+//
+#include "width.h"
+
+//////////////////////////////
+// CELL LAYOUT AND UTF-8
+//
+#include "cell.h"
+#include "utf8.h"
+#include "dfa.h"
+
+//////////////////////////////
+// IO_URING
+//
+#if IO_URING && defined(__linux__)
+#  define TERM_URING
+#  include "uring.h"
+#endif
+
 //////////////////////////////
 // PREPROCESSOR
 //
-#define UTF8_PUSH_BYTE(ind) wc|=buf[n+ind]&0xff;wc<<=8
-#define UTF8_PUSH_BYTE_END(size) wc|=buf[n]&0xff;n+=size
+/* A code point field with the top bit set
+ *   holds an index into the grapheme pool
+ *   rather than a code point
+ */
+#define CELL_IS_CLUSTER(cell) ((CELL_CHAR(cell) & POOL_TAG) != 0)
+#define CELL_CLUSTER(cell) (CELL_CHAR(cell) & ~POOL_TAG)
+
+#define POOL_TAG 0x80000000
+#define POOL_CLUSTER_MAX 32
+#define POOL_HASH_SIZE 4096
+#define POOL_ARENA_MIN 4096
+#define POOL_ZWJ 0x200d
+
+#define SEARCH_MAX 256
+
+/* INCR transfers in flight at once */
+#define SEL_TRANSFERS 8
+
+/* Rows converted per XPutImage when
+ *   uploading an image
+ */
+#define GFX_STRIPE_ROWS 64
+
+/* Ids given to images sent without one */
+#define GFX_ID_INTERNAL 0x80000000
+
+/* Rows of a soft-wrapped line scanned
+ *   for hints, matches kept per line,
+ *   lines cached and labels shown
+ */
+#define HINT_SPAN   8
+#define HINT_MAX    32
+#define HINT_CACHE  256
+#define HINT_LABELS 26
+
+/* Fonts tried for a character: FONT_STRING,
+ *   then font_fallbacks
+ */
+#define FONT_CHAIN (1+(int)(sizeof(font_fallbacks)/sizeof(font_fallbacks[0])))
+
+/* Drawing queued before it is sent (see
+ *   X DRAWING), and the largest PolyText16
+ *   request built from it
+ */
+#define BATCH_RECTS      512
+#define BATCH_TEXTS      1024
+#define BATCH_GLYPHS     4096
+#define BATCH_TEXT_BYTES 4096
+#define BATCH_SENT       0xffffffff /* Not a color */
+
+/* Cell size when drawing headless, where
+ *   each glyph is a pattern of its code
+ *   point's bits rather than a font's
+ */
+#define FB_CHAR_W  6
+#define FB_CHAR_H  12
+#define FB_ASCENT  10
+
+/* Events the window always wants (any
+ *   other pointer motion is selected
+ *   by term_x_events)
+ */
+#define TERM_EVENTS \
+  (SubstructureNotifyMask | \
+   StructureNotifyMask |    \
+   ExposureMask |           \
+   KeyPressMask |           \
+   ButtonPressMask |        \
+   ButtonReleaseMask |      \
+   Button1MotionMask |      \
+   LeaveWindowMask |        \
+   PropertyChangeMask)
 
 #define TERM_CURRENT_X x
 #define TERM_CURRENT_Y y
 
+/* Rows are stored in a ring of buf_rows
+ *   rows: row 0 is the top of the screen,
+ *   negative rows are scrollback
+ */
+#define TERM_ROW(row) (&screen_buf[(size_t)((buf_top+(row)+buf_rows) % buf_rows)*term_width])
+
+/* Lines of history, counting any
+ *   spilled out of the ring (which
+ *   only the primary screen has)
+ */
+#define TERM_HIST (hist_len+(alt_screen ? 0 : (int)spill.len))
+
+/* Mapped spill files grow in steps of at least this */
+#define SPILL_GROW (1 << 24)
+
+#ifdef MADV_PAGEOUT
+#  define SPILL_ADVICE MADV_PAGEOUT
+#else
+#  define SPILL_ADVICE MADV_DONTNEED
+#endif
+
+/* Output recorded per event (longer reads
+ *   are split)
+ */
+#define REC_EVENT_MAX 4096
+
+/* An event as a line of the recording,
+ *   at most (each byte takes at most
+ *   6 escaped)
+ */
+#define REC_LINE_MAX ((REC_EVENT_MAX*6)+64)
+
+/* Provided buffers for reading the shell's output */
+#define URING_BUFS     16
+#define URING_BUF_SIZE 4096
+
+/* Shadow grid keys for cells whose pixels
+ *   are not (only) the grid's: a real key
+ *   never has every flag bit set
+ */
+#define SHADOW_DIRTY  (~(uint128_t)0)
+#define SHADOW_CURSOR (~(uint128_t)0 ^ 1)
+#define SHADOW_MARK(key) (CELL_FLAGS(key) == 0xff)
+
+/* Snapshot file header, bumped whenever
+ *   the record layout changes
+ */
+#define SNAP_MAGIC   "TERMSNAP"
+#define SNAP_VERSION 1
+
 //////////////////////////////
 // ENUMS AND TYPEDEFS
 //
@@ -55,10 +219,28 @@ enum term_status_codes {
     = -1,
   TERM_LOG_SHUTDOWN
     = -2,
+  TERM_LOG_STARTUP_TIME
+    = -3,
+  TERM_LOG_HEADLESS
+    = -4,
+  TERM_LOG_X_BYTES
+    = -5,
 
   /* Warning codes */
   TERM_WARN_ESC
     = -100,
+  TERM_WARN_SPILL
+    = -101,
+  TERM_WARN_SNAPSHOT
+    = -102,
+  TERM_WARN_HINT
+    = -103,
+  TERM_WARN_RECORD
+    = -104,
+  TERM_WARN_RECORD_LOST
+    = -105,
+  TERM_WARN_CLIPBOARD
+    = -106,
 
   /* Error codes */
   TERM_ERR_DISPLAY
@@ -68,7 +250,11 @@ enum term_status_codes {
   TERM_ERR_TTY
     = 3,
   X_FONT_SET
-    = 4
+    = 4,
+  TERM_ERR_HEADLESS
+    = 5,
+  TERM_ERR_REPLAY
+    = 6
 };
 
 enum term_config_opts {
@@ -78,20 +264,551 @@ enum term_config_opts {
   TERM_CURSOR_LINE
     = 2,
   TERM_CURSOR_BLOCK
-    = 4
+    = 4,
+  TERM_CURSOR_UNDERLINE
+    = 8,
+  /* Blinks (with any of the above) */
+  TERM_CURSOR_BLINK
+    = 16
+};
+
+enum term_font_states {
+  FONT_CLOSED,
+  FONT_OPEN,     /* Opened, but not yet asked which characters it has */
+  FONT_COVERED,
+  FONT_MISSING
+};
+
+enum term_atoms {
+  ATOM_CLIPBOARD,
+  ATOM_UTF8_STRING,
+  ATOM_TARGETS,
+  ATOM_INCR,
+  ATOM_PASTE,
+  ATOM_NET_WM_NAME,
+  ATOM_COUNT
+};
+
+struct term_cluster {
+  uint32_t off,  /* Offset into the arena */
+           hash,
+           gen;  /* Last collection which found this cluster in use */
+  int32_t next;  /* Hash chain (or free list, when len is 0) */
+  uint16_t len;
+};
+
+struct term_match {
+  uint64_t line; /* Absolute line the match starts on */
+  int col,       /* Cells from the start of that line (past
+                  *   term_width when it starts on a later
+                  *   row of a soft-wrapped line) */
+      len;       /* Cells */
+};
+
+struct term_search {
+  int active,
+      regex,
+      regex_ok,
+      done,
+      jump,     /* Show the next match as soon as it is found */
+      current,
+      span;     /* Most rows below its starting line any match reaches */
+  uint32_t query[SEARCH_MAX];
+  int query_len;
+  regex_t re;
+  uint64_t scan; /* Next line to scan, working backwards */
+  struct term_match *matches;
+  int matches_len,
+      matches_cap;
+  char *line_buf;
+  int *line_map,
+      line_cap;
+};
+
+struct term_sel_pos {
+  uint64_t line; /* Absolute line */
+  int col;
+};
+
+struct term_sel_range {
+  struct term_sel_pos start,
+                      end;   /* Inclusive */
+  int alt, /* Made on the alternate screen */
+      set;
+  char *text;    /* Given by OSC 52, rather than read from the grid */
+  long text_len;
+};
+
+/* An INCR transfer to another client,
+ *   read from the grid as it goes
+ */
+struct term_transfer {
+  Window requestor;
+  Atom property,
+       type;
+  struct term_sel_range range;
+  struct term_sel_pos pos;
+};
+
+struct term_selection {
+  int dragging,
+      shown,
+      next;    /* Transfer slot to reuse when all are busy */
+  struct term_sel_pos anchor;
+  struct term_sel_range range, /* Highlighted */
+                        primary,
+                        clipboard;
+  struct term_transfer xfer[SEL_TRANSFERS];
+  char chunk[SELECTION_CHUNK];
+};
+
+/* Operating system commands (OSC): the
+ *   title waiting for the next frame, and
+ *   the clipboard OSC 52 is decoding as
+ *   it streams in (its buffer is kept for
+ *   the next one)
+ */
+struct term_osc {
+  char title[TITLE_MAX],
+       title_shown[TITLE_MAX];
+  int title_pending;
+  char *clip;
+  long clip_len,
+       clip_cap;
+  int clip_lost; /* Went past CLIPBOARD_MAX */
+};
+
+/* Mouse reporting (DECSET 1000, 1002
+ *   or 1003, and 1006 for the SGR
+ *   encoding)
+ */
+struct term_mouse {
+  int mode,
+      sgr,
+      buttons,     /* Held, a bit per button */
+      col,         /* Last cell reported */
+      row,
+      motion,      /* Motion left to report at the end of the frame */
+      motion_col,
+      motion_row;
+  unsigned int motion_state;
+};
+
+/* Bytes for the shell (or the
+ *   recording) which it has not
+ *   taken yet
+ */
+struct term_queue {
+  char *buf;
+  size_t off,
+         len,
+         cap;
+};
+
+/* An event queued for the recording's
+ *   writer, followed by len bytes
+ */
+struct term_rec_event {
+  double t;     /* Seconds since recording started */
+  uint32_t len;
+  char type;    /* o (output), r (resize) or m (marker) */
+};
+
+/* The recording (with -r), and the
+ *   ring of events queued for its
+ *   writer thread: head and tail
+ *   only grow, and index it modulo
+ *   cap. With io_uring (ring), events
+ *   are instead encoded into out and
+ *   written from sending, alongside
+ *   the shell's input
+ */
+struct term_record {
+  int on,
+      fd,
+      stop,
+      failed,
+      ring,
+      writing;
+  char *path;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  char *buf;
+  size_t cap,
+         head,
+         tail;
+  unsigned long lost,       /* Left out since the last event */
+                lost_total;
+  struct timespec start;
+  struct utf8_decoder dec;  /* The writer's */
+  struct term_queue out,
+                    sending;
+};
+
+/* Window resizes: the size in cells of
+ *   the last ConfigureNotify, not yet
+ *   applied, and whether the shell is
+ *   yet to be told the grid's size
+ */
+struct term_geometry {
+  int pending,
+      width,
+      height,
+      winch;
+  struct timespec changed; /* When the grid last changed size */
+};
+
+struct term_hint {
+  uint64_t line; /* Absolute line the match starts on */
+  int col,       /* As in struct term_match */
+      len,
+      pattern;
+};
+
+/* The hints found on a logical line,
+ *   valid while none of the rows
+ *   scanned has changed since gen
+ */
+struct term_hint_line {
+  uint64_t line,
+           gen;
+  int alt,
+      width,
+      rows,
+      len;
+  struct term_hint hints[HINT_MAX];
+};
+
+struct term_hints {
+  struct dfa dfa;
+  int ok,
+      active,   /* Hint mode, with labels shown */
+      stale,    /* Rows on screen may not have been scanned */
+      busy,     /* The shell has written since the last wait */
+      scan,     /* Next screen row to scan while idle */
+      moved,    /* The pointer has moved since the last frame */
+      px,
+      py;
+  struct term_hint hover,
+                   labels[HINT_LABELS];
+  int labels_len;
+  struct term_hint_line lines[HINT_CACHE];
+  uint64_t gen,   /* Bumped whenever a row changes */
+           *rows; /* When each row of the ring last did */
+  uint8_t *text;  /* Symbols of the line being scanned */
+  int *map,       /* And the cell each came from */
+      cap;
+};
+
+struct term_paste {
+  int incr,
+      waiting,   /* Next chunk held back until the queue drains */
+      bracketed;
+};
+
+/* Keys of a kitty graphics command */
+struct term_gfx_cmd {
+  char a, /* Action */
+       t, /* Transmission medium */
+       o, /* Compression */
+       d; /* What to delete */
+  int f,
+      s, v, /* Size in pixels */
+      S, O, /* Size and offset in a file */
+      m,    /* More chunks follow */
+      q,
+      c, r, /* Size in cells */
+      x, y, w, h,
+      C;
+  uint32_t i, p;
+};
+
+struct term_image {
+  uint32_t id;
+  int w, h;
+  Pixmap pix;
+  uint64_t used; /* When it was last drawn */
+};
+
+struct term_placement {
+  uint32_t image,
+           id;
+  uint64_t line;   /* Absolute line of its top row */
+  int col,
+      alt,
+      x, y, w, h,  /* Part of the image shown */
+      cols,
+      rows;
+};
+
+struct term_gfx {
+  struct term_image *images;
+  int images_len,
+      images_cap;
+  struct term_placement *places;
+  int places_len,
+      places_cap;
+  size_t bytes;
+  uint64_t tick;
+  uint32_t next_id;
+
+  /* Direct transmission in progress */
+  struct term_gfx_cmd upload;
+  int uploading;
+  const char *upload_err;
+  unsigned char *data;
+  size_t data_len,
+         data_cap;
+};
+
+/* Rows spilled out of the scrollback:
+ *   dat holds, for each, a header and
+ *   its cells up to the last non-blank
+ *   one, then the text of its clusters
+ *   (each a count and code points,
+ *   which cluster cells hold the offset
+ *   of), padded to 16 bytes; idx holds
+ *   each one's offset
+ */
+struct term_spill_row {
+  uint32_t width,
+           len,
+           text, /* Code points (and counts) */
+           pad;
+};
+
+struct term_spill {
+  int on,
+      fd_dat,
+      fd_idx;
+  char path_dat[PATH_MAX],
+       path_idx[PATH_MAX];
+  unsigned char *dat;
+  uint64_t *idx;
+  size_t dat_len,
+         dat_cap,
+         idx_cap,
+         advised; /* dat_len when the cold part was last advised */
+  uint64_t len;   /* Lines */
+
+  /* Rows spilled at another width,
+   *   resized for reading
+   */
+  uint128_t *scratch[2];
+  uint64_t scratch_key[2]; /* Index+1, or 0 */
+  int scratch_width,
+      scratch_next;
+};
+
+/* Snapshot records, each an 8-byte
+ *   header and then its payload:
+ *   commits mark the end of a
+ *   consistent snapshot (anything
+ *   after the last one is ignored)
+ */
+enum term_snap_records {
+  SNAP_REC_STATE  = 1,
+  SNAP_REC_ROW    = 2,
+  SNAP_REC_COMMIT = 3
+};
+
+/* What each io_uring completion is for */
+enum term_uring_tags {
+  URING_PTY_READ = 1,
+  URING_PTY_WRITE,
+  URING_PTY_POLL,   /* The shell can take more */
+  URING_X_POLL,
+  URING_REC_WRITE
+};
+
+struct term_snap_header {
+  char magic[8];
+  uint32_t version,
+           cell;     /* sizeof(uint128_t), as a sanity check */
+};
+
+struct term_snap_rec {
+  uint32_t type,
+           len;
+};
+
+struct term_snap_state {
+  uint64_t lines_total;
+  int32_t width,
+          height,
+          hist,
+          x,
+          y,
+          x_saved,
+          y_saved,
+          cursor_style,
+          bracketed_paste;
+  uint32_t fg,
+           bg;
+  char mod,
+       pad[7];
+};
+
+/* Rows are stored up to their last
+ *   non-blank cell
+ */
+struct term_snap_row {
+  uint64_t line;
+  uint32_t width,
+           len;
+};
+
+/* Snapshots are written by a forked
+ *   child (seeing the grid as it was
+ *   when forked), one at a time
+ */
+struct term_snapshot {
+  int on,
+      full,      /* Rewrite everything next time */
+      pending;   /* Changed since the last one */
+  char *path;
+  pid_t pid;
+  struct timespec last;
+
+  /* Row hashes as of the last snapshot,
+   *   for screen lines base onwards
+   */
+  uint64_t *hash,
+           base;
+  int hash_len;
+
+  /* Lines to write (when not full) */
+  uint64_t *lines;
+  int lines_len,
+      lines_cap;
+
+  size_t full_bytes, /* Size of the last full snapshot */
+         log_bytes;  /* Appended to it since */
+};
+
+/* A grid and its ring position, for
+ *   whichever screen is not showing
+ */
+struct term_grid {
+  uint128_t *buf;
+  int rows,
+      top,
+      hist;
+  uint64_t lines;
 };
 
-typedef __uint128_t uint128_t;
+/* What the window shows: a key per
+ *   cell (term_shadow_key()) and a hash
+ *   of each row's keys (0 if unknown)
+ */
+struct term_shadow {
+  uint128_t *cells;
+  uint64_t *hash;
+  int width,
+      height;
+};
+
+/* A font in the fallback chain, with
+ *   a bit per character (below U+10000,
+ *   all core fonts can index) it has
+ */
+struct term_font {
+  unsigned long id;  /* Font, or xcb_font_t */
+  int state,
+      advance;       /* Width of every glyph (0 if they differ, or it is not known) */
+  uint8_t *cover;
+};
+
+struct term_fonts {
+  struct term_font chain[FONT_CHAIN];
+  int current;           /* Font the GC has */
+  uint8_t of[0x10000];   /* Font each character was drawn with, plus one (0 if not yet looked up) */
+};
+
+/* Text queued to be drawn: len
+ *   characters (from glyphs[off])
+ *   in one font and color
+ */
+struct term_batch_text {
+  int16_t x,
+          y;
+  uint32_t color;
+  uint16_t off;
+  uint8_t len,
+          font;
+};
+
+/* Drawing queued to be sent: all of
+ *   it above the band of rows from top
+ *   to bottom, or in that band and left
+ *   of right, so nothing overlaps but
+ *   text over rectangles (which are
+ *   sent first). Also counts the bytes
+ *   drawing takes
+ */
+struct term_batch {
+  XRectangle rects[BATCH_RECTS];
+  uint32_t rect_colors[BATCH_RECTS],
+           glyphs[BATCH_GLYPHS],
+           color,    /* Set by term_x_color() */
+           gc_color; /* The GC's foreground */
+  struct term_batch_text texts[BATCH_TEXTS];
+  int rects_len,
+      texts_len,
+      glyphs_len,
+      top,
+      bottom,
+      right,
+      text_right,
+      text_x;   /* Where the last text went, which more may be drawn over */
+
+  unsigned long bytes, /* Since the last frame */
+                bytes_total,
+                bytes_max;
+  int frames,
+      report;   /* With -b */
+};
+
+/* The framebuffer drawn into
+ *   headless (with -H), and how
+ *   long each frame took
+ */
+struct term_fb {
+  uint32_t *pix,   /* 0xRRGGBB */
+           color;
+  int w,
+      h,
+      frames;
+  double total_ms,
+         max_ms;
+};
+
+struct term_pool {
+  uint32_t *arena;
+  size_t arena_len,
+         arena_cap;
+  struct term_cluster *ents;
+  int ents_len,
+      ents_cap,
+      free;
+  int32_t hash[POOL_HASH_SIZE];
+  uint32_t gen;
+};
 
 //////////////////////////////
 // GLOBAL VARIABLES
 //
 Display *dpy;
 Window win;
-XFontSet fnt;
 int run = 1,
+    startup_bench = 0,
+    char_w = 0,
+    char_h = 0,
+    char_ascent = 0,
     pty_m,
     pty_s,
+    shell_pid = 0,
     x = 0,
     y = 0,
     x_next = 0,
@@ -102,12 +819,82 @@ int run = 1,
     term_height = 100,
     esc_ind = -2,
     cursor_style = CURSOR_STYLE,
-    viewport = 0;
+    viewport = 0,
+    buf_rows = 0,
+    buf_top = 0,
+    hist_len = 0,
+    alt_screen = 0,
+    bracketed_paste = 0,
+    x_saved = 0,
+    y_saved = 0;
+uint64_t lines_total = 0;
 uint32_t fg = FG_DEFAULT,
-         bg = BG_DEFAULT;
-char mod = 0;
+         bg = BG_DEFAULT,
+         fg_saved = FG_DEFAULT,
+         bg_saved = BG_DEFAULT,
+         fg_default = FG_DEFAULT, /* Set by OSC 10 and 11 */
+         bg_default = BG_DEFAULT;
+char mod = 0,
+     mod_saved = 0,
+     join_next = 0;
 char esc_seq[256];
+struct esc_string esc_str;
 uint128_t *screen_buf;
+struct term_grid grid_other = { 0 };
+struct term_pool pool = { .free = -1 };
+struct term_shadow shadow = { 0 };
+struct term_fb fb = { 0 };
+struct term_fonts fonts = { 0 };
+struct term_batch batch = { .gc_color = BATCH_SENT };
+char *headless = NULL,     /* Input to render, with -H */
+     *headless_out = NULL; /* Where to write the last frame */
+struct term_search search = { .current = -1 };
+struct term_selection sel = { 0 };
+struct term_osc osc = { 0 };
+struct term_paste paste = { 0 };
+struct term_mouse mouse = { 0 };
+struct term_geometry geom = { 0 };
+struct term_record rec = { 0 };
+char *replay = NULL;  /* Recording to play, with -p or -P */
+int replay_fast = 0;
+struct term_hints hint = { 0 };
+struct term_queue pty_out = { 0 },
+                  pty_sending = { 0 }; /* Being written through io_uring */
+struct term_gfx gfx = { .next_id = GFX_ID_INTERNAL };
+struct term_spill spill = { 0 };
+char *spill_dir = NULL;
+struct term_snapshot snap = { 0 };
+#ifdef TERM_URING
+struct uring ring;
+#endif
+int ring_on = 0,
+    ring_writing = 0;
+#ifdef TERM_XCB
+xcb_connection_t *xc;
+xcb_gcontext_t xgc;
+xcb_query_font_cookie_t font_cookie = { 0 }; /* Metrics asked for at startup */
+xcb_intern_atom_cookie_t atom_cookies[ATOM_COUNT];
+int atoms_ready = 0;
+#endif
+Atom atoms[ATOM_COUNT];
+char *atom_names[ATOM_COUNT] = {
+  "CLIPBOARD",
+  "UTF8_STRING",
+  "TARGETS",
+  "INCR",
+  "TERM_PASTE",
+  "_NET_WM_NAME"
+};
+int (*x_error_default)(Display*, XErrorEvent*);
+struct utf8_decoder utf8_dec;
+uint32_t *write_buf = NULL;
+int write_cap = 0;
+struct timespec time_start;
+double time_x = 0,
+       time_font = 0,
+       time_prompt = 0;
+struct timespec cursor_blink;
+int cursor_phase = 1; /* Showing, while blinking */
 
 //////////////////////////////
 // STATIC DEFINITIONS
@@ -115,14 +902,55 @@ uint128_t *screen_buf;
 // TODO: More
 //
 static void term_esc(char func, int args[256], int num, char *str);
+static void term_esc_string(struct esc_string *seq);
+static void term_osc(struct esc_string *seq);
+static void term_osc_stream(struct esc_string *seq);
+static void term_gfx_command(char *buf);
+static void term_gfx_clear(uint64_t from, uint64_t to);
+static void term_gfx_draw_row(int line);
+static uint128_t *term_row(int row);
+void term_spill_reset();
+static double term_elapsed(struct timespec *since);
+static int term_metrics_load(int *sized);
+static void term_metrics_store(int sized);
+static void term_x_init(int need_metrics);
+static void term_x_atoms();
+static void term_x_color(uint32_t color);
+static void term_x_fill(int pos_x, int pos_y, int w, int h);
+static void term_x_text(int pos_x, int pos_y, wchar_t *text, int len);
+static void term_x_copy(Drawable src, int src_x, int src_y, int w, int h, int pos_x, int pos_y);
+static void term_x_clear(int pos_x, int pos_y, int w, int h);
+static void term_x_flush();
+static void term_x_frame();
+static void term_x_free();
+static int term_cast_next(FILE *fp, char **buf, size_t *cap, double *t);
+static void term_fb_fill(int pos_x, int pos_y, int w, int h);
+static void term_fb_text(int pos_x, int pos_y, wchar_t *text, int len);
+static void term_fb_copy(int src_x, int src_y, int w, int h, int pos_x, int pos_y);
+static void term_shadow_resize();
+static void term_queue_grow(struct term_queue *q, size_t len);
+#ifdef TERM_URING
+static void term_uring_rec_drain();
+#endif
+static void term_shadow_damage(int pos_x, int pos_y, int w, int h);
 static void term_draw(int pos_x, int pos_y);
 static void term_draw_cursor();
+static int term_cursor_wait();
 static void term_redraw_line();
+static void term_redraw_lines(uint64_t from, uint64_t to);
+static void term_hint_touch(int from, int to);
 static void term_redraw();
 static void term_write(char *buf, int len);
+static void term_pty_write(const char *buf, size_t len);
+static void term_mouse_set(int mode, int on);
+static void term_mouse_flush();
+static void term_pty_flush();
+static size_t term_pty_queued();
 static void term_putchar(wchar_t wc);
 static void term_key(XKeyEvent key);
-static void term_resize();
+static void term_newline();
+static void term_resize(int width, int height);
+static void term_alt_screen(int enable, int clear);
 static void term_loop();
 static void term_shutdown();
 
@@ -154,7 +982,6 @@ void term_esc(char func, int args[ESC_MAX], int num, char *str){
     case ESC_FUNC_CURSOR_RIGHT:
       x = x_next;
       x_next += (num > 0 ? args[0] : 1);
-      term_draw_cursor();
       break;
     case ESC_FUNC_CURSOR_LEFT:
       /* Important! term writes this escape
@@ -192,15 +1019,34 @@ void term_esc(char func, int args[ESC_MAX], int num, char *str){
       }
       switch(args[0]){
         case 0:
-          memset(&screen_buf[(y*term_width)+x], 0, ((term_width*term_height)-((y*term_width)+x))*sizeof(uint128_t));
+          memset(&TERM_ROW(y)[x], 0, (term_width-x)*sizeof(uint128_t));
+          for(i=y+1;i<term_height;i++){
+            memset(TERM_ROW(i), 0, term_width*sizeof(uint128_t));
+          }
           break;
         case 1:
-          memset(screen_buf, 0, ((y*term_width)+x+1)*sizeof(uint128_t));
+          for(i=0;i<y;i++){
+            memset(TERM_ROW(i), 0, term_width*sizeof(uint128_t));
+          }
+          memset(TERM_ROW(y), 0, (x+1)*sizeof(uint128_t));
           break;
+        case 3:
+          term_gfx_clear(lines_total-TERM_HIST, lines_total-1);
+          if(!alt_screen){
+            term_spill_reset();
+            snap.full = 1;
+          }
+          hist_len = 0;
+          viewport = 0;
+          /* Fall through */
         case 2:
-          memset(screen_buf, 0, term_width*term_height*sizeof(uint128_t));
+          for(i=0;i<term_height;i++){
+            memset(TERM_ROW(i), 0, term_width*sizeof(uint128_t));
+          }
+          term_gfx_clear(lines_total, lines_total+term_height-1);
           break;
       }
+      term_hint_touch(0, term_height-1);
       term_redraw();
       break;
     case ESC_FUNC_ERASE_LINE:
@@ -209,15 +1055,16 @@ void term_esc(char func, int args[ESC_MAX], int num, char *str){
       }
       switch(args[0]){
         case 0:
-          memset(&screen_buf[(y*term_width)+x], 0, (term_width-x)*sizeof(uint128_t));
+          memset(&TERM_ROW(y)[x], 0, (term_width-x)*sizeof(uint128_t));
           break;
         case 1:
-          memset(&screen_buf[y*term_width], 0, x*sizeof(uint128_t));
+          memset(TERM_ROW(y), 0, x*sizeof(uint128_t));
           break;
         case 2:
-          memset(&screen_buf[y*term_width], 0, term_width*sizeof(uint128_t));
+          memset(TERM_ROW(y), 0, term_width*sizeof(uint128_t));
           break;
       }
+      term_hint_touch(y, y);
       term_redraw_line(TERM_CURRENT_Y);
       break;
 
@@ -226,7 +1073,7 @@ void term_esc(char func, int args[ESC_MAX], int num, char *str){
         case ESC_GFX_NOCHANGE:
           break;
         case ESC_GFX_RESET:
-          fg = FG_DEFAULT;
+          fg = fg_default;
           break;
         default:
           fg = args[0];
@@ -236,7 +1083,7 @@ void term_esc(char func, int args[ESC_MAX], int num, char *str){
         case ESC_GFX_NOCHANGE:
           break;
         case ESC_GFX_RESET:
-          bg = BG_DEFAULT;
+          bg = bg_default;
           break;
         default:
           bg = args[1];
@@ -254,27 +1101,86 @@ void term_esc(char func, int args[ESC_MAX], int num, char *str){
     case ESC_FUNC_GRAPHICS_MODE:
     case ESC_FUNC_GRAPHICS_MODE_RESET:
       if(args[0] == ESC_QUESTION){
-        if(args[1] == 25){
-          cursor_style = 
-            (func == ESC_FUNC_GRAPHICS_MODE ?
-              (cursor_style & ~TERM_CURSOR_NONE) :
-              (cursor_style | TERM_CURSOR_NONE)
-            );
-        } else if(args[1] == 2004){
-          /* TODO: Bracketed paste here? Bash 5.1 spams this whereas 5.0 did not */
+        for(i=1;i<num;i++){
+          if(args[i] == 25){
+            cursor_style =
+              (func == ESC_FUNC_GRAPHICS_MODE ?
+                (cursor_style & ~TERM_CURSOR_NONE) :
+                (cursor_style | TERM_CURSOR_NONE)
+              );
+          } else if(args[i] == 1049){
+            /* Saves the cursor and clears the
+             *   alternate screen on the way in
+             */
+            if(func == ESC_FUNC_GRAPHICS_MODE){
+              x_saved = x_next;
+              y_saved = y_next;
+              fg_saved = fg;
+              bg_saved = bg;
+              mod_saved = mod;
+              term_alt_screen(1, 1);
+            } else if(alt_screen){
+              x = x_next = x_saved;
+              y = y_next = y_saved;
+              fg = fg_saved;
+              bg = bg_saved;
+              mod = mod_saved;
+              term_alt_screen(0, 0);
+            }
+          } else if(args[i] == 47 || args[i] == 1047){
+            term_alt_screen(func == ESC_FUNC_GRAPHICS_MODE, 0);
+          } else if(args[i] == 2004){
+            bracketed_paste = (func == ESC_FUNC_GRAPHICS_MODE);
+          } else if(args[i] == 1000 || args[i] == 1002 || args[i] == 1003 || args[i] == 1006){
+            term_mouse_set(args[i], func == ESC_FUNC_GRAPHICS_MODE);
+          }
         }
       }
       break;
 
+    case ESC_FUNC_CURSOR_STYLE:
+      /* DECSCUSR (CSI Ps SP q), the
+       *   odd shapes blinking
+       */
+      if(strchr(str, ' ') == NULL){ break; }
+      switch(num > 0 ? args[0] : 0){
+        case 0:
+          i = CURSOR_STYLE;
+          break;
+        case 1:
+        case 2:
+          i = TERM_CURSOR_BLOCK;
+          break;
+        case 3:
+        case 4:
+          i = TERM_CURSOR_UNDERLINE;
+          break;
+        default:
+          i = TERM_CURSOR_LINE;
+          break;
+      }
+      if(num > 0 && args[0] % 2 == 1){
+        i |= TERM_CURSOR_BLINK;
+      }
+      cursor_style = (cursor_style & TERM_CURSOR_NONE) | i;
+      cursor_phase = 1;
+      clock_gettime(CLOCK_MONOTONIC, &cursor_blink);
+
+      /* Redrawn in the new shape */
+      term_draw(x_cur_prev, y_cur_prev);
+      break;
+
     case ESC_FUNC_DELETE:
       /* TODO */
       break;
   }
 
   if(x_next < 0) { x_next = 0; }
-  if(x_next > term_width) { x_next = term_width; }
+  if(x_next > term_width-1) { x_next = term_width-1; }
   if(y_next < 0) { y_next = 0; }
-  if(y_next > term_height) { y_next = term_height; }
+  if(y_next > term_height-1) { y_next = term_height-1; }
+  if(x > term_width-1) { x = term_width-1; }
+  if(y > term_height-1) { y = term_height-1; }
 
   printf("Escape sequence:\n String: %s\n Function: %i\n", str, func);
   for(i=0;i<num;i++){
@@ -282,12 +1188,32 @@ void term_esc(char func, int args[ESC_MAX], int num, char *str){
   }
   }
 
+/*
+ * Handle a complete string
+ * sequence (OSC, APC or DCS)
+ */
+void term_esc_string(struct esc_string *seq){
+  if(seq->overflow){ return; }
+
+  switch(seq->type){
+    case ESC_STR_OSC:
+      term_osc(seq);
+      break;
+    case ESC_STR_APC:
+      if(seq->buf[0] == 'G'){
+        term_gfx_command(seq->buf+1);
+      }
+      break;
+  }
+}
+
 //////////////////////////////
 // LOG FUNCTIONS
 //
-// TODO: varargs
-//
-void log_info(int status){
+void log_info(int status, ...){
+  va_list ap;
+
+  va_start(ap, status);
   switch(status){
     case TERM_LOG_STARTUP:
       printf("term starting up.\n");
@@ -295,7 +1221,17 @@ void log_info(int status){
     case TERM_LOG_SHUTDOWN:
       printf("term shutting down.\n");
       break;
+    case TERM_LOG_STARTUP_TIME:
+      vprintf("Startup: first prompt after %.3fms (X setup %.3fms, font %.3fms).\n", ap);
+      break;
+    case TERM_LOG_HEADLESS:
+      vprintf("Headless: %i frames, %.3fms mean, %.3fms max, %.0f bytes of requests mean, frame hash %016lx.\n", ap);
+      break;
+    case TERM_LOG_X_BYTES:
+      vprintf("X: %i frames drawn, %.0f bytes of requests mean, %lu max.\n", ap);
+      break;
   }
+  va_end(ap);
 }
 
 void log_warn(int status, char *str){
@@ -303,6 +1239,24 @@ void log_warn(int status, char *str){
     case TERM_WARN_ESC:
       printf("Warning: Unknown escape sequence \"%s\".\n", str);
       break;
+    case TERM_WARN_SPILL:
+      printf("Warning: Cannot spill scrollback to \"%s\", older lines will be dropped.\n", str);
+      break;
+    case TERM_WARN_SNAPSHOT:
+      printf("Warning: Snapshot \"%s\" is damaged or from another version, starting afresh.\n", str);
+      break;
+    case TERM_WARN_HINT:
+      printf("Warning: Hint pattern \"%s\" is invalid or too large, hints are off.\n", str);
+      break;
+    case TERM_WARN_RECORD:
+      printf("Warning: Cannot record to \"%s\", the recording is incomplete or off.\n", str);
+      break;
+    case TERM_WARN_RECORD_LOST:
+      printf("Warning: The recording fell behind, and %s bytes of output were left out of it.\n", str);
+      break;
+    case TERM_WARN_CLIPBOARD:
+      printf("Warning: A program's clipboard (OSC 52) was larger than %s bytes, and left as it was.\n", str);
+      break;
   }
 }
 
@@ -320,222 +1274,5593 @@ void log_error(int status){
     case X_FONT_SET:
       fprintf(stderr, "Error: Failed to create X font set.\n");
       break;
+    case TERM_ERR_HEADLESS:
+      fprintf(stderr, "Error: Failed to read headless input.\n");
+      break;
+    case TERM_ERR_REPLAY:
+      fprintf(stderr, "Error: Failed to read recording.\n");
+      break;
   }
   exit(status);
 }
 
 //////////////////////////////
-// TERM CORE
+// X DRAWING
 //
-void term_init(){
-  XSetWindowAttributes attrs;
-  struct winsize ws;
-  char **missing_list,
-       *def_string;
-  int missing_count;
-
-  log_info(TERM_LOG_STARTUP);
-
-  /* Screen buffer */
-  screen_buf = calloc(term_width*term_height*SCROLLBACK_SIZE, sizeof(uint128_t));
+// All drawing goes through these,
+// and none of them wait on the X
+// server: requests are buffered,
+// and sent once per pass of
+// term_loop, just before it
+// blocks. Built with TERM_XCB,
+// they are sent through XCB on
+// Xlib's connection, which also
+// lets the atoms and font be asked
+// for at startup without waiting
+// for the replies (Xlib still owns
+// the event queue, for the sake of
+// XLookupString()). Headless, they
+// draw into the framebuffer instead
+// (see HEADLESS).
+//
+// With LOW_BANDWIDTH, rectangles and
+// text are queued rather than sent
+// as they are drawn, and go out a
+// band of rows at a time: one
+// PolyFillRectangle per color, and
+// one PolyText16 per color and row
+// (per font, where fonts are mixed),
+// whose glyphs the server already
+// holds. Every request's size is
+// counted, for -b.
+//
+/*
+ * Ask for the atoms, and the font
+ * (and its metrics, if need_metrics
+ * is set), once the window exists
+ */
+void term_x_init(int need_metrics){
+#ifdef TERM_XCB
+  uint32_t values[1];
+  int i;
 
-  /* Locale */
-  setlocale(LC_ALL, "");
+  xc = XGetXCBConnection(dpy);
 
-  /* X */
-  dpy = XOpenDisplay(NULL);
-  if(dpy == NULL){
-    log_error(TERM_ERR_DISPLAY);
+  for(i=0;i<ATOM_COUNT;i++){
+    atom_cookies[i] = xcb_intern_atom(xc, 0, strlen(atom_names[i]), atom_names[i]);
   }
 
-  attrs.background_pixel = BG_DEFAULT;
-  attrs.event_mask
-    = SubstructureNotifyMask |
-      StructureNotifyMask |
-      ExposureMask |
-      KeyPressMask |
-      ButtonPressMask;
-
-  win = XCreateWindow(
-    dpy,
-    DefaultRootWindow(dpy),
-    0, 0,
-    term_width, term_height,
-    0,
-    DefaultDepth(dpy, DefaultScreen(dpy)),
-    InputOutput,
-    DefaultVisual(dpy, DefaultScreen(dpy)),
-    CWBackPixel|CWEventMask,
-    &attrs
-  );
-  XMapWindow(dpy, win);
-  XFlush(dpy);
-
-  fnt = XCreateFontSet(
-    dpy,
-    FONT_STRING,
-    &missing_list,
-    &missing_count,
-    &def_string
-  );
-  if(fnt == NULL){
-    log_error(X_FONT_SET);
+  fonts.chain[0].id = xcb_generate_id(xc);
+  xcb_open_font(xc, fonts.chain[0].id, strlen(FONT_STRING), FONT_STRING);
+  if(need_metrics){
+    font_cookie = xcb_query_font(xc, fonts.chain[0].id);
   }
-  XFreeStringList(missing_list);
 
-  /* pty */
-  if(openpty(&pty_m, &pty_s, NULL, NULL, NULL)
-      != 0){
-    log_error(TERM_ERR_PTY);
-  }
+  xgc = xcb_generate_id(xc);
+  values[0] = fonts.chain[0].id;
+  xcb_create_gc(xc, xgc, win, XCB_GC_FONT, values);
+#else
+  /* Xlib has no way to ask for the
+   *   metrics ahead: term_font_query
+   *   waits on them either way
+   */
+  (void)need_metrics;
 
-  ws.ws_col = term_width;
-  ws.ws_row = term_height;
-  ioctl(pty_m, TIOCSWINSZ, &ws);
+  XInternAtoms(dpy, atom_names, ATOM_COUNT, False, atoms);
+  fonts.chain[0].id = XLoadFont(dpy, FONT_STRING);
+  XSetFont(dpy, DefaultGC(dpy, DefaultScreen(dpy)), fonts.chain[0].id);
+#endif
+  fonts.chain[0].state = FONT_OPEN;
+}
 
-  if(fork() == 0){
-    close(pty_m);
-    setsid();
-    if(ioctl(pty_s, TIOCSCTTY, NULL) == -1){
-      log_error(TERM_ERR_TTY);
-    }
+/*
+ * Claim the atoms asked for at
+ * startup (by the time an event
+ * needs them, the replies have
+ * long since arrived)
+ */
+void term_x_atoms(){
+#ifdef TERM_XCB
+  xcb_intern_atom_reply_t *reply;
+  int i;
 
-    dup2(pty_s, STDIN_FILENO);
-    dup2(pty_s, STDOUT_FILENO);
-    dup2(pty_s, STDERR_FILENO);
-    close(pty_s);
+  if(atoms_ready){ return; }
 
-    execvp(SHELL, NULL);
-  } else {
-    close(pty_s);
+  for(i=0;i<ATOM_COUNT;i++){
+    reply = xcb_intern_atom_reply(xc, atom_cookies[i], NULL);
+    atoms[i] = (reply != NULL ? reply->atom : None);
+    free(reply);
   }
+  atoms_ready = 1;
+#endif
 }
 
-void term_draw(int pos_x, int pos_y){
-  uint128_t cell;
-  wchar_t c;
+/*
+ * Open font i of the chain (if it is
+ * not yet) and find which characters
+ * it has, measuring the cells from it
+ * if it is FONT_STRING and they are not
+ * yet known. Either waits on the server,
+ * so this is only done once a font is
+ * needed
+ */
+void term_font_query(int i){
+  struct term_font *f = &fonts.chain[i];
+  const char *name = (i == 0 ? FONT_STRING : font_fallbacks[i-1]);
+  struct timespec start;
+  unsigned b1, b2;
+  int cols,
+      ascent = 0,
+      descent = 0;
+#ifdef TERM_XCB
+  xcb_query_font_reply_t *reply = NULL;
+  xcb_generic_error_t *err;
+  xcb_charinfo_t *info = NULL;
+  int info_len = 0;
+#else
+  XFontStruct *reply = NULL;
+  XCharStruct *info = NULL;
+  int info_len = 0;
+#endif
 
-  cell = screen_buf[(pos_y*term_width)+pos_x];
-  c = cell & 0xffffffff;
+  clock_gettime(CLOCK_MONOTONIC, &start);
 
-  if(c != 0){
-    XSetForeground(
-      dpy,
-      DefaultGC(dpy, DefaultScreen(dpy)),
-      (cell >> 56) & 0xffffff
-    );
-    XFillRectangle(
-      dpy,
-      win,
-      DefaultGC(dpy, DefaultScreen(dpy)),
-      (pos_x*CHAR_W)+LEFTMOST, (pos_y-viewport)*CHAR_H,
-      CHAR_W, CHAR_H
+#ifdef TERM_XCB
+  if(f->state == FONT_CLOSED){
+    f->id = xcb_generate_id(xc);
+    if((err=xcb_request_check(xc, xcb_open_font_checked(xc, f->id, strlen(name), name))) != NULL){
+      free(err);
+      f->state = FONT_MISSING;
+      return;
+    }
+  }
+  reply = xcb_query_font_reply(
+    xc,
+    (i == 0 && font_cookie.sequence != 0 ? font_cookie : xcb_query_font(xc, f->id)),
+    NULL
+  );
+  font_cookie.sequence = 0;
+  if(reply != NULL){
+    info = xcb_query_font_char_infos(reply);
+    info_len = xcb_query_font_char_infos_length(reply);
+    ascent = reply->font_ascent;
+    descent = reply->font_descent;
+    if(i == 0 && char_w == 0){ char_w = reply->max_bounds.character_width; }
+    if(reply->min_bounds.character_width == reply->max_bounds.character_width){
+      f->advance = reply->max_bounds.character_width;
+    }
+  }
+#  define FONT_HAS(c) ((c)->character_width != 0 || (c)->ascent != 0 || (c)->descent != 0 || \
+                       (c)->left_side_bearing != 0 || (c)->right_side_bearing != 0)
+#else
+  if(f->state == FONT_CLOSED){
+    if((reply=XLoadQueryFont(dpy, name)) != NULL){
+      f->id = reply->fid;
+    }
+  } else {
+    reply = XQueryFont(dpy, f->id);
+  }
+  if(reply != NULL){
+    info = reply->per_char;
+    info_len = (info == NULL ? 0 : (reply->max_byte1-reply->min_byte1+1)*(reply->max_char_or_byte2-reply->min_char_or_byte2+1));
+    ascent = reply->ascent;
+    descent = reply->descent;
+    if(i == 0 && char_w == 0){ char_w = reply->max_bounds.width; }
+    if(reply->min_bounds.width == reply->max_bounds.width){
+      f->advance = reply->max_bounds.width;
+    }
+  }
+#  define FONT_HAS(c) ((c)->width != 0 || (c)->ascent != 0 || (c)->descent != 0 || \
+                       (c)->lbearing != 0 || (c)->rbearing != 0)
+#endif
+
+  if(reply == NULL){
+    if(i == 0){
+      log_error(X_FONT_SET);
+    }
+    f->state = FONT_MISSING;
+    return;
+  }
+
+  if(i == 0 && char_h == 0){
+    char_h = ascent+descent;
+    char_ascent = ascent;
+    term_metrics_store(0);
+    time_font = term_elapsed(&start);
+  }
+
+  /* Fonts without per-character
+   *   metrics have every character
+   *   in their range
+   */
+  f->cover = calloc(0x10000/8, 1);
+  cols = reply->max_char_or_byte2-reply->min_char_or_byte2+1;
+  for(b1=reply->min_byte1;b1<=reply->max_byte1;b1++){
+    for(b2=reply->min_char_or_byte2;b2<=reply->max_char_or_byte2;b2++){
+      if(info_len == 0 || FONT_HAS(&info[((b1-reply->min_byte1)*cols)+(b2-reply->min_char_or_byte2)])){
+        f->cover[b1 << 5 | b2 >> 3] |= 1 << (b2 & 7);
+      }
+    }
+  }
+  f->state = FONT_COVERED;
+
+#ifdef TERM_XCB
+  free(reply);
+#else
+  XFreeFontInfo(NULL, reply, 1);
+#endif
+}
+
+/*
+ * Return the font to draw a character
+ * (below U+10000) with: the first in
+ * the chain which has it, or FONT_STRING
+ * (and its default glyph) if none do
+ */
+int term_font_for(uint32_t c){
+  struct term_font *f;
+  int i;
+
+  /* FONT_STRING is taken to have ASCII */
+  if(c < 0x80){ return 0; }
+  if(fonts.of[c] != 0){ return fonts.of[c]-1; }
+
+  for(i=0;i<FONT_CHAIN;i++){
+    f = &fonts.chain[i];
+    if(f->state == FONT_CLOSED || f->state == FONT_OPEN){
+      term_font_query(i);
+    }
+    if(f->state == FONT_COVERED && f->cover[c >> 3] & (1 << (c & 7))){ break; }
+  }
+  if(i == FONT_CHAIN){ i = 0; }
+
+  fonts.of[c] = i+1;
+  return i;
+}
+
+/*
+ * Count a request of len bytes
+ * (padded as the protocol pads
+ * them) towards the frame
+ */
+void term_x_count(int len){
+  batch.bytes += (len+3) & ~3;
+}
+
+void term_x_font(int i){
+  if(i == fonts.current){ return; }
+  fonts.current = i;
+  term_x_count(16);
+#ifdef TERM_XCB
+  xcb_change_gc(xc, xgc, XCB_GC_FONT, (uint32_t[]){ fonts.chain[i].id });
+#else
+  XSetFont(dpy, DefaultGC(dpy, DefaultScreen(dpy)), fonts.chain[i].id);
+#endif
+}
+
+void term_x_gc_color(uint32_t color){
+  fb.color = color;
+  if(color == batch.gc_color){ return; }
+  batch.gc_color = color;
+  term_x_count(16);
+  if(headless){ return; }
+#ifdef TERM_XCB
+  xcb_change_gc(xc, xgc, XCB_GC_FOREGROUND, &color);
+#else
+  XSetForeground(dpy, DefaultGC(dpy, DefaultScreen(dpy)), color);
+#endif
+}
+
+/*
+ * Send the rectangles queued,
+ * one request per color
+ */
+void term_x_send_rects(){
+  XRectangle group[BATCH_RECTS];
+  uint32_t color;
+  int i, j, n;
+
+  for(i=0;i<batch.rects_len;i++){
+    if((color=batch.rect_colors[i]) == BATCH_SENT){ continue; }
+
+    for(n=0,j=i;j<batch.rects_len;j++){
+      if(batch.rect_colors[j] == color){
+        group[n++] = batch.rects[j];
+        batch.rect_colors[j] = BATCH_SENT;
+      }
+    }
+
+    term_x_gc_color(color);
+    term_x_count(12+(n*8));
+    if(headless){
+      for(j=0;j<n;j++){
+        term_fb_fill(group[j].x, group[j].y, group[j].width, group[j].height);
+      }
+      continue;
+    }
+#ifdef TERM_XCB
+    xcb_poly_fill_rectangle(xc, win, xgc, n, (xcb_rectangle_t*)group);
+#else
+    XFillRectangles(dpy, win, DefaultGC(dpy, DefaultScreen(dpy)), group, n);
+#endif
+  }
+  batch.rects_len = 0;
+}
+
+/*
+ * Send the text queued in the color
+ * and at the baseline of texts[first],
+ * as PolyText16 requests whose items
+ * step along the row by their font's
+ * advance, so that a row takes one
+ * unless its fonts differ
+ */
+void term_x_send_text(int first){
+  struct term_batch_text *t;
+  uint32_t color = batch.texts[first].color,
+           c;
+  wchar_t text[256];
+  int pos_y = batch.texts[first].y,
+      pos_x = 0,
+      pen = -1,
+      font = 0,
+      len = 0,
+      delta,
+      i, j;
+#ifdef TERM_XCB
+  uint8_t items[BATCH_TEXT_BYTES];
+  int last = 0; /* Where the last item starts */
+#else
+  XTextItem16 items[BATCH_TEXT_BYTES/4];
+  XChar2b chars[BATCH_TEXT_BYTES/2];
+  int items_len = 0,
+      chars_len = 0;
+#endif
+
+  term_x_gc_color(color);
+  for(i=first;i<=batch.texts_len;i++){
+    t = &batch.texts[i];
+    if(i < batch.texts_len && (t->color != color || t->y != pos_y)){ continue; }
+
+    /* A request ends after the last item,
+     *   or where the next cannot step on
+     *   from it (another font, or one
+     *   whose glyphs' widths differ)
+     */
+    delta = (i < batch.texts_len ? t->x-pen : 0);
+    if(len > 0 &&
+       (i == batch.texts_len ||
+        pen < 0 || t->font != font ||
+        delta < -127 || delta > 127*4 ||
+        len+8+2+(t->len*2) > BATCH_TEXT_BYTES)){
+      term_x_count(16+len);
+      if(!headless){
+        term_x_font(font);
+#ifdef TERM_XCB
+        xcb_poly_text_16(xc, win, xgc, pos_x, pos_y, len, items);
+#else
+        XDrawText16(dpy, win, DefaultGC(dpy, DefaultScreen(dpy)), pos_x, pos_y, items, items_len);
+        items_len = chars_len = 0;
+#endif
+      }
+      len = 0;
+    }
+    if(i == batch.texts_len){ break; }
+
+    if(len == 0){
+      pos_x = t->x;
+      font = t->font;
+      delta = 0;
+    }
+    t->color = BATCH_SENT;
+
+    if(headless){
+      for(j=0;j<t->len;j++){
+        text[j] = batch.glyphs[t->off+j];
+      }
+      term_fb_text(t->x, t->y, text, t->len);
+    }
+
+    /* Text carrying on from the last
+     *   item joins it
+     */
+#ifdef TERM_XCB
+    if(delta == 0 && len > 0 && items[last]+t->len <= 254){
+      items[last] += t->len;
+    } else {
+      /* Items step at most 127 pixels */
+      for(;delta>127;delta-=127){
+        items[len++] = 0;
+        items[len++] = 127;
+      }
+      last = len;
+      items[len++] = t->len;
+      items[len++] = (uint8_t)(int8_t)delta;
+    }
+    for(j=0;j<t->len;j++){
+      c = batch.glyphs[t->off+j];
+      c = (c > 0xffff ? 0xfffd : c);
+      items[len++] = c >> 8;
+      items[len++] = c & 0xff;
+    }
+#else
+    if(delta == 0 && len > 0 && items[items_len-1].nchars+t->len <= 254){
+      items[items_len-1].nchars += t->len;
+      len += t->len*2;
+    } else {
+      len += ((delta > 127 ? (delta-1)/127 : 0)*2)+2+(t->len*2);
+      items[items_len].chars = &chars[chars_len];
+      items[items_len].nchars = t->len;
+      items[items_len].delta = delta;
+      items[items_len++].font = None;
+    }
+    for(j=0;j<t->len;j++){
+      c = batch.glyphs[t->off+j];
+      c = (c > 0xffff ? 0xfffd : c);
+      chars[chars_len].byte1 = c >> 8;
+      chars[chars_len++].byte2 = c & 0xff;
+    }
+#endif
+
+    pen = (fonts.chain[font].advance > 0 ? t->x+(t->len*fonts.chain[font].advance) : -1);
+  }
+}
+
+/*
+ * Send everything queued
+ */
+void term_x_flush(){
+  int i;
+
+  term_x_send_rects();
+  for(i=0;i<batch.texts_len;i++){
+    if(batch.texts[i].color != BATCH_SENT){
+      term_x_send_text(i);
+    }
+  }
+  batch.texts_len = 0;
+  batch.glyphs_len = 0;
+}
+
+/*
+ * Make room in the queue for drawing
+ * over an area, first sending what is
+ * queued if it might overlap: anything
+ * drawn above the band being drawn,
+ * or left of what is queued in it
+ * (text need only be right of other
+ * text, or at the same place, like
+ * combining marks)
+ */
+void term_x_room(int pos_x, int pos_y, int w, int h, int text){
+  if(batch.rects_len+batch.texts_len > 0 &&
+     pos_y < batch.bottom &&
+     !(pos_y >= batch.top && pos_y+h <= batch.bottom &&
+       (text ? pos_x >= batch.text_right || pos_x == batch.text_x : pos_x >= batch.right))){
+    term_x_flush();
+  }
+
+  if(batch.rects_len+batch.texts_len == 0 || pos_y >= batch.bottom){
+    batch.top = pos_y;
+    batch.bottom = pos_y+h;
+    batch.right = pos_x;
+    batch.text_right = pos_x;
+  }
+  if(pos_x+w > batch.right){
+    batch.right = pos_x+w;
+  }
+  if(text && pos_x+w > batch.text_right){
+    batch.text_right = pos_x+w;
+  }
+  batch.text_x = (text ? pos_x : -1);
+}
+
+/*
+ * Send what has been drawn since
+ * the last frame, once per pass of
+ * term_loop, counting its bytes
+ */
+void term_x_frame(){
+  term_x_flush();
+
+  if(batch.bytes > 0){
+    batch.frames++;
+    batch.bytes_total += batch.bytes;
+    if(batch.bytes > batch.bytes_max){ batch.bytes_max = batch.bytes; }
+    batch.bytes = 0;
+  }
+
+  if(!headless){
+    XFlush(dpy);
+  }
+}
+
+void term_x_color(uint32_t color){
+  batch.color = color;
+}
+
+void term_x_fill(int pos_x, int pos_y, int w, int h){
+  XRectangle *last;
+
+  if(batch.rects_len == BATCH_RECTS){
+    term_x_flush();
+  }
+  term_x_room(pos_x, pos_y, w, h, 0);
+  last = &batch.rects[(batch.rects_len > 0 ? batch.rects_len-1 : 0)];
+
+  /* A run of cells in one color
+   *   is one rectangle
+   */
+  if(batch.rects_len > 0 &&
+     batch.rect_colors[batch.rects_len-1] == batch.color &&
+     last->y == pos_y && last->height == h &&
+     last->x+last->width == pos_x){
+    last->width += w;
+  } else {
+    batch.rects[batch.rects_len] = (XRectangle){ pos_x, pos_y, w, h };
+    batch.rect_colors[batch.rects_len++] = batch.color;
+  }
+
+  if(!LOW_BANDWIDTH){
+    term_x_flush();
+  }
+}
+
+/*
+ * Draw text (in the foreground
+ * color only) with its baseline
+ * at pos_y
+ */
+void term_x_text(int pos_x, int pos_y, wchar_t *text, int len){
+  struct term_batch_text *t;
+  uint32_t c;
+  int cells = len,
+      off, n, font;
+
+  if(batch.texts_len+len > BATCH_TEXTS || batch.glyphs_len+len > BATCH_GLYPHS){
+    term_x_flush();
+  }
+
+  for(n=0;n<len;n++){
+    if(text[n] >= 0x300 && width_lookup(text[n]) == 2){ cells++; }
+  }
+  term_x_room(pos_x, pos_y-char_ascent, cells*char_w, char_h, 1);
+
+  /* Each run is drawn with the font
+   *   its characters are found in
+   *   (core fonts index by 16 bits,
+   *   and items hold 254 of them)
+   */
+  for(off=0;off<len;off+=n){
+    font = -1;
+    for(n=0;off+n<len && n<254;n++){
+      c = (text[off+n] > 0xffff ? 0xfffd : text[off+n]);
+      if(headless){
+        font = 0;
+      } else if(font < 0){
+        font = term_font_for(c);
+      } else if(term_font_for(c) != font){
+        break;
+      }
+      batch.glyphs[batch.glyphs_len+n] = text[off+n];
+    }
+
+    t = &batch.texts[batch.texts_len++];
+    t->x = pos_x+(off*char_w);
+    t->y = pos_y;
+    t->color = batch.color;
+    t->off = batch.glyphs_len;
+    t->len = n;
+    t->font = font;
+    batch.glyphs_len += n;
+  }
+
+  if(!LOW_BANDWIDTH){
+    term_x_flush();
+  }
+}
+
+/*
+ * Copy an area of src (the window
+ * or an image's Pixmap) to the
+ * window
+ */
+void term_x_copy(Drawable src, int src_x, int src_y, int w, int h, int pos_x, int pos_y){
+  term_x_flush();
+  term_x_count(28);
+  if(headless){
+    term_fb_copy(src_x, src_y, w, h, pos_x, pos_y);
+    return;
+  }
+#ifdef TERM_XCB
+  xcb_copy_area(xc, src, win, xgc, src_x, src_y, pos_x, pos_y, w, h);
+#else
+  XCopyArea(dpy, src, win, DefaultGC(dpy, DefaultScreen(dpy)), src_x, src_y, w, h, pos_x, pos_y);
+#endif
+}
+
+/*
+ * Clear an area to the background,
+ * or the whole window if w and h
+ * are 0
+ */
+void term_x_clear(int pos_x, int pos_y, int w, int h){
+  term_x_flush();
+  term_x_count(16);
+  if(headless){
+    fb.color = bg_default;
+    term_fb_fill(pos_x, pos_y, (w == 0 ? fb.w : w), (h == 0 ? fb.h : h));
+    return;
+  }
+#ifdef TERM_XCB
+  xcb_clear_area(xc, 0, win, pos_x, pos_y, w, h);
+#else
+  XClearArea(dpy, win, pos_x, pos_y, w, h, False);
+#endif
+}
+
+void term_x_free(){
+  int i;
+
+  for(i=0;i<FONT_CHAIN;i++){
+    if(fonts.chain[i].state == FONT_OPEN || fonts.chain[i].state == FONT_COVERED){
+#ifdef TERM_XCB
+      xcb_close_font(xc, fonts.chain[i].id);
+#else
+      XUnloadFont(dpy, fonts.chain[i].id);
+#endif
+    }
+    free(fonts.chain[i].cover);
+  }
+#ifdef TERM_XCB
+  xcb_free_gc(xc, xgc);
+#endif
+}
+
+//////////////////////////////
+// HEADLESS
+//
+// With -H file, the bytes in file
+// are rendered as if the shell had
+// written them, a read at a time,
+// into an in-memory framebuffer
+// rather than a window, through the
+// same drawing code. The last frame
+// can be written out as a PPM, and
+// its hash is reported (along with
+// how long frames took to render)
+// for golden tests and benchmarks.
+//
+void term_fb_resize(){
+  fb.w = (term_width*char_w)+LEFTMOST;
+  fb.h = term_height*char_h;
+  fb.pix = realloc(fb.pix, (size_t)fb.w*fb.h*sizeof(uint32_t));
+  fb.color = bg_default;
+  term_fb_fill(0, 0, fb.w, fb.h);
+}
+
+void term_fb_fill(int pos_x, int pos_y, int w, int h){
+  int x_i, y_i;
+
+  if(pos_x < 0){ w += pos_x; pos_x = 0; }
+  if(pos_y < 0){ h += pos_y; pos_y = 0; }
+  if(pos_x+w > fb.w){ w = fb.w-pos_x; }
+  if(pos_y+h > fb.h){ h = fb.h-pos_y; }
+
+  for(y_i=pos_y;y_i<pos_y+h;y_i++){
+    for(x_i=pos_x;x_i<pos_x+w;x_i++){
+      fb.pix[((size_t)y_i*fb.w)+x_i] = fb.color;
+    }
+  }
+}
+
+/*
+ * Draw each glyph as its code
+ * point's bits (hashed), in a
+ * 4x8 box above the baseline
+ */
+void term_fb_text(int pos_x, int pos_y, wchar_t *text, int len){
+  uint32_t bits;
+  int i, b;
+
+  for(i=0;i<len;i++){
+    if(text[i] == ' '){ continue; }
+    bits = (uint32_t)text[i]*0x9e3779b1;
+    for(b=0;b<32;b++){
+      if(bits & (1u << b)){
+        term_fb_fill(pos_x+(i*char_w)+1+(b & 3), pos_y-char_ascent+2+(b >> 2), 1, 1);
+      }
+    }
+  }
+}
+
+void term_fb_copy(int src_x, int src_y, int w, int h, int pos_x, int pos_y){
+  int y_i, b;
+
+  if(src_x < 0 || src_y < 0 || pos_x < 0 || pos_y < 0){ return; }
+  if(src_x+w > fb.w || pos_x+w > fb.w){ w = fb.w-(src_x > pos_x ? src_x : pos_x); }
+  if(src_y+h > fb.h || pos_y+h > fb.h){ h = fb.h-(src_y > pos_y ? src_y : pos_y); }
+  if(w <= 0 || h <= 0){ return; }
+
+  /* Rows are copied in the order
+   *   which leaves overlapping
+   *   ones intact
+   */
+  for(y_i=0;y_i<h;y_i++){
+    b = (pos_y > src_y ? h-1-y_i : y_i);
+    memmove(
+      &fb.pix[((size_t)(pos_y+b)*fb.w)+pos_x],
+      &fb.pix[((size_t)(src_y+b)*fb.w)+src_x],
+      w*sizeof(uint32_t)
+    );
+  }
+}
+
+uint64_t term_fb_hash(){
+  uint64_t h = 0xcbf29ce484222325;
+  size_t i;
+
+  for(i=0;i<(size_t)fb.w*fb.h;i++){
+    h = (h ^ fb.pix[i]) * 0x100000001b3;
+  }
+  return h;
+}
+
+void term_fb_write(const char *path){
+  FILE *f;
+  size_t i;
+
+  if((f=fopen(path, "wb")) == NULL){ return; }
+  fprintf(f, "P6\n%i %i\n255\n", fb.w, fb.h);
+  for(i=0;i<(size_t)fb.w*fb.h;i++){
+    fputc((fb.pix[i] >> 16) & 0xff, f);
+    fputc((fb.pix[i] >> 8) & 0xff, f);
+    fputc(fb.pix[i] & 0xff, f);
+  }
+  fclose(f);
+}
+
+/*
+ * Render the input a read at a
+ * time (or, for a recording, an
+ * event at a time, as fast as it
+ * can), timing each frame
+ */
+void term_headless_run(){
+  struct timespec start;
+  FILE *fp;
+  char *buf = NULL;
+  size_t cap = ESC_MAX;
+  double ms, t;
+  int len, cast;
+
+  if((fp=fopen(headless, "r")) == NULL){
+    log_error(TERM_ERR_HEADLESS);
+  }
+  buf = malloc(cap);
+
+  cast = (fgetc(fp) == '{');
+  rewind(fp);
+
+  for(;;){
+    if(cast){
+      if((len=term_cast_next(fp, &buf, &cap, &t)) < 0){ break; }
+    } else if((len=fread(buf, 1, ESC_MAX, fp)) == 0){
+      break;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    term_write(buf, len);
+    term_mouse_flush();
+    term_draw_cursor();
+    term_x_frame();
+    ms = term_elapsed(&start);
+
+    fb.frames++;
+    fb.total_ms += ms;
+    if(ms > fb.max_ms){ fb.max_ms = ms; }
+  }
+  fclose(fp);
+  free(buf);
+
+  if(headless_out != NULL){
+    term_fb_write(headless_out);
+  }
+  log_info(
+    TERM_LOG_HEADLESS,
+    fb.frames,
+    (fb.frames > 0 ? fb.total_ms/fb.frames : 0.0),
+    fb.max_ms,
+    (batch.frames > 0 ? (double)batch.bytes_total/batch.frames : 0.0),
+    term_fb_hash()
+  );
+}
+
+//////////////////////////////
+// GRAPHEME POOL
+//
+// Clusters which do not fit in a
+// single cell (stacked combining
+// marks, ZWJ emoji sequences) are
+// interned into one arena and
+// referenced from cells by index.
+// Nothing is freed eagerly: once
+// the arena fills, clusters no
+// longer referenced by any cell
+// are swept and the rest compacted.
+//
+uint32_t pool_hash(const uint32_t *cps, int len){
+  uint32_t h = 2166136261u;
+  int i;
+
+  for(i=0;i<len;i++){
+    h = (h ^ cps[i]) * 16777619u;
+  }
+  return h;
+}
+
+void pool_collect(){
+  uint32_t *arena;
+  size_t i, cells = (size_t)buf_rows*term_width,
+         other = (size_t)grid_other.rows*term_width;
+  int e;
+
+  /* Mark (both screens) */
+  pool.gen++;
+  for(i=0;i<cells;i++){
+    if(CELL_IS_CLUSTER(screen_buf[i])){
+      pool.ents[CELL_CLUSTER(screen_buf[i])].gen = pool.gen;
+    }
+  }
+  for(i=0;i<other;i++){
+    if(CELL_IS_CLUSTER(grid_other.buf[i])){
+      pool.ents[CELL_CLUSTER(grid_other.buf[i])].gen = pool.gen;
+    }
+  }
+
+  /* (and spilled rows read back, which
+   *   may still be in use)
+   */
+  for(e=0;e<2;e++){
+    for(i=0;i<(size_t)spill.scratch_width;i++){
+      if(CELL_IS_CLUSTER(spill.scratch[e][i])){
+        pool.ents[CELL_CLUSTER(spill.scratch[e][i])].gen = pool.gen;
+      }
+    }
+  }
+
+  /* (and what is on screen, so that the
+   *   shadow grid's keys stay valid)
+   */
+  for(i=0;i<(size_t)shadow.width*shadow.height;i++){
+    if(CELL_IS_CLUSTER(shadow.cells[i]) && !SHADOW_MARK(shadow.cells[i])){
+      pool.ents[CELL_CLUSTER(shadow.cells[i])].gen = pool.gen;
+    }
+  }
+
+  /* Sweep and compact */
+  arena = malloc((pool.arena_cap > 0 ? pool.arena_cap : 1)*sizeof(uint32_t));
+  pool.arena_len = 0;
+  pool.free = -1;
+  memset(pool.hash, 0xff, sizeof(pool.hash));
+
+  for(e=pool.ents_len-1;e>=0;e--){
+    if(pool.ents[e].len > 0 && pool.ents[e].gen == pool.gen){
+      memcpy(&arena[pool.arena_len], &pool.arena[pool.ents[e].off], pool.ents[e].len*sizeof(uint32_t));
+      pool.ents[e].off = pool.arena_len;
+      pool.ents[e].next = pool.hash[pool.ents[e].hash & (POOL_HASH_SIZE-1)];
+      pool.hash[pool.ents[e].hash & (POOL_HASH_SIZE-1)] = e;
+      pool.arena_len += pool.ents[e].len;
+    } else {
+      pool.ents[e].len = 0;
+      pool.ents[e].next = pool.free;
+      pool.free = e;
+    }
+  }
+
+  free(pool.arena);
+  pool.arena = arena;
+}
+
+/*
+ * Return the index of the
+ * cluster holding code points
+ * cps, adding it if necessary
+ */
+int pool_intern(const uint32_t *cps, int len){
+  uint32_t h = pool_hash(cps, len);
+  int e;
+
+  if(pool.arena != NULL){
+    for(e=pool.hash[h & (POOL_HASH_SIZE-1)];e!=-1;e=pool.ents[e].next){
+      if(pool.ents[e].hash == h &&
+         pool.ents[e].len == len &&
+         memcmp(&pool.arena[pool.ents[e].off], cps, len*sizeof(uint32_t)) == 0){
+        return e;
+      }
+    }
+  }
+
+  if(pool.arena_len+len > pool.arena_cap){
+    pool_collect();
+
+    /* Grow when mostly live even after collecting */
+    if(pool.arena_len+len > pool.arena_cap/2){
+      pool.arena_cap = (pool.arena_cap > 0 ? pool.arena_cap*2 : POOL_ARENA_MIN);
+      pool.arena = realloc(pool.arena, pool.arena_cap*sizeof(uint32_t));
+    }
+  }
+
+  if(pool.free != -1){
+    e = pool.free;
+    pool.free = pool.ents[e].next;
+  } else {
+    if(pool.ents_len == pool.ents_cap){
+      pool.ents_cap = (pool.ents_cap > 0 ? pool.ents_cap*2 : POOL_ARENA_MIN/4);
+      pool.ents = realloc(pool.ents, pool.ents_cap*sizeof(struct term_cluster));
+    }
+    e = pool.ents_len++;
+  }
+
+  memcpy(&pool.arena[pool.arena_len], cps, len*sizeof(uint32_t));
+  pool.ents[e].off = pool.arena_len;
+  pool.ents[e].len = len;
+  pool.ents[e].hash = h;
+  pool.ents[e].gen = pool.gen;
+  pool.ents[e].next = pool.hash[h & (POOL_HASH_SIZE-1)];
+  pool.hash[h & (POOL_HASH_SIZE-1)] = e;
+  pool.arena_len += len;
+
+  return e;
+}
+
+/*
+ * Write the code points making
+ * up a cell into out (which must
+ * hold POOL_CLUSTER_MAX entries),
+ * returning how many there are
+ */
+int term_cell_text(uint128_t cell, uint32_t *out){
+  struct term_cluster *ent;
+
+  if(CELL_IS_CLUSTER(cell)){
+    ent = &pool.ents[CELL_CLUSTER(cell)];
+    memcpy(out, &pool.arena[ent->off], ent->len*sizeof(uint32_t));
+    return ent->len;
+  }
+
+  out[0] = CELL_CHAR(cell);
+  if(out[0] == 0){ return 0; }
+  if((out[1]=CELL_COMB(cell)) != 0){ return 2; }
+  return 1;
+}
+
+/*
+ * Return a cell which does not
+ * refer to the pool, for keeping
+ * outside of the grid (clusters
+ * keep only their first two code
+ * points)
+ */
+uint128_t term_cell_flatten(uint128_t cell){
+  uint32_t text[POOL_CLUSTER_MAX];
+  uint128_t out;
+
+  if(!CELL_IS_CLUSTER(cell)){ return cell; }
+
+  term_cell_text(cell, text);
+  out = CELL_ATTRS(cell) | ((uint128_t)CELL_FLAGS(cell) << 88) | text[0];
+  if(pool.ents[CELL_CLUSTER(cell)].len > 1){
+    CELL_SET_COMB(out, text[1]);
+  }
+  return out;
+}
+
+//////////////////////////////
+// SCROLLBACK SPILL
+//
+// With -S, rows pushed out of the
+// scrollback ring are appended to
+// a pair of memory-mapped files
+// instead of being dropped, and
+// read back straight from the
+// mappings. As the files grow,
+// the kernel is told that all but
+// the most recently written part
+// is cold, which keeps the
+// resident size bounded however
+// long the history gets.
+//
+void term_spill_close(){
+  if(spill.dat != NULL){ munmap(spill.dat, spill.dat_cap); }
+  if(spill.idx != NULL){ munmap(spill.idx, spill.idx_cap); }
+  if(spill.fd_dat > 0){
+    close(spill.fd_dat);
+    unlink(spill.path_dat);
+  }
+  if(spill.fd_idx > 0){
+    close(spill.fd_idx);
+    unlink(spill.path_idx);
+  }
+  free(spill.scratch[0]);
+  free(spill.scratch[1]);
+
+  memset(&spill, 0, sizeof(spill));
+}
+
+void term_spill_open(const char *dir){
+  snprintf(spill.path_dat, sizeof(spill.path_dat), "%s/term-spill-%i.dat", dir, (int)getpid());
+  snprintf(spill.path_idx, sizeof(spill.path_idx), "%s/term-spill-%i.idx", dir, (int)getpid());
+
+  spill.fd_dat = open(spill.path_dat, O_RDWR|O_CREAT|O_TRUNC, 0600);
+  spill.fd_idx = open(spill.path_idx, O_RDWR|O_CREAT|O_TRUNC, 0600);
+  if(spill.fd_dat < 0 || spill.fd_idx < 0){
+    log_warn(TERM_WARN_SPILL, (char*)dir);
+    term_spill_close();
+    return;
+  }
+  spill.on = 1;
+}
+
+/*
+ * Grow a mapped file to hold at
+ * least size bytes, returning
+ * the new mapping (or NULL)
+ */
+void *term_spill_grow(int fd, void *map, size_t *cap, size_t size){
+  size_t want = (*cap > 0 ? *cap : SPILL_GROW);
+
+  while(want < size){ want *= 2; }
+
+  if(map != NULL){
+    munmap(map, *cap);
+  }
+  *cap = 0;
+  if(ftruncate(fd, want) != 0){ return NULL; }
+  if((map=mmap(NULL, want, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED){ return NULL; }
+
+  *cap = want;
+  return map;
+}
+
+/*
+ * Mark everything but the last
+ * SPILL_HOT_BYTES (of row data,
+ * and proportionally of the
+ * index) as cold
+ */
+void term_spill_advise(){
+  size_t page = sysconf(_SC_PAGESIZE),
+         hot_idx = (size_t)((spill.len*(double)SPILL_HOT_BYTES)/spill.dat_len)*sizeof(uint64_t),
+         end;
+
+  if(spill.dat_len > SPILL_HOT_BYTES){
+    end = (spill.dat_len-SPILL_HOT_BYTES) & ~(page-1);
+    madvise(spill.dat, end, SPILL_ADVICE);
+  }
+  if(spill.len*sizeof(uint64_t) > hot_idx){
+    end = ((spill.len*sizeof(uint64_t))-hot_idx) & ~(page-1);
+    madvise(spill.idx, end, SPILL_ADVICE);
+  }
+
+  spill.advised = spill.dat_len;
+}
+
+void term_spill_reset(){
+  if(!spill.on){ return; }
+
+  spill.len = 0;
+  spill.dat_len = 0;
+  spill.advised = 0;
+  spill.scratch_key[0] = spill.scratch_key[1] = 0;
+  if(spill.dat != NULL){ madvise(spill.dat, spill.dat_cap, MADV_DONTNEED); }
+  if(spill.idx != NULL){ madvise(spill.idx, spill.idx_cap, MADV_DONTNEED); }
+}
+
+/*
+ * Append a row, just before it
+ * is dropped from the ring
+ */
+void term_spill_push(uint128_t *cells){
+  struct term_spill_row *row;
+  uint128_t *out;
+  uint32_t *text;
+  size_t need;
+  int len = term_width,
+      n = 0,
+      i;
+
+  if(spill.len == SPILL_LINES){
+    term_spill_reset();
+  }
+
+  while(len > 0 && cells[len-1] == 0){
+    len--;
+  }
+  for(i=0;i<len;i++){
+    if(CELL_IS_CLUSTER(cells[i])){
+      n += 1+pool.ents[CELL_CLUSTER(cells[i])].len;
+    }
+  }
+  need = sizeof(struct term_spill_row)+(len*sizeof(uint128_t))+(((n*sizeof(uint32_t))+15) & ~15);
+
+  if(spill.dat_len+need > spill.dat_cap){
+    spill.dat = term_spill_grow(spill.fd_dat, spill.dat, &spill.dat_cap, spill.dat_len+need);
+  }
+  if((spill.len+1)*sizeof(uint64_t) > spill.idx_cap){
+    spill.idx = term_spill_grow(spill.fd_idx, spill.idx, &spill.idx_cap, (spill.len+1)*sizeof(uint64_t));
+  }
+  if(spill.dat == NULL || spill.idx == NULL){
+    /* Out of space: the history
+     *   spilled so far goes too
+     */
+    log_warn(TERM_WARN_SPILL, spill.path_dat);
+    term_spill_close();
+    return;
+  }
+
+  row = (struct term_spill_row*)&spill.dat[spill.dat_len];
+  row->width = term_width;
+  row->len = len;
+  row->text = n;
+  out = (uint128_t*)(row+1);
+  text = (uint32_t*)(out+len);
+
+  n = 0;
+  for(i=0;i<len;i++){
+    out[i] = cells[i];
+    if(CELL_IS_CLUSTER(cells[i])){
+      text[n] = term_cell_text(cells[i], &text[n+1]);
+      out[i] = (cells[i] & ~(uint128_t)0xffffffff) | POOL_TAG | n;
+      n += 1+text[n];
+    }
+  }
+
+  spill.idx[spill.len++] = spill.dat_len;
+  spill.dat_len += need;
+
+  if(spill.dat_len-spill.advised >= SPILL_HOT_BYTES){
+    term_spill_advise();
+  }
+}
+
+/*
+ * Return spilled row k (counting
+ * from the oldest), straight
+ * from the mapping when it was
+ * spilled whole at the current
+ * width with no clusters, or else
+ * filled out (with its clusters
+ * back in the pool)
+ */
+uint128_t *term_spill_row(uint64_t k){
+  struct term_spill_row *row = (struct term_spill_row*)&spill.dat[spill.idx[k]];
+  uint128_t *cells = (uint128_t*)(row+1),
+            *out;
+  uint32_t *text = (uint32_t*)(cells+row->len);
+  int len = ((int)row->len < term_width ? (int)row->len : term_width),
+      slot, i;
+
+  if(row->width == (uint32_t)term_width && row->len == row->width && row->text == 0){
+    return cells;
+  }
+
+  if(spill.scratch_width != term_width){
+    for(slot=0;slot<2;slot++){
+      spill.scratch[slot] = realloc(spill.scratch[slot], term_width*sizeof(uint128_t));
+      memset(spill.scratch[slot], 0, term_width*sizeof(uint128_t));
+      spill.scratch_key[slot] = 0;
+    }
+    spill.scratch_width = term_width;
+  }
+  for(slot=0;slot<2;slot++){
+    if(spill.scratch_key[slot] == k+1){
+      return spill.scratch[slot];
+    }
+  }
+
+  slot = (spill.scratch_next++ & 1);
+  out = spill.scratch[slot];
+  memset(out, 0, term_width*sizeof(uint128_t));
+
+  /* (cluster cells are only written once
+   *   interned, since interning may sweep
+   *   the pool, scratch rows included)
+   */
+  for(i=0;i<len;i++){
+    if(CELL_IS_CLUSTER(cells[i])){
+      out[i] = (cells[i] & ~(uint128_t)0xffffffff) | POOL_TAG |
+               pool_intern(&text[CELL_CLUSTER(cells[i])+1], text[CELL_CLUSTER(cells[i])]);
+    } else {
+      out[i] = cells[i];
+    }
+  }
+  spill.scratch_key[slot] = k+1;
+  return out;
+}
+
+/*
+ * Return a row for reading, which
+ * (on the primary screen) may be
+ * older than the scrollback ring
+ */
+uint128_t *term_row(int row){
+  if(row >= -hist_len || alt_screen){
+    return TERM_ROW(row);
+  }
+  return term_spill_row(spill.len+hist_len+row);
+}
+
+//////////////////////////////
+// SESSION SNAPSHOTS
+//
+// With -s, the primary screen and
+// its scrollback are kept in a log
+// of records on disk. Every so
+// often, the rows which changed
+// since the last snapshot (found
+// by comparing row hashes) are
+// appended to it by a forked
+// child, so writing never holds
+// up drawing. Once the appended
+// rows outgrow the full snapshot
+// the log started with, a fresh
+// one is written and renamed over
+// it. Restoring is a single pass
+// over the mapped file, indexing
+// the rows of each complete
+// snapshot by line, after which
+// the lines kept are copied out.
+// Spilled history (with -S) is
+// written and restored too.
+//
+// Only the grid and the cursor are
+// restored, since the shell which
+// set the rest is gone.
+//
+uint64_t term_snap_hash(uint128_t *cells){
+  uint64_t h = 0xcbf29ce484222325;
+  uint128_t cell;
+  int i;
+
+  for(i=0;i<term_width;i++){
+    cell = term_cell_flatten(cells[i]);
+    h = (h ^ (uint64_t)cell) * 0x100000001b3;
+    h = (h ^ (uint64_t)(cell >> 64)) * 0x100000001b3;
+  }
+  return h;
+}
+
+/*
+ * Buffered writes for the snapshot
+ * child, returning 0 on failure
+ */
+struct term_snap_out {
+  int fd,
+      ok;
+  size_t len;
+  char buf[65536];
+};
+
+void term_snap_flush(struct term_snap_out *out){
+  size_t off = 0;
+  ssize_t n;
+
+  while(out->ok && off < out->len){
+    if((n=write(out->fd, out->buf+off, out->len-off)) < 0){
+      if(errno == EINTR){ continue; }
+      out->ok = 0;
+      break;
+    }
+    off += n;
+  }
+  out->len = 0;
+}
+
+void term_snap_put(struct term_snap_out *out, const void *data, size_t len){
+  size_t n;
+
+  while(len > 0){
+    if(out->len == sizeof(out->buf)){
+      term_snap_flush(out);
+    }
+    n = sizeof(out->buf)-out->len;
+    if(n > len){ n = len; }
+    memcpy(out->buf+out->len, data, n);
+    out->len += n;
+    data = (const char*)data+n;
+    len -= n;
+  }
+}
+
+void term_snap_put_row(struct term_snap_out *out, uint64_t line){
+  struct term_snap_rec rec = { .type = SNAP_REC_ROW };
+  struct term_snap_row row = { line, term_width, term_width };
+  uint128_t *cells = term_row((int)(line-lines_total)),
+            cell;
+  int i;
+
+  while(row.len > 0 && cells[row.len-1] == 0){
+    row.len--;
+  }
+  rec.len = sizeof(row)+(row.len*sizeof(uint128_t));
+
+  term_snap_put(out, &rec, sizeof(rec));
+  term_snap_put(out, &row, sizeof(row));
+  for(i=0;i<(int)row.len;i++){
+    cell = term_cell_flatten(cells[i]);
+    term_snap_put(out, &cell, sizeof(cell));
+  }
+}
+
+/*
+ * Write a snapshot: either every
+ * row, to a new file replacing
+ * the old, or just snap.lines,
+ * appended to it
+ */
+int term_snap_write(int full){
+  struct term_snap_out *out;
+  struct term_snap_header hdr = { SNAP_MAGIC, SNAP_VERSION, sizeof(uint128_t) };
+  struct term_snap_rec rec = { SNAP_REC_STATE, sizeof(struct term_snap_state) };
+  struct term_snap_state state = {
+    .lines_total = lines_total,
+    .width = term_width,
+    .height = term_height,
+    .hist = TERM_HIST,
+    .x = x_next,
+    .y = y_next,
+    .x_saved = x_saved,
+    .y_saved = y_saved,
+    .cursor_style = cursor_style,
+    .bracketed_paste = bracketed_paste,
+    .fg = fg,
+    .bg = bg,
+    .mod = mod
+  };
+  char tmp[PATH_MAX];
+  uint64_t line;
+  int ok, i;
+
+  if((out=malloc(sizeof(struct term_snap_out))) == NULL){ return 0; }
+  out->len = 0;
+  out->ok = 1;
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", snap.path);
+  out->fd = (full ? open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0600) : open(snap.path, O_WRONLY|O_APPEND));
+  if(out->fd < 0){
+    free(out);
+    return 0;
+  }
+
+  if(full){
+    term_snap_put(out, &hdr, sizeof(hdr));
+  }
+  term_snap_put(out, &rec, sizeof(rec));
+  term_snap_put(out, &state, sizeof(state));
+
+  if(full){
+    for(line=lines_total-TERM_HIST;line<lines_total+term_height;line++){
+      term_snap_put_row(out, line);
+    }
+  } else {
+    for(i=0;i<snap.lines_len;i++){
+      term_snap_put_row(out, snap.lines[i]);
+    }
+  }
+
+  rec.type = SNAP_REC_COMMIT;
+  rec.len = 0;
+  term_snap_put(out, &rec, sizeof(rec));
+  term_snap_flush(out);
+
+  ok = out->ok;
+  close(out->fd);
+  free(out);
+
+  if(full){
+    ok = (ok && rename(tmp, snap.path) == 0);
+  }
+  return ok;
+}
+
+/*
+ * Take a snapshot, in a child
+ * process unless sync is set
+ */
+void term_snap_save(int sync){
+  uint64_t prev_base = snap.base,
+           line,
+           h;
+  size_t row_bytes = sizeof(struct term_snap_rec)+sizeof(struct term_snap_row)+(term_width*sizeof(uint128_t)), /* At most */
+         bytes;
+  pid_t pid;
+  int full,
+      ok = 1;
+
+  if(snap.pid > 0 || alt_screen){ return; }
+
+  if(snap.hash_len != term_height){
+    snap.hash = realloc(snap.hash, term_height*sizeof(uint64_t));
+    snap.hash_len = term_height;
+    snap.full = 1;
+  }
+
+  /* Rows which were on screen last time
+   *   are checked against their hashes,
+   *   rows which appeared since are new
+   *   (and are all hashed in line order,
+   *   so each hash is read before the
+   *   one for its new position is stored).
+   *   Any which scrolled on past the ring
+   *   since are read back from the spill
+   */
+  snap.lines_len = 0;
+  line = (snap.full ? lines_total : prev_base);
+  if(line < lines_total-TERM_HIST){ line = lines_total-TERM_HIST; }
+  for(;line<lines_total+term_height;line++){
+    h = term_snap_hash(term_row((int)(line-lines_total)));
+    if(!snap.full && (line-prev_base >= (uint64_t)snap.hash_len || h != snap.hash[line-prev_base])){
+      if(snap.lines_len == snap.lines_cap){
+        snap.lines_cap = (snap.lines_cap == 0 ? 64 : snap.lines_cap*2);
+        snap.lines = realloc(snap.lines, snap.lines_cap*sizeof(uint64_t));
+      }
+      snap.lines[snap.lines_len++] = line;
+    }
+    if(line >= lines_total){
+      snap.hash[line-lines_total] = h;
+    }
+  }
+  snap.base = lines_total;
+
+  bytes = (snap.lines_len*row_bytes)+sizeof(struct term_snap_state)+(2*sizeof(struct term_snap_rec));
+  if(snap.log_bytes+bytes > snap.full_bytes){
+    snap.full = 1;
+  }
+  if(snap.full){
+    bytes = ((TERM_HIST+term_height)*row_bytes)+sizeof(struct term_snap_state)+(2*sizeof(struct term_snap_rec));
+  }
+
+  /* (a child's failure is only seen
+   *   when it is reaped)
+   */
+  full = snap.full;
+  if(sync || (pid=fork()) < 0){
+    ok = term_snap_write(full);
+  } else if(pid == 0){
+    _exit(term_snap_write(full) ? 0 : 1);
+  } else {
+    snap.pid = pid;
+  }
+
+  if(!ok){
+    snap.full = 1;
+  } else if(full){
+    snap.full_bytes = bytes;
+    snap.log_bytes = 0;
+    snap.full = 0;
+  } else {
+    snap.log_bytes += bytes;
+  }
+  snap.pending = 0;
+  clock_gettime(CLOCK_MONOTONIC, &snap.last);
+}
+
+/*
+ * Reap the last snapshot's child,
+ * and take the next one when due
+ */
+void term_snap_tick(){
+  int status;
+
+  if(snap.pid > 0 && waitpid(snap.pid, &status, WNOHANG) == snap.pid){
+    /* A failed append may have left a
+     *   partial record, which only a
+     *   full rewrite gets rid of
+     */
+    if(!WIFEXITED(status) || WEXITSTATUS(status) != 0){
+      snap.full = 1;
+      snap.pending = 1;
+    }
+    snap.pid = 0;
+  }
+
+  if(snap.pending && snap.pid == 0 && term_elapsed(&snap.last) >= SNAPSHOT_INTERVAL_MS){
+    term_snap_save(0);
+  }
+}
+
+/*
+ * Milliseconds until term_snap_tick()
+ * next has something to do
+ */
+int term_snap_wait(){
+  int ms = SNAPSHOT_INTERVAL_MS-(int)term_elapsed(&snap.last);
+
+  if(snap.pid > 0 && ms < 10){ ms = 10; }
+  return (ms < 0 ? 0 : ms);
+}
+
+/*
+ * Return the size of the record
+ * at off, or 0 if it is malformed
+ * or cut short
+ */
+size_t term_snap_rec_size(unsigned char *map, size_t size, size_t off){
+  struct term_snap_rec rec;
+  struct term_snap_row row;
+
+  if(off+sizeof(rec) > size){ return 0; }
+  memcpy(&rec, map+off, sizeof(rec));
+  if(rec.len > size-off-sizeof(rec)){ return 0; }
+
+  switch(rec.type){
+    case SNAP_REC_STATE:
+      if(rec.len != sizeof(struct term_snap_state)){ return 0; }
+      break;
+    case SNAP_REC_ROW:
+      if(rec.len < sizeof(row)){ return 0; }
+      memcpy(&row, map+off+sizeof(rec), sizeof(row));
+      if(row.len > row.width || rec.len != sizeof(row)+((size_t)row.len*sizeof(uint128_t))){ return 0; }
+      break;
+    case SNAP_REC_COMMIT:
+      if(rec.len != 0){ return 0; }
+      break;
+    default:
+      return 0;
+  }
+
+  return sizeof(rec)+rec.len;
+}
+
+/*
+ * Whether restored cells are all ones
+ * the pool accounts for (snapshots
+ * flatten clusters, so only a damaged
+ * file has any)
+ */
+int term_snap_cells_ok(const uint128_t *cells, size_t len){
+  size_t i;
+
+  for(i=0;i<len;i++){
+    if(CELL_IS_CLUSTER(cells[i]) && CELL_CLUSTER(cells[i]) >= (uint32_t)pool.ents_len){ return 0; }
+  }
+  return 1;
+}
+
+/*
+ * Fill the (freshly allocated) grid
+ * (and, with -S, the spill) from the
+ * last complete snapshot, leaving the
+ * cursor on the line after its own
+ */
+void term_snap_restore(){
+  struct stat st;
+  struct term_snap_header hdr;
+  struct term_snap_rec rec;
+  struct term_snap_state state = { 0 },
+                         next = { 0 };
+  struct term_snap_row row;
+  unsigned char *map;
+  uint128_t *dst,
+            *src,
+            *tmp;
+  uint64_t *at = NULL,     /* Each line's latest committed row, by line-base */
+           *pending = NULL, /* Line and offset of rows since the last commit */
+           base = 0,
+           first,
+           keep,
+           spilled,
+           line;
+  size_t off,
+         len,
+         at_len = 0,
+         grow,
+         pending_len = 0,
+         pending_cap = 0,
+         i;
+  int committed = 0,
+      have_next = 0,
+      damaged = 0,
+      fd;
+
+  if((fd=open(snap.path, O_RDONLY)) < 0){ return; }
+  if(fstat(fd, &st) != 0 || st.st_size == 0){
+    close(fd);
+    return;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE|MAP_POPULATE, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED){
+    log_warn(TERM_WARN_SNAPSHOT, snap.path);
+    return;
+  }
+
+  /* A single pass validates the records
+   *   and indexes rows by line, each
+   *   snapshot's taking effect at its
+   *   commit (lines before the first
+   *   snapshot's history are never
+   *   written)
+   */
+  memcpy(&hdr, map, ((size_t)st.st_size < sizeof(hdr) ? (size_t)st.st_size : sizeof(hdr)));
+  if((size_t)st.st_size >= sizeof(hdr) &&
+      memcmp(hdr.magic, SNAP_MAGIC, sizeof(hdr.magic)) == 0 &&
+      hdr.version == SNAP_VERSION &&
+      hdr.cell == sizeof(uint128_t)){
+    for(off=sizeof(hdr);(len=term_snap_rec_size(map, st.st_size, off)) > 0;off+=len){
+      memcpy(&rec, map+off, sizeof(rec));
+      if(rec.type == SNAP_REC_STATE){
+        memcpy(&next, map+off+sizeof(rec), sizeof(next));
+        if(!have_next && !committed){
+          base = (next.hist >= 0 && (uint64_t)next.hist <= next.lines_total ? next.lines_total-next.hist : next.lines_total);
+        }
+        have_next = 1;
+      } else if(rec.type == SNAP_REC_ROW){
+        memcpy(&row, map+off+sizeof(rec), sizeof(row));
+        if(!have_next || row.line < base || row.line >= next.lines_total+(uint32_t)next.height){ continue; }
+        if(pending_len+2 > pending_cap){
+          pending_cap = (pending_cap == 0 ? 1024 : pending_cap*2);
+          pending = realloc(pending, pending_cap*sizeof(uint64_t));
+        }
+        pending[pending_len++] = row.line-base;
+        pending[pending_len++] = off;
+      } else if(rec.type == SNAP_REC_COMMIT && have_next){
+        for(i=0;i<pending_len;i+=2){
+          if(pending[i] >= at_len){
+            grow = (pending[i]+1 > at_len*2 ? pending[i]+1 : at_len*2);
+            at = realloc(at, grow*sizeof(uint64_t));
+            memset(at+at_len, 0, (grow-at_len)*sizeof(uint64_t));
+            at_len = grow;
+          }
+          at[pending[i]] = pending[i+1];
+        }
+        pending_len = 0;
+        state = next;
+        have_next = 0;
+        committed = 1;
+      }
+    }
+  }
+  free(pending);
+
+  if(!committed ||
+      state.width < 1 || state.height < 1 ||
+      state.hist < 0 || (uint64_t)state.hist > state.lines_total ||
+      state.y < 0 || state.y >= state.height){
+    log_warn(TERM_WARN_SNAPSHOT, snap.path);
+    free(at);
+    munmap(map, st.st_size);
+    return;
+  }
+
+  /* Lines up to the cursor's are kept,
+   *   as many as fit above the last
+   *   row of the screen, and (with -S)
+   *   older ones are spilled
+   */
+  keep = (uint64_t)state.hist+state.y+1;
+  first = state.lines_total+state.y+1-keep;
+  spilled = 0;
+  if(keep > (uint64_t)buf_rows-1){
+    spilled = (spill.on ? keep-(buf_rows-1) : 0);
+    first += keep-(buf_rows-1)-spilled;
+    keep = buf_rows-1;
+  }
+
+  hist_len = (keep > (uint64_t)term_height-1 ? keep-(term_height-1) : 0);
+  buf_top = hist_len;
+  lines_total = hist_len;
+
+  tmp = calloc(term_width, sizeof(uint128_t));
+  for(line=first;line<first+spilled+keep;line++){
+    if(line-base < at_len && at[line-base] != 0){
+      off = at[line-base];
+      memcpy(&row, map+off+sizeof(rec), sizeof(row));
+      src = (uint128_t*)(map+off+sizeof(rec)+sizeof(row));
+    } else {
+      row.len = row.width = 0;
+      src = NULL;
+    }
+
+    /* (the rest of the grid is never
+     *   touched)
+     */
+    dst = (line < first+spilled ? tmp : &screen_buf[(size_t)(line-first-spilled)*term_width]);
+    len = (row.len < (uint32_t)term_width ? row.len : (uint32_t)term_width);
+    if(len > 0){ memcpy(dst, src, len*sizeof(uint128_t)); }
+    if(!term_snap_cells_ok(dst, len)){
+      memset(dst, 0, len*sizeof(uint128_t));
+      row.len = 0;
+      damaged = 1;
+    }
+    if(row.len > 0 && row.len == row.width && CELL_FLAGS(src[row.len-1]) & TERM_CELL_WRAP){
+      dst[term_width-1] |= (uint128_t)TERM_CELL_WRAP << 88;
+    }
+
+    if(dst == tmp){
+      if(spill.on){ term_spill_push(tmp); }
+      memset(tmp, 0, term_width*sizeof(uint128_t));
+    }
+  }
+  free(tmp);
+
+  x = x_next = 0;
+  y = y_next = keep-hist_len;
+
+  free(at);
+  munmap(map, st.st_size);
+
+  if(damaged){
+    log_warn(TERM_WARN_SNAPSHOT, snap.path);
+  }
+
+  /* Renumbered, so rewritten in full */
+  snap.full = 1;
+  snap.pending = 1;
+}
+
+void term_snap_close(){
+  int status;
+
+  if(snap.pid > 0 && waitpid(snap.pid, &status, 0) == snap.pid &&
+      (!WIFEXITED(status) || WEXITSTATUS(status) != 0)){
+    snap.full = 1;
+    snap.pending = 1;
+  }
+  snap.pid = 0;
+
+  if(snap.pending){
+    term_snap_save(1);
+  }
+
+  free(snap.hash);
+  free(snap.lines);
+}
+
+//////////////////////////////
+// RECORDING
+//
+// With -r, the shell's output is
+// recorded as asciicast v2: a JSON
+// header, then an event per line.
+// term_loop only copies each read
+// (and when it came) into a ring
+// buffer, from which a thread of
+// its own encodes and writes it, so
+// a slow disk never holds up the
+// window. If that thread falls so
+// far behind that the ring fills,
+// output is left out (and a marker
+// event says how much) rather than
+// waited on. With io_uring, there is
+// no thread: each event is encoded
+// as it comes, and written in the
+// same submission as the shell's
+// input.
+//
+// With -p (or -P, as fast as it
+// can), a recording is played back
+// by a child on the pty in place of
+// the shell, so it is drawn exactly
+// as it was first; -H plays one
+// headlessly, a frame per event.
+//
+/*
+ * Append s (len bytes, decoded with
+ * dec) to out as the inside of a
+ * JSON string, which must be valid
+ * UTF-8
+ */
+size_t term_rec_escape(char *out, struct utf8_decoder *dec, const char *s, int len){
+  uint32_t cps[REC_EVENT_MAX+4];
+  size_t n = 0;
+  int count, i;
+
+  count = utf8_decode(dec, s, len, cps);
+  for(i=0;i<count;i++){
+    if(cps[i] == '"' || cps[i] == '\\'){
+      out[n++] = '\\';
+      out[n++] = cps[i];
+    } else if(cps[i] == '\r' || cps[i] == '\n'){
+      out[n++] = '\\';
+      out[n++] = (cps[i] == '\r' ? 'r' : 'n');
+    } else if(cps[i] < 0x20 || cps[i] == 0x7f){
+      n += sprintf(&out[n], "\\u%04x", cps[i]);
+    } else {
+      n += utf8_encode(cps[i], &out[n]);
+    }
+  }
+  return n;
+}
+
+/*
+ * Encode an event (with its len bytes
+ * of data) into out as a line of the
+ * recording, which takes at most
+ * REC_LINE_MAX bytes
+ */
+size_t term_rec_line(char *out, struct term_rec_event *ev, const char *data){
+  struct utf8_decoder fresh = { 0 };
+  size_t n;
+
+  /* Only output is split between events,
+   *   so a sequence is carried over only
+   *   from one to the very next
+   */
+  if(ev->type != 'o'){
+    memset(&rec.dec, 0, sizeof(rec.dec));
+  }
+
+  n = sprintf(out, "[%.6f, \"%c\", \"", ev->t, ev->type);
+  n += term_rec_escape(&out[n], (ev->type == 'o' ? &rec.dec : &fresh), data, ev->len);
+  n += sprintf(&out[n], "\"]\n");
+  return n;
+}
+
+/*
+ * Queue an event of type (o, r or m)
+ * for the writer, returning 0 if it
+ * does not fit
+ */
+int term_rec_put(char type, const char *data, uint32_t len){
+  struct term_rec_event ev;
+  size_t used = rec.head-rec.tail,
+         i;
+
+  ev.type = type;
+  ev.t = term_elapsed(&rec.start)/1000.0;
+  ev.len = len;
+
+  /* With io_uring it is encoded here,
+   *   and cap bounds what is yet to
+   *   be written instead
+   */
+  if(rec.ring){
+    used = (rec.out.len-rec.out.off)+(rec.sending.len-rec.sending.off);
+    if(used+REC_LINE_MAX > rec.cap){ return 0; }
+    term_queue_grow(&rec.out, REC_LINE_MAX);
+    rec.out.len += term_rec_line(rec.out.buf+rec.out.len, &ev, data);
+    return 1;
+  }
+
+  if(used+sizeof(ev)+len > rec.cap){ return 0; }
+  for(i=0;i<sizeof(ev);i++){
+    rec.buf[(rec.head+i) % rec.cap] = ((char*)&ev)[i];
+  }
+  rec.head += sizeof(ev);
+  for(i=0;i<len;i++){
+    rec.buf[(rec.head+i) % rec.cap] = data[i];
+  }
+  rec.head += len;
+  return 1;
+}
+
+/*
+ * Record an event, noting first
+ * how much was left out before
+ * it, if anything was
+ */
+void term_rec_event(char type, const char *data, uint32_t len){
+  char note[64];
+
+  pthread_mutex_lock(&rec.lock);
+  if(rec.lost > 0){
+    snprintf(note, sizeof(note), "%lu bytes of output left out", rec.lost);
+    if(term_rec_put('m', note, strlen(note))){
+      rec.lost = 0;
+    }
+  }
+  if(rec.lost > 0 || !term_rec_put(type, data, len)){
+    rec.lost += len;
+    rec.lost_total += len;
+  }
+  pthread_cond_signal(&rec.wake);
+  pthread_mutex_unlock(&rec.lock);
+}
+
+/*
+ * The writer thread: encodes what
+ * is queued and writes it out, a
+ * batch at a time, until told to
+ * stop (and everything is written)
+ */
+void *term_rec_thread(void *arg){
+  struct term_rec_event ev;
+  char data[REC_EVENT_MAX],
+       *out;
+  size_t tail, head, n, i;
+
+  (void)arg;
+  out = malloc(REC_LINE_MAX);
+
+  pthread_mutex_lock(&rec.lock);
+  for(;;){
+    while(rec.head == rec.tail && !rec.stop){
+      pthread_cond_wait(&rec.wake, &rec.lock);
+    }
+    if(rec.head == rec.tail){ break; }
+    tail = rec.tail;
+    head = rec.head;
+    pthread_mutex_unlock(&rec.lock);
+
+    /* Only this thread moves the tail, so
+     *   what is between it and the head
+     *   stays put until it does
+     */
+    while(tail < head){
+      for(i=0;i<sizeof(ev);i++){
+        ((char*)&ev)[i] = rec.buf[(tail+i) % rec.cap];
+      }
+      tail += sizeof(ev);
+      for(i=0;i<ev.len;i++){
+        data[i] = rec.buf[(tail+i) % rec.cap];
+      }
+      tail += ev.len;
+
+      n = term_rec_line(out, &ev, data);
+      if(write(rec.fd, out, n) != (ssize_t)n){
+        rec.failed = 1;
+      }
+    }
+
+    pthread_mutex_lock(&rec.lock);
+    rec.tail = tail;
+  }
+  pthread_mutex_unlock(&rec.lock);
+
+  free(out);
+  return NULL;
+}
+
+void term_rec_open(const char *path){
+  char header[256];
+  int len;
+
+  if((rec.fd=open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0){
+    log_warn(TERM_WARN_RECORD, (char*)path);
+    return;
+  }
+
+  len = snprintf(
+    header, sizeof(header),
+    "{\"version\": 2, \"width\": %i, \"height\": %i, \"timestamp\": %li, \"env\": {\"SHELL\": \"%s\"}}\n",
+    term_width, term_height, (long)time(NULL), SHELL
+  );
+  if(write(rec.fd, header, len) != len){
+    close(rec.fd);
+    log_warn(TERM_WARN_RECORD, (char*)path);
+    return;
+  }
+
+  rec.cap = RECORD_BUFFER;
+  rec.buf = malloc(rec.cap);
+  clock_gettime(CLOCK_MONOTONIC, &rec.start);
+  pthread_mutex_init(&rec.lock, NULL);
+  pthread_cond_init(&rec.wake, NULL);
+  if(pthread_create(&rec.thread, NULL, term_rec_thread, NULL) != 0){
+    free(rec.buf);
+    close(rec.fd);
+    log_warn(TERM_WARN_RECORD, (char*)path);
+    return;
+  }
+  rec.on = 1;
+}
+
+/*
+ * Record the shell's output
+ */
+void term_rec_output(const char *buf, int len){
+  int off;
+
+  for(off=0;off<len;off+=REC_EVENT_MAX){
+    term_rec_event('o', buf+off, (len-off < REC_EVENT_MAX ? len-off : REC_EVENT_MAX));
+  }
+}
+
+/*
+ * Record the grid's new size
+ */
+void term_rec_resize(){
+  char size[32];
+
+  snprintf(size, sizeof(size), "%ix%i", term_width, term_height);
+  term_rec_event('r', size, strlen(size));
+}
+
+/*
+ * Let the writer finish what is
+ * queued, and stop it
+ */
+void term_rec_stop(){
+  pthread_mutex_lock(&rec.lock);
+  rec.stop = 1;
+  pthread_cond_signal(&rec.wake);
+  pthread_mutex_unlock(&rec.lock);
+  pthread_join(rec.thread, NULL);
+}
+
+/*
+ * Write out what is left of the
+ * recording, and close it
+ */
+void term_rec_close(){
+  char lost[32];
+
+#ifdef TERM_URING
+  if(rec.ring){
+    term_uring_rec_drain();
+  } else
+#endif
+  {
+    term_rec_stop();
+  }
+
+  close(rec.fd);
+  free(rec.buf);
+  free(rec.out.buf);
+  free(rec.sending.buf);
+  rec.on = 0;
+
+  if(rec.failed){
+    log_warn(TERM_WARN_RECORD, rec.path);
+  } else if(rec.lost_total > 0){
+    snprintf(lost, sizeof(lost), "%lu", rec.lost_total);
+    log_warn(TERM_WARN_RECORD_LOST, lost);
+  }
+}
+
+/*
+ * Read the next output event of a
+ * recording, decoding its text into
+ * *buf (grown as needed), and return
+ * its length (or -1 at the end). The
+ * header and other events are skipped
+ */
+int term_cast_next(FILE *fp, char **buf, size_t *cap, double *t){
+  const char *hex = "0123456789abcdefABCDEF";
+  char *line = NULL,
+       *p,
+       *end;
+  size_t line_cap = 0;
+  uint32_t cp, lo;
+  int len;
+
+  while(getline(&line, &line_cap, fp) > 0){
+    if(line[0] != '['){ continue; }
+
+    *t = strtod(line+1, &end);
+    p = end+strspn(end, " ,");
+    if(strncmp(p, "\"o\"", 3) != 0){ continue; }
+    p += 3;
+    p += strspn(p, " ,");
+    if(*p++ != '"'){ continue; }
+
+    /* Escapes only ever shrink */
+    if(line_cap > *cap){
+      *cap = line_cap;
+      *buf = realloc(*buf, *cap);
+    }
+
+    len = 0;
+    while(*p != '"' && *p != '\0'){
+      if(*p != '\\'){
+        (*buf)[len++] = *p++;
+        continue;
+      }
+      p++;
+      switch(*p++){
+        case 'b': (*buf)[len++] = '\b'; break;
+        case 'f': (*buf)[len++] = '\f'; break;
+        case 'n': (*buf)[len++] = '\n'; break;
+        case 'r': (*buf)[len++] = '\r'; break;
+        case 't': (*buf)[len++] = '\t'; break;
+        case 'u':
+          /* A short escape (cut off by the
+           *   quote or the end of the line)
+           *   ends the event
+           */
+          if(strspn(p, hex) < 4){
+            p += strlen(p);
+            break;
+          }
+          cp = strtoul((char[]){ p[0], p[1], p[2], p[3], '\0' }, NULL, 16);
+          p += 4;
+          if(cp >= 0xd800 && cp < 0xdc00 && p[0] == '\\' && p[1] == 'u' && strspn(p+2, hex) >= 4){
+            lo = strtoul((char[]){ p[2], p[3], p[4], p[5], '\0' }, NULL, 16);
+            if(lo >= 0xdc00 && lo < 0xe000){
+              cp = 0x10000+((cp-0xd800) << 10)+(lo-0xdc00);
+              p += 6;
+            }
+          }
+          len += utf8_encode(cp, &(*buf)[len]);
+          break;
+        case '\0':
+          p--;
+          break;
+        default:
+          (*buf)[len++] = p[-1];
+          break;
+      }
+    }
+
+    free(line);
+    return len;
+  }
+
+  free(line);
+  return -1;
+}
+
+/*
+ * Play a recording back to the pty
+ * (in the child started in place of
+ * the shell), at the pace it was
+ * recorded (with long pauses cut
+ * short) or as fast as it can be
+ * written
+ */
+void term_cast_play(){
+  struct termios tio;
+  FILE *fp;
+  char *buf = NULL;
+  size_t cap = 0;
+  double t, last = 0, wait;
+  int len, off, n;
+
+  /* Sent as it was, with no
+   *   newline translation
+   */
+  tcgetattr(STDOUT_FILENO, &tio);
+  cfmakeraw(&tio);
+  tcsetattr(STDOUT_FILENO, TCSANOW, &tio);
+
+  if((fp=fopen(replay, "r")) == NULL){
+    log_error(TERM_ERR_REPLAY);
+  }
+
+  while((len=term_cast_next(fp, &buf, &cap, &t)) >= 0){
+    if(!replay_fast){
+      wait = t-last;
+      if(wait > REPLAY_IDLE_MAX_MS/1000.0){ wait = REPLAY_IDLE_MAX_MS/1000.0; }
+      if(wait > 0){ usleep(wait*1000000); }
+    }
+    last = t;
+    for(off=0;off<len;off+=n){
+      if((n=write(STDOUT_FILENO, buf+off, len-off)) <= 0){ exit(0); }
+    }
+  }
+  fclose(fp);
+  free(buf);
+
+  /* Left on screen until term closes
+   *   the pty, which hangs this up
+   */
+  for(;;){ pause(); }
+}
+
+//////////////////////////////
+// SEARCH
+//
+// Searching scans backwards from
+// the bottom of the view, a time
+// slice at a time between events,
+// so that results appear (and are
+// highlighted) while older history
+// is still being scanned.
+//
+uint32_t term_cell_base(uint128_t cell){
+  if(CELL_IS_CLUSTER(cell)){
+    return pool.arena[pool.ents[CELL_CLUSTER(cell)].off];
+  }
+  return (CELL_CHAR(cell) == 0 ? ' ' : CELL_CHAR(cell));
+}
+
+/*
+ * Return the first cell in
+ * [from, to) which could start
+ * a match for cp (clusters are
+ * always candidates), or to
+ */
+int term_search_find(uint128_t *cells, int from, int to, uint32_t cp){
+#ifdef __SSE2__
+  __m128i needle = _mm_set1_epi32(cp),
+          blank = _mm_set1_epi32(cp == ' ' ? 0 : cp),
+          lanes,
+          hits;
+  __m128 lo, hi;
+  int mask;
+
+  /* Gather the code point (low 32 bits)
+   *   of four cells into one register
+   */
+  for(;from+4<=to;from+=4){
+    lo = _mm_shuffle_ps(
+      _mm_castsi128_ps(_mm_loadu_si128((__m128i*)&cells[from])),
+      _mm_castsi128_ps(_mm_loadu_si128((__m128i*)&cells[from+1])),
+      _MM_SHUFFLE(0, 0, 0, 0)
+    );
+    hi = _mm_shuffle_ps(
+      _mm_castsi128_ps(_mm_loadu_si128((__m128i*)&cells[from+2])),
+      _mm_castsi128_ps(_mm_loadu_si128((__m128i*)&cells[from+3])),
+      _MM_SHUFFLE(0, 0, 0, 0)
+    );
+    lanes = _mm_castps_si128(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0)));
+
+    hits = _mm_or_si128(
+      _mm_or_si128(_mm_cmpeq_epi32(lanes, needle), _mm_cmpeq_epi32(lanes, blank)),
+      _mm_srai_epi32(lanes, 31)
+    );
+    if((mask=_mm_movemask_ps(_mm_castsi128_ps(hits))) != 0){
+      return from+__builtin_ctz(mask);
+    }
+  }
+#endif
+
+  for(;from<to;from++){
+    if(CELL_IS_CLUSTER(cells[from]) || term_cell_base(cells[from]) == cp){
+      return from;
+    }
+  }
+  return to;
+}
+
+/*
+ * Check for a match of the whole
+ * query starting at a cell,
+ * following soft wraps, and
+ * return its length in cells
+ */
+int term_search_verify(int row, int col){
+  uint128_t *cells = term_row(row);
+  int k = 0,
+      n = 0;
+
+  while(k < search.query_len){
+    if(col == term_width){
+      if(!(CELL_FLAGS(cells[term_width-1]) & TERM_CELL_WRAP) || row+1 >= term_height){
+        return 0;
+      }
+      cells = term_row(++row);
+      col = 0;
+    }
+
+    if(!(CELL_FLAGS(cells[col]) & TERM_CELL_DUMMY)){
+      if(term_cell_base(cells[col]) != search.query[k++]){
+        return 0;
+      }
+    }
+    col++;
+    n++;
+  }
+
+  return n;
+}
+
+/*
+ * Return the index of the first
+ * match starting on or above line
+ * (matches are kept newest first)
+ */
+int term_search_lookup(uint64_t line){
+  int lo = 0,
+      hi = search.matches_len,
+      mid;
+
+  while(lo < hi){
+    mid = (lo+hi)/2;
+    if(search.matches[mid].line > line){
+      lo = mid+1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+/*
+ * Return 0 if a cell is not part
+ * of a match, 1 if it is, or 2 if
+ * it is part of the current one
+ */
+int term_search_hit(int pos_x, int pos_y){
+  uint64_t line = lines_total+pos_y;
+  int d, i, off;
+
+  for(d=0;d<=search.span && (uint64_t)d<=line;d++){
+    off = (d*term_width)+pos_x;
+    for(i=term_search_lookup(line-d);i<search.matches_len && search.matches[i].line == line-d;i++){
+      if(off >= search.matches[i].col && off < search.matches[i].col+search.matches[i].len){
+        return (i == search.current ? 2 : 1);
+      }
+    }
+  }
+  return 0;
+}
+
+void term_search_status(){
+  wchar_t text[SEARCH_MAX+64];
+  char info[64];
+  int len = 0, i;
+
+  if(!search.active){ return; }
+
+  snprintf(info, sizeof(info), "%s: ", (search.regex ? "regex" : "search"));
+  for(i=0;info[i]!='\0';i++){ text[len++] = info[i]; }
+  for(i=0;i<search.query_len;i++){ text[len++] = search.query[i]; }
+  snprintf(
+    info, sizeof(info), "  [%i match%s%s]",
+    search.matches_len,
+    (search.matches_len == 1 ? "" : "es"),
+    (search.regex && !search.regex_ok ? ", invalid" : (search.done ? "" : ", scanning"))
+  );
+  for(i=0;info[i]!='\0';i++){ text[len++] = info[i]; }
+
+  term_shadow_damage(0, term_height-1, term_width, 1);
+  term_x_color(fg_default);
+  term_x_fill(
+    0, (term_height-1)*char_h,
+    (term_width*char_w)+LEFTMOST, char_h
+  );
+  term_x_color(bg_default);
+  term_x_text(
+    LEFTMOST, ((term_height-1)*char_h)+char_ascent,
+    text,
+    len
+  );
+}
+
+/*
+ * Redraw the rows covered by
+ * a match, if they are visible
+ */
+void term_search_damage(struct term_match *m){
+  int row = (int64_t)(m->line-lines_total),
+      last = row+((m->col+m->len-1)/term_width);
+
+  for(;row<=last;row++){
+    term_redraw_line(row);
+  }
+}
+
+/*
+ * Make match i the current one,
+ * scrolling it into view
+ */
+void term_search_show(int i){
+  struct term_match *prev = (search.current >= 0 ? &search.matches[search.current] : NULL);
+  int row;
+
+  search.current = i;
+  search.jump = 0;
+
+  row = (int64_t)(search.matches[i].line-lines_total)+(search.matches[i].col/term_width);
+  if(row+viewport < 0 || row+viewport >= term_height-1){
+    viewport = (term_height/2)-row;
+    if(viewport > TERM_HIST){ viewport = TERM_HIST; }
+    if(viewport < 0){ viewport = 0; }
+    term_redraw();
+  } else {
+    if(prev != NULL){
+      term_search_damage(prev);
+    }
+    term_search_damage(&search.matches[i]);
+  }
+}
+
+void term_search_add(uint64_t line, int col, int len){
+  struct term_match *m;
+
+  if(search.matches_len == search.matches_cap){
+    search.matches_cap = (search.matches_cap > 0 ? search.matches_cap*2 : 64);
+    search.matches = realloc(search.matches, search.matches_cap*sizeof(struct term_match));
+  }
+
+  m = &search.matches[search.matches_len++];
+  m->line = line;
+  m->col = col;
+  m->len = len;
+
+  if((col+len-1)/term_width > search.span){
+    search.span = (col+len-1)/term_width;
+  }
+
+  if(search.jump){
+    term_search_show(search.matches_len-1);
+  } else {
+    term_search_damage(m);
+  }
+}
+
+void term_search_row_plain(int row, uint64_t line){
+  uint128_t *cells = term_row(row);
+  int col = 0,
+      len;
+
+  while((col=term_search_find(cells, col, term_width, search.query[0])) < term_width){
+    if((len=term_search_verify(row, col)) > 0){
+      term_search_add(line, col, len);
+    }
+    col++;
+
+    /* Verifying may have read (spilled)
+     *   rows into the same scratch space
+     */
+    cells = term_row(row);
+  }
+}
+
+void term_search_row_regex(int row, uint64_t line){
+  uint128_t *cells;
+  uint32_t text[POOL_CLUSTER_MAX];
+  regmatch_t m;
+  char *out;
+  int r, c, i, j, n, len = 0, off = 0, start, end, wrapped;
+
+  /* Regexes run over whole logical lines,
+   *   which start on rows not preceded by
+   *   a soft-wrapped one
+   */
+  if(row > -TERM_HIST && CELL_FLAGS(term_row(row-1)[term_width-1]) & TERM_CELL_WRAP){
+    return;
+  }
+
+  for(r=row,wrapped=1;wrapped && r<term_height;r++){
+    cells = term_row(r);
+    wrapped = CELL_FLAGS(cells[term_width-1]) & TERM_CELL_WRAP;
+
+    for(c=0;c<term_width;c++){
+      if(CELL_FLAGS(cells[c]) & TERM_CELL_DUMMY){ continue; }
+      if(!wrapped && CELL_CHAR(cells[c]) == 0){
+        for(i=c;i<term_width && CELL_CHAR(cells[i]) == 0;i++);
+        if(i == term_width){ break; }
+      }
+
+      if(len+(POOL_CLUSTER_MAX*4)+1 > search.line_cap){
+        search.line_cap = (search.line_cap > 0 ? search.line_cap*2 : 4096);
+        search.line_buf = realloc(search.line_buf, search.line_cap);
+        search.line_map = realloc(search.line_map, search.line_cap*sizeof(int));
+      }
+
+      if((n=term_cell_text(cells[c], text)) == 0){
+        text[n++] = ' ';
+      }
+      for(i=0;i<n;i++){
+        out = &search.line_buf[len];
+        if(text[i] < 0x80){
+          *out++ = text[i];
+        } else if(text[i] < 0x800){
+          *out++ = 0xc0|(text[i]>>6);
+          *out++ = 0x80|(text[i]&0x3f);
+        } else if(text[i] < 0x10000){
+          *out++ = 0xe0|(text[i]>>12);
+          *out++ = 0x80|((text[i]>>6)&0x3f);
+          *out++ = 0x80|(text[i]&0x3f);
+        } else {
+          *out++ = 0xf0|(text[i]>>18);
+          *out++ = 0x80|((text[i]>>12)&0x3f);
+          *out++ = 0x80|((text[i]>>6)&0x3f);
+          *out++ = 0x80|(text[i]&0x3f);
+        }
+        for(j=len;j<out-search.line_buf;j++){
+          search.line_map[j] = ((r-row)*term_width)+c;
+        }
+        len = out-search.line_buf;
+      }
+    }
+  }
+  if(len == 0){ return; }
+  search.line_buf[len] = '\0';
+
+  while(off < len && regexec(&search.re, search.line_buf+off, 1, &m, (off > 0 ? REG_NOTBOL : 0)) == 0){
+    if(m.rm_eo == m.rm_so){
+      off += m.rm_so+1;
+      continue;
+    }
+
+    start = search.line_map[off+m.rm_so];
+    end = search.line_map[off+m.rm_eo-1];
+    cells = term_row(row+(end/term_width));
+    end += (CELL_FLAGS(cells[end%term_width]) & TERM_CELL_WIDE ? 2 : 1);
+
+    term_search_add(line, start, end-start);
+    off += m.rm_eo;
+  }
+}
+
+/*
+ * Scan for one time slice,
+ * returning early only once
+ * the whole history is done
+ */
+void term_search_step(){
+  struct timespec start;
+  uint64_t oldest;
+  int row, n = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  while(!search.done){
+    oldest = lines_total-TERM_HIST;
+    if(search.scan < oldest){
+      search.done = 1;
+      break;
+    }
+
+    row = (int64_t)(search.scan-lines_total);
+    if(row < term_height){
+      if(search.regex){
+        term_search_row_regex(row, search.scan);
+      } else {
+        term_search_row_plain(row, search.scan);
+      }
+    }
+
+    if(search.scan == oldest){
+      search.done = 1;
+    } else {
+      search.scan--;
+    }
+
+    if((++n & 63) == 0 && term_elapsed(&start)*1000 >= SEARCH_SLICE_US){
+      break;
+    }
+  }
+
+  term_search_status();
+}
+
+void term_search_clear(){
+  int i, row,
+      last = term_height;
+
+  /* Only rows showing a match need redrawing */
+  for(i=term_search_lookup(lines_total+term_height-1-viewport);i<search.matches_len;i++){
+    row = (int64_t)(search.matches[i].line-lines_total);
+    if(row+viewport+search.span < 0){ break; }
+    if(row+((search.matches[i].col+search.matches[i].len-1)/term_width) < last){
+      last = row;
+      term_search_damage(&search.matches[i]);
+    }
+  }
+
+  search.matches_len = 0;
+  search.current = -1;
+  search.span = 0;
+}
+
+void term_search_restart(){
+  char pattern[SEARCH_MAX*4+1];
+  int i, n,
+      len = 0;
+
+  term_search_clear();
+
+  if(search.regex_ok){
+    regfree(&search.re);
+    search.regex_ok = 0;
+  }
+  if(search.regex && search.query_len > 0){
+    /* A character the locale cannot
+     *   encode leaves the regex invalid
+     */
+    for(i=0;i<search.query_len;i++){
+      if((n=wctomb(&pattern[len], search.query[i])) < 0){ break; }
+      len += n;
+    }
+    pattern[len] = '\0';
+    search.regex_ok = (i == search.query_len && regcomp(&search.re, pattern, REG_EXTENDED|REG_NEWLINE) == 0);
+  }
+
+  search.scan = lines_total+term_height-1-viewport;
+  search.done = (search.query_len == 0 || (search.regex && !search.regex_ok));
+  search.jump = 1;
+
+  term_search_status();
+}
+
+void term_search_start(){
+  search.active = 1;
+  search.query_len = 0;
+  term_search_restart();
+}
+
+void term_search_stop(){
+  search.active = 0;
+  search.done = 1;
+  search.matches_len = 0;
+  search.current = -1;
+  if(search.regex_ok){
+    regfree(&search.re);
+    search.regex_ok = 0;
+  }
+  term_redraw();
+}
+
+void term_search_key(KeySym ksym, char *buf, int num){
+  int i;
+
+  switch(ksym){
+    case XK_Escape:
+      term_search_stop();
+      return;
+    case XK_Return:
+    case XK_Up:
+      if(search.current+1 < search.matches_len){
+        term_search_show(search.current+1);
+      } else if(!search.done){
+        search.jump = 1;
+      }
+      return;
+    case XK_Down:
+      if(search.current > 0){
+        term_search_show(search.current-1);
+      }
+      return;
+    case XK_Tab:
+      search.regex = !search.regex;
+      break;
+    case XK_BackSpace:
+      if(search.query_len == 0){ return; }
+      search.query_len--;
+      break;
+    default:
+      /* XLookupString produces Latin-1 */
+      for(i=0;i<num && search.query_len<SEARCH_MAX;i++){
+        if((unsigned char)buf[i] < 0x20){ return; }
+        search.query[search.query_len++] = (unsigned char)buf[i];
+      }
+      if(num == 0){ return; }
+      break;
+  }
+
+  term_search_restart();
+}
+
+//////////////////////////////
+// SELECTION
+//
+// Selections are ranges of
+// absolute lines, so they follow
+// their text into the scrollback.
+// Their text is read out of the
+// grid a chunk at a time when
+// another client asks for it,
+// never built up in one piece,
+// and anything larger than a
+// chunk is sent (or received)
+// with the ICCCM INCR protocol.
+//
+int term_sel_before(struct term_sel_pos *a, struct term_sel_pos *b){
+  return (a->line < b->line || (a->line == b->line && a->col < b->col));
+}
+
+/*
+ * Find the cell under a
+ * pointer position
+ */
+void term_sel_at(int px, int py, struct term_sel_pos *pos){
+  int col = (px-LEFTMOST)/char_w,
+      row = py/char_h;
+
+  if(col < 0){ col = 0; }
+  if(col > term_width-1){ col = term_width-1; }
+  if(row < 0){ row = 0; }
+  if(row > term_height-1){ row = term_height-1; }
+
+  pos->line = lines_total+row-viewport;
+  pos->col = col;
+}
+
+int term_sel_hit(int pos_x, int pos_y){
+  struct term_sel_pos pos = { lines_total+pos_y, pos_x };
+
+  return (sel.range.alt == alt_screen &&
+          !term_sel_before(&pos, &sel.range.start) &&
+          !term_sel_before(&sel.range.end, &pos));
+}
+
+/*
+ * Read the text of a range into
+ * out (at most cap bytes), from
+ * *pos onwards, returning how
+ * many bytes were written (0 at
+ * the end of the range)
+ */
+int term_sel_read(struct term_sel_range *r, struct term_sel_pos *pos, char *out, int cap){
+  uint32_t text[POOL_CLUSTER_MAX];
+  uint128_t *cells;
+  int n = 0,
+      row, wrap, last, end, len, i;
+
+  if(!r->set){ return 0; }
+
+  /* Text from OSC 52, where pos->line
+   *   is an offset into it
+   */
+  if(r->text != NULL){
+    n = (r->text_len-(long)pos->line < cap ? r->text_len-(long)pos->line : cap);
+    memcpy(out, r->text+pos->line, n);
+    pos->line += n;
+    return n;
+  }
+
+  if(r->alt != alt_screen){ return 0; }
+
+  while(term_sel_before(pos, &r->end) || (pos->line == r->end.line && pos->col == r->end.col)){
+    /* Lines since recycled by the
+     *   scrollback are skipped
+     */
+    if(pos->line < lines_total-TERM_HIST){
+      pos->line = lines_total-TERM_HIST;
+      pos->col = 0;
+      continue;
+    }
+
+    row = (int64_t)(pos->line-lines_total);
+    if(row >= term_height){ break; }
+
+    /* Trailing blanks are only kept
+     *   on soft-wrapped rows
+     */
+    cells = term_row(row);
+    wrap = CELL_FLAGS(cells[term_width-1]) & TERM_CELL_WRAP;
+    for(last=term_width-1;!wrap && last>=0 && CELL_CHAR(cells[last]) == 0;last--);
+    end = (pos->line == r->end.line ? r->end.col : term_width-1);
+    if(end > last){ end = last; }
+
+    for(;pos->col<=end;pos->col++){
+      if(CELL_FLAGS(cells[pos->col]) & TERM_CELL_DUMMY){ continue; }
+      if(n+(POOL_CLUSTER_MAX*4) > cap){ return n; }
+
+      len = term_cell_text(cells[pos->col], text);
+      if(len == 0){
+        out[n++] = ' ';
+      }
+      for(i=0;i<len;i++){
+        n += utf8_encode(text[i], &out[n]);
+      }
+    }
+
+    if(pos->line < r->end.line && !wrap){
+      if(n+1 > cap){ return n; }
+      out[n++] = '\n';
+    }
+    pos->line++;
+    pos->col = 0;
+  }
+
+  return n;
+}
+
+void term_sel_press(XButtonEvent *evt){
+  if(sel.shown){
+    sel.shown = 0;
+    term_redraw_lines(sel.range.start.line, sel.range.end.line);
+  }
+
+  term_sel_at(evt->x, evt->y, &sel.anchor);
+  sel.range.start = sel.range.end = sel.anchor;
+  sel.range.alt = alt_screen;
+  sel.range.set = 1;
+  sel.dragging = 1;
+}
+
+void term_sel_motion(XMotionEvent *evt){
+  struct term_sel_pos pos;
+  uint64_t from, to;
+
+  if(!sel.dragging){ return; }
+
+  term_sel_at(evt->x, evt->y, &pos);
+  if(!sel.shown && pos.line == sel.anchor.line && pos.col == sel.anchor.col){ return; }
+
+  from = (sel.shown ? sel.range.start.line : sel.anchor.line);
+  to = (sel.shown ? sel.range.end.line : sel.anchor.line);
+
+  if(term_sel_before(&pos, &sel.anchor)){
+    sel.range.start = pos;
+    sel.range.end = sel.anchor;
+  } else {
+    sel.range.start = sel.anchor;
+    sel.range.end = pos;
+  }
+  sel.shown = 1;
+
+  /* Only rows the change touched */
+  term_redraw_lines(
+    (sel.range.start.line < from ? sel.range.start.line : from),
+    (sel.range.end.line > to ? sel.range.end.line : to)
+  );
+}
+
+/*
+ * Free the text OSC 52 gave a
+ * selection, ending any transfers
+ * still reading it
+ */
+void term_sel_drop(struct term_sel_range *r){
+  struct term_transfer *t;
+  int i;
+
+  if(r->text == NULL){ return; }
+
+  for(i=0;i<SEL_TRANSFERS;i++){
+    t = &sel.xfer[i];
+    if(t->requestor == None || t->range.text != r->text){ continue; }
+
+    if(t->requestor != win){
+      XSelectInput(dpy, t->requestor, NoEventMask);
+    }
+    t->requestor = None;
+  }
+  free(r->text);
+  r->text = NULL;
+}
+
+void term_sel_release(XButtonEvent *evt){
+  sel.dragging = 0;
+  if(!sel.shown){ return; }
+
+  term_sel_drop(&sel.primary);
+  sel.primary = sel.range;
+  XSetSelectionOwner(dpy, XA_PRIMARY, win, evt->time);
+}
+
+void term_sel_copy(Time time){
+  if(!sel.primary.set){ return; }
+
+  term_sel_drop(&sel.clipboard);
+  sel.clipboard = sel.primary;
+  if(sel.primary.text != NULL){
+    sel.clipboard.text = malloc(sel.primary.text_len);
+    memcpy(sel.clipboard.text, sel.primary.text, sel.primary.text_len);
+  }
+  XSetSelectionOwner(dpy, atoms[ATOM_CLIPBOARD], win, time);
+}
+
+void term_sel_clear(XSelectionClearEvent *evt){
+  if(evt->selection == atoms[ATOM_CLIPBOARD]){
+    term_sel_drop(&sel.clipboard);
+    sel.clipboard.set = 0;
+    return;
+  }
+
+  term_sel_drop(&sel.primary);
+  sel.primary.set = 0;
+  if(sel.shown){
+    sel.shown = 0;
+    term_redraw_lines(sel.range.start.line, sel.range.end.line);
+  }
+}
+
+/*
+ * Answer another client asking
+ * for the PRIMARY or CLIPBOARD
+ * selection
+ */
+void term_sel_request(XSelectionRequestEvent *req){
+  struct term_sel_range *r = (req->selection == XA_PRIMARY ? &sel.primary : &sel.clipboard);
+  struct term_sel_pos pos = r->start;
+  struct term_transfer *t = NULL;
+  Atom targets[] = { atoms[ATOM_TARGETS], atoms[ATOM_UTF8_STRING], XA_STRING },
+       property = (req->property == None ? req->target : req->property);
+  XEvent res;
+  long size;
+  int len, i;
+
+  res.xselection.type = SelectionNotify;
+  res.xselection.display = dpy;
+  res.xselection.requestor = req->requestor;
+  res.xselection.selection = req->selection;
+  res.xselection.target = req->target;
+  res.xselection.property = None;
+  res.xselection.time = req->time;
+
+  if(req->target == atoms[ATOM_TARGETS]){
+    XChangeProperty(dpy, req->requestor, property, XA_ATOM, 32, PropModeReplace, (unsigned char*)targets, 3);
+    res.xselection.property = property;
+  } else if(r->set && (req->target == atoms[ATOM_UTF8_STRING] || req->target == XA_STRING)){
+    len = term_sel_read(r, &pos, sel.chunk, SELECTION_CHUNK);
+
+    if(len+(POOL_CLUSTER_MAX*4) <= SELECTION_CHUNK){
+      XChangeProperty(dpy, req->requestor, property, req->target, 8, PropModeReplace, (unsigned char*)sel.chunk, len);
+    } else {
+      for(i=0;i<SEL_TRANSFERS && t == NULL;i++){
+        if(sel.xfer[i].requestor == None){ t = &sel.xfer[i]; }
+      }
+      if(t == NULL){
+        /* Requestors which went away
+         *   mid-transfer never finish
+         */
+        t = &sel.xfer[sel.next++ % SEL_TRANSFERS];
+      }
+
+      t->requestor = req->requestor;
+      t->property = property;
+      t->type = req->target;
+      t->range = *r;
+      t->pos = r->start;
+
+      /* Chunks follow as the requestor
+       *   deletes the property
+       */
+      if(req->requestor != win){
+        XSelectInput(dpy, req->requestor, PropertyChangeMask);
+      }
+      /* The size is only a lower bound
+       *   (ICCCM 2.7.2), so the first chunk
+       *   stands in rather than reading the
+       *   whole selection twice
+       */
+      size = len;
+      XChangeProperty(dpy, req->requestor, property, atoms[ATOM_INCR], 32, PropModeReplace, (unsigned char*)&size, 1);
+    }
+    res.xselection.property = property;
+  }
+
+  XSendEvent(dpy, req->requestor, False, NoEventMask, &res);
+}
+
+/*
+ * Send the next chunk of an INCR
+ * transfer once the requestor
+ * has taken the last one
+ */
+void term_sel_send(XPropertyEvent *evt){
+  struct term_transfer *t;
+  int len, i;
+
+  if(evt->state != PropertyDelete){ return; }
+
+  for(i=0;i<SEL_TRANSFERS;i++){
+    t = &sel.xfer[i];
+    if(t->requestor != evt->window || t->property != evt->atom){ continue; }
+
+    len = term_sel_read(&t->range, &t->pos, sel.chunk, SELECTION_CHUNK);
+    XChangeProperty(dpy, t->requestor, t->property, t->type, 8, PropModeReplace, (unsigned char*)sel.chunk, len);
+
+    /* An empty chunk ends it */
+    if(len == 0){
+      if(t->requestor != win){
+        XSelectInput(dpy, t->requestor, NoEventMask);
+      }
+      t->requestor = None;
+    }
+    return;
+  }
+}
+
+void term_paste(Atom selection, Time time){
+  XConvertSelection(dpy, selection, atoms[ATOM_UTF8_STRING], atoms[ATOM_PASTE], win, time);
+}
+
+/*
+ * Queue the pasted property for
+ * the shell (reading it a chunk
+ * at a time), returning its size
+ */
+long term_paste_read(){
+  Atom type;
+  int format;
+  unsigned long nitems, after, i;
+  unsigned char *data;
+  long off = 0;
+
+  do {
+    if(XGetWindowProperty(dpy, win, atoms[ATOM_PASTE], off/4, SELECTION_CHUNK/4, False, AnyPropertyType, &type, &format, &nitems, &after, &data) != Success){
+      break;
+    }
+    if(format == 8){
+      /* The shell expects Return, not newlines */
+      for(i=0;i<nitems;i++){
+        if(data[i] == '\n'){ data[i] = '\r'; }
+      }
+      term_pty_write((char*)data, nitems);
+      off += nitems;
+    }
+    XFree(data);
+  } while(format == 8 && after > 0);
+
+  return off;
+}
+
+void term_paste_end(){
+  paste.incr = 0;
+  paste.waiting = 0;
+  if(paste.bracketed){
+    term_pty_write("\x1b[201~", 6);
+  }
+}
+
+/*
+ * A paste arrived: all of it,
+ * or the start of an INCR one
+ */
+void term_paste_notify(XSelectionEvent *evt){
+  Atom type;
+  int format;
+  unsigned long nitems, after;
+  unsigned char *data = NULL;
+
+  if(evt->property == None){ return; }
+
+  XGetWindowProperty(dpy, win, atoms[ATOM_PASTE], 0, 0, False, AnyPropertyType, &type, &format, &nitems, &after, &data);
+  if(data != NULL){
+    XFree(data);
+  }
+
+  paste.bracketed = bracketed_paste;
+  if(paste.bracketed){
+    term_pty_write("\x1b[200~", 6);
+  }
+
+  if(type == atoms[ATOM_INCR]){
+    /* Deleting it asks for the first chunk */
+    paste.incr = 1;
+    XDeleteProperty(dpy, win, atoms[ATOM_PASTE]);
+    return;
+  }
+
+  term_paste_read();
+  XDeleteProperty(dpy, win, atoms[ATOM_PASTE]);
+  term_paste_end();
+}
+
+void term_paste_chunk(XPropertyEvent *evt){
+  if(!paste.incr || evt->window != win || evt->atom != atoms[ATOM_PASTE] || evt->state != PropertyNewValue){ return; }
+
+  if(term_paste_read() == 0){
+    XDeleteProperty(dpy, win, atoms[ATOM_PASTE]);
+    term_paste_end();
+    return;
+  }
+
+  /* The next chunk is only asked for
+   *   once the shell has caught up
+   */
+  if(term_pty_queued() < PASTE_QUEUE_MAX){
+    XDeleteProperty(dpy, win, atoms[ATOM_PASTE]);
+  } else {
+    paste.waiting = 1;
+  }
+}
+
+int term_x_error(Display *d, XErrorEvent *err){
+  /* Requestors can go away mid-transfer */
+  if(err->error_code == BadWindow){ return 0; }
+  /* Only FONT_STRING is opened by name
+   *   without checking
+   */
+  if(err->error_code == BadName){ log_error(X_FONT_SET); }
+  return x_error_default(d, err);
+}
+
+//////////////////////////////
+// MOUSE REPORTING
+//
+// Programs asking for the mouse
+// get its buttons (and, in modes
+// 1002 and 1003, its motion) as
+// escape sequences, unless Shift
+// is held, which leaves it to the
+// selection. Motion is reported
+// at most once a frame, and only
+// when it reaches another cell.
+//
+/*
+ * The window's events: all pointer
+ * motion while there are hints to
+ * hover over or mode 1003 is on, and
+ * motion with a button held in 1002
+ */
+long term_x_events(){
+  return TERM_EVENTS |
+    (hint.ok || mouse.mode == 1003 ? PointerMotionMask : 0) |
+    (mouse.mode == 1002 ? ButtonMotionMask : 0);
+}
+
+void term_mouse_set(int mode, int on){
+  if(mode == 1006){
+    mouse.sgr = on;
+    return;
+  }
+
+  if(on){
+    mouse.mode = mode;
+  } else if(mouse.mode == mode){
+    mouse.mode = 0;
+  }
+  mouse.buttons = 0;
+  mouse.motion = 0;
+  mouse.col = mouse.row = -1;
+
+  if(headless){ return; }
+  XSelectInput(dpy, win, term_x_events());
+}
+
+/*
+ * Write a report for button code
+ * (0-2, 64-67 for wheels, with 32
+ * added for motion) at a cell
+ */
+void term_mouse_report(int code, int col, int row, unsigned int state, int release){
+  char buf[64];
+  int len;
+
+  if(state & ShiftMask){ code |= 4; }
+  if(state & Mod1Mask){ code |= 8; }
+  if(state & ControlMask){ code |= 16; }
+
+  if(mouse.sgr){
+    len = snprintf(buf, sizeof(buf), "\x1b[<%i;%i;%i%c", code, col+1, row+1, (release ? 'm' : 'M'));
+  } else {
+    /* Positions past 223 cannot be
+     *   encoded in a byte
+     */
+    if(col+1+32 > 255 || row+1+32 > 255){ return; }
+    if(release){ code = (code & ~3) | 3; }
+    len = snprintf(buf, sizeof(buf), "\x1b[M%c%c%c", code+32, col+1+32, row+1+32);
+  }
+
+  term_pty_write(buf, len);
+  mouse.col = col;
+  mouse.row = row;
+}
+
+void term_mouse_at(int px, int py, int *col, int *row){
+  *col = (px-LEFTMOST)/char_w;
+  *row = py/char_h;
+
+  if(*col < 0){ *col = 0; }
+  if(*col > term_width-1){ *col = term_width-1; }
+  if(*row < 0){ *row = 0; }
+  if(*row > term_height-1){ *row = term_height-1; }
+}
+
+/*
+ * Report motion held back since
+ * the last frame
+ */
+void term_mouse_flush(){
+  int code = 3,
+      b;
+
+  if(!mouse.motion){ return; }
+  mouse.motion = 0;
+  if(mouse.motion_col == mouse.col && mouse.motion_row == mouse.row){ return; }
+
+  for(b=0;b<3;b++){
+    if(mouse.buttons & (1 << b)){
+      code = b;
+      break;
+    }
+  }
+  term_mouse_report(code+32, mouse.motion_col, mouse.motion_row, mouse.motion_state, 0);
+}
+
+/*
+ * Report a button press or release,
+ * returning 0 if it is not being
+ * reported (and so is left to the
+ * selection and scrollback)
+ */
+int term_mouse_button(XButtonEvent *evt, int press){
+  int code, col, row;
+
+  if(!mouse.mode || evt->state & ShiftMask){ return 0; }
+
+  switch(evt->button){
+    case Button1: code = 0; break;
+    case Button2: code = 1; break;
+    case Button3: code = 2; break;
+    case Button4: code = 64; break;
+    case Button5: code = 65; break;
+    case 6:       code = 66; break;
+    case 7:       code = 67; break;
+    default:      return 1;
+  }
+
+  /* Wheels have no release */
+  if(code >= 64 && !press){ return 1; }
+
+  if(code < 64){
+    if(press){
+      mouse.buttons |= (1 << code);
+    } else {
+      mouse.buttons &= ~(1 << code);
+    }
+  }
+
+  term_mouse_flush();
+  term_mouse_at(evt->x, evt->y, &col, &row);
+  term_mouse_report(code, col, row, evt->state, !press);
+  return 1;
+}
+
+/*
+ * Note where the pointer has moved
+ * to, returning 0 if motion is not
+ * being reported
+ */
+int term_mouse_motion(XMotionEvent *evt){
+  if(!mouse.mode || evt->state & ShiftMask || sel.dragging){ return 0; }
+  if(mouse.mode == 1000 || (mouse.mode == 1002 && mouse.buttons == 0)){ return 1; }
+
+  term_mouse_at(evt->x, evt->y, &mouse.motion_col, &mouse.motion_row);
+  mouse.motion_state = evt->state;
+  mouse.motion = 1;
+  return 1;
+}
+
+//////////////////////////////
+// HINTS
+//
+// URLs, file:line references and
+// the like (hint_patterns) are found
+// by one DFA, built at startup, run
+// over a logical line at a time.
+// Nothing is scanned as output
+// arrives: lines are scanned when
+// the pointer is over them, in hint
+// mode, or between events once the
+// shell is quiet, and the results
+// are kept until the line's cells
+// change or it scrolls out of the
+// cache.
+//
+/*
+ * Drop every line cached (the grid
+ * was swapped or laid out anew),
+ * with when each row changed
+ */
+void term_hint_forget(){
+  size_t rows = (size_t)term_height+SCROLLBACK_LINES;
+
+  hint.rows = realloc(hint.rows, rows*sizeof(uint64_t));
+  memset(hint.rows, 0, rows*sizeof(uint64_t));
+  memset(hint.lines, 0, sizeof(hint.lines));
+}
+
+void term_hint_init(){
+  int count = sizeof(hint_patterns)/sizeof(hint_patterns[0]),
+      i;
+
+  term_hint_forget();
+  if(dfa_compile(&hint.dfa, hint_patterns, count) == DFA_SUCCESS){
+    hint.ok = 1;
+    return;
+  }
+
+  /* Blame the first which fails alone */
+  for(i=0;i<count-1;i++){
+    if(dfa_compile(&hint.dfa, &hint_patterns[i], 1) != DFA_SUCCESS){ break; }
+    dfa_free(&hint.dfa);
+  }
+  log_warn(TERM_WARN_HINT, (char*)hint_patterns[i]);
+}
+
+/*
+ * Note that the cells of rows from
+ * to to (of the showing grid) have
+ * changed, so any line cached over
+ * them is scanned again
+ */
+void term_hint_touch(int from, int to){
+  int r;
+
+  hint.gen++;
+  for(r=from;r<=to;r++){
+    hint.rows[(buf_top+r+buf_rows) % buf_rows] = hint.gen;
+  }
+}
+
+/*
+ * Whether the rows a cached line
+ * was scanned from (other than any
+ * spilled, which never change) are
+ * as they were
+ */
+int term_hint_fresh(struct term_hint_line *l, int row){
+  int r;
+
+  for(r=(row > -hist_len ? row : -hist_len);r<row+l->rows;r++){
+    if(hint.rows[(buf_top+r+buf_rows) % buf_rows] > l->gen){ return 0; }
+  }
+  return 1;
+}
+
+/*
+ * Return the row a logical line
+ * containing row starts on, or
+ * term_height (never a start) if
+ * that is more than HINT_SPAN
+ * rows up
+ */
+int term_hint_line_start(int row){
+  int d;
+
+  for(d=0;d<HINT_SPAN;d++){
+    if(row-d <= -TERM_HIST || !(CELL_FLAGS(term_row(row-d-1)[term_width-1]) & TERM_CELL_WRAP)){
+      return row-d;
+    }
+  }
+  return term_height;
+}
+
+/*
+ * Return the hints on the logical
+ * line starting at row, scanning
+ * it only if its rows changed
+ * since it was last scanned
+ */
+struct term_hint_line *term_hint_line(int row){
+  struct term_hint_line *l;
+  uint128_t *cells;
+  uint64_t line = lines_total+row;
+  int n = 0,
+      r, c, i, len, end, wrapped;
+
+  l = &hint.lines[line % HINT_CACHE];
+  if(l->line == line && l->alt == alt_screen && l->width == term_width && term_hint_fresh(l, row)){
+    return l;
+  }
+
+  if(hint.cap < HINT_SPAN*term_width){
+    hint.cap = HINT_SPAN*term_width;
+    hint.text = realloc(hint.text, hint.cap);
+    hint.map = realloc(hint.map, hint.cap*sizeof(int));
+  }
+
+  for(r=row,wrapped=1;wrapped && r<row+HINT_SPAN && r<term_height;r++){
+    cells = term_row(r);
+    wrapped = CELL_FLAGS(cells[term_width-1]) & TERM_CELL_WRAP;
+    for(c=0;c<term_width;c++){
+      if(CELL_FLAGS(cells[c]) & TERM_CELL_DUMMY){ continue; }
+      hint.text[n] = dfa_symbol(term_cell_base(cells[c]));
+      hint.map[n++] = ((r-row)*term_width)+c;
+    }
+  }
+
+  l->line = line;
+  l->gen = hint.gen;
+  l->alt = alt_screen;
+  l->width = term_width;
+  l->rows = r-row;
+  l->len = 0;
+
+  /* Leftmost-longest, starting only
+   *   at the beginning of a word
+   */
+  for(i=0;i<n && l->len<HINT_MAX;){
+    if(i > 0 && (isalnum(hint.text[i-1]) || hint.text[i-1] == DFA_OTHER)){
+      i++;
+      continue;
+    }
+    if((len=dfa_match(&hint.dfa, &hint.text[i], n-i, &l->hints[l->len].pattern)) == 0){
+      i++;
+      continue;
+    }
+
+    /* Sentence punctuation after a
+     *   URL is not part of it
+     */
+    while(len > 1 && strchr(".,;:!?)", hint.text[i+len-1]) != NULL){ len--; }
+
+    end = hint.map[i+len-1];
+    cells = term_row(row+(end/term_width));
+    end += (CELL_FLAGS(cells[end%term_width]) & TERM_CELL_WIDE ? 2 : 1);
+
+    l->hints[l->len].line = line;
+    l->hints[l->len].col = hint.map[i];
+    l->hints[l->len].len = end-hint.map[i];
+    l->len++;
+    i += len;
+  }
+
+  return l;
+}
+
+/*
+ * Find the hint over a cell,
+ * returning 0 if there is none
+ */
+int term_hint_find(int row, int col, struct term_hint *out){
+  struct term_hint_line *l;
+  int start, off, i;
+
+  if(!hint.ok || (start=term_hint_line_start(row)) >= term_height){ return 0; }
+
+  l = term_hint_line(start);
+  off = ((row-start)*term_width)+col;
+  for(i=0;i<l->len;i++){
+    if(off >= l->hints[i].col && off < l->hints[i].col+l->hints[i].len){
+      *out = l->hints[i];
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int term_hint_covers(struct term_hint *m, int pos_x, int pos_y){
+  uint64_t line = lines_total+pos_y;
+  int64_t off;
+
+  if(m->len == 0 || line < m->line){ return 0; }
+  off = ((int64_t)(line-m->line)*term_width)+pos_x;
+  return (off >= m->col && off < m->col+m->len);
+}
+
+/*
+ * Return how a cell is shown: 1
+ * if it is underlined (hovered,
+ * or labelled in hint mode), or
+ * 2 plus the label's index if it
+ * is showing a label
+ */
+int term_hint_hit(int pos_x, int pos_y){
+  int i;
+
+  if(hint.active){
+    for(i=0;i<hint.labels_len;i++){
+      if(term_hint_covers(&hint.labels[i], pos_x, pos_y)){
+        return (lines_total+pos_y == hint.labels[i].line+(hint.labels[i].col/term_width) &&
+                pos_x == hint.labels[i].col%term_width ? 2+i : 1);
+      }
+    }
+  }
+  return term_hint_covers(&hint.hover, pos_x, pos_y);
+}
+
+void term_hint_damage(struct term_hint *m){
+  if(m->len == 0){ return; }
+  term_redraw_lines(m->line+(m->col/term_width), m->line+((m->col+m->len-1)/term_width));
+}
+
+/*
+ * Run a hint's command, from the
+ * shell's directory, without
+ * waiting for it
+ */
+void term_hint_open(struct term_hint *m){
+  struct term_sel_range r;
+  struct term_sel_pos pos;
+  char cwd[64];
+  int n;
+  pid_t pid;
+
+  r.start.line = m->line+(m->col/term_width);
+  r.start.col = m->col%term_width;
+  r.end.line = m->line+((m->col+m->len-1)/term_width);
+  r.end.col = (m->col+m->len-1)%term_width;
+  r.alt = alt_screen;
+  r.set = 1;
+  pos = r.start;
+  n = term_sel_read(&r, &pos, sel.chunk, SELECTION_CHUNK-1);
+  if(n == 0){ return; }
+  sel.chunk[n] = '\0';
+
+  /* Orphaned, so never a zombie */
+  if((pid=fork()) == 0){
+    if(fork() == 0){
+      setsid();
+      close(pty_m);
+      close(ConnectionNumber(dpy));
+      snprintf(cwd, sizeof(cwd), "/proc/%i/cwd", shell_pid);
+      if(chdir(cwd) != 0){}
+      execl("/bin/sh", "sh", "-c", hint_commands[m->pattern], "sh", sel.chunk, NULL);
+    }
+    _exit(0);
+  } else if(pid > 0){
+    waitpid(pid, NULL, 0);
+  }
+}
+
+/*
+ * Underline whatever is under the
+ * pointer, once per frame
+ */
+void term_hint_hover(){
+  struct term_hint found = { 0 },
+                   prev = hint.hover;
+  int col, row;
+
+  hint.moved = 0;
+  if(hint.px >= 0){
+    term_mouse_at(hint.px, hint.py, &col, &row);
+    if(!term_hint_find(row-viewport, col, &found)){
+      found.len = 0;
+    }
+  }
+
+  if(found.len == prev.len && found.line == prev.line && found.col == prev.col){ return; }
+  hint.hover = found;
+  term_hint_damage(&prev);
+  term_hint_damage(&hint.hover);
+}
+
+/*
+ * Note where the pointer is, or
+ * that it has left (px < 0)
+ */
+void term_hint_motion(int px, int py){
+  hint.px = px;
+  hint.py = py;
+  hint.moved = 1;
+}
+
+/*
+ * Open the hint under a Ctrl+click,
+ * returning 0 if there is none
+ */
+int term_hint_click(XButtonEvent *evt){
+  struct term_hint m;
+  int col, row;
+
+  if(evt->button != Button1 || !(evt->state & ControlMask)){ return 0; }
+
+  term_mouse_at(evt->x, evt->y, &col, &row);
+  if(!term_hint_find(row-viewport, col, &m)){ return 0; }
+  term_hint_open(&m);
+  return 1;
+}
+
+/*
+ * Label the hints on screen,
+ * from the bottom up
+ */
+void term_hint_start(){
+  struct term_hint_line *l;
+  int row, start, prev = term_height, i, first;
+
+  if(!hint.ok){ return; }
+
+  hint.labels_len = 0;
+  for(row=term_height-1-viewport;row>=-viewport && hint.labels_len<HINT_LABELS;row--){
+    if((start=term_hint_line_start(row)) >= term_height || start == prev){ continue; }
+    prev = start;
+
+    l = term_hint_line(start);
+    for(i=l->len-1;i>=0 && hint.labels_len<HINT_LABELS;i--){
+      first = start+(l->hints[i].col/term_width);
+      if(first+viewport >= 0 && first+viewport < term_height){
+        hint.labels[hint.labels_len++] = l->hints[i];
+      }
+    }
+  }
+
+  if(hint.labels_len > 0){
+    hint.active = 1;
+    term_redraw();
+  }
+}
+
+void term_hint_stop(){
+  hint.active = 0;
+  term_redraw();
+}
+
+void term_hint_key(KeySym ksym){
+  int i = ksym-XK_a;
+
+  if(i >= 0 && i < hint.labels_len){
+    term_hint_open(&hint.labels[i]);
+  }
+  term_hint_stop();
+}
+
+/*
+ * Scan the rows on screen for one
+ * time slice while the shell is
+ * quiet, so hovering and hint mode
+ * find them already scanned
+ */
+void term_hint_step(){
+  struct timespec start;
+  int row;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  for(;hint.scan<term_height;hint.scan++){
+    row = hint.scan-viewport;
+    if(term_hint_line_start(row) == row){
+      term_hint_line(row);
+    }
+    if(term_elapsed(&start)*1000 >= HINT_SLICE_US){
+      hint.scan++;
+      return;
+    }
+  }
+
+  hint.stale = 0;
+  hint.scan = 0;
+  if(hint.hover.len > 0){
+    hint.moved = 1;
+  }
+}
+
+//////////////////////////////
+// GRAPHICS
+//
+// The kitty graphics protocol.
+// Images are converted and sent
+// to the X server once, into a
+// Pixmap, and placements (anchored
+// to an absolute line, so they
+// scroll with the text) are copied
+// from it whenever their rows are
+// redrawn. Files and shared memory
+// are read through a mapping.
+//
+// Only raw RGB and RGBA data is
+// understood: PNG and compressed
+// data would need zlib.
+//
+/*
+ * Decode base64 into out (which
+ * may be in), returning its length
+ */
+size_t term_gfx_b64(const char *in, size_t len, unsigned char *out){
+  uint32_t acc = 0;
+  size_t n = 0, i;
+  int bits = 0, v;
+  char c;
+
+  for(i=0;i<len;i++){
+    c = in[i];
+    if(c >= 'A' && c <= 'Z'){ v = c-'A'; }
+    else if(c >= 'a' && c <= 'z'){ v = c-'a'+26; }
+    else if(c >= '0' && c <= '9'){ v = c-'0'+52; }
+    else if(c == '+'){ v = 62; }
+    else if(c == '/'){ v = 63; }
+    else { continue; }
+
+    acc = (acc << 6) | v;
+    bits += 6;
+    if(bits >= 8){
+      bits -= 8;
+      out[n++] = (acc >> bits) & 0xff;
+    }
+  }
+  return n;
+}
+
+/*
+ * Read the keys of a command,
+ * returning its payload
+ */
+char *term_gfx_parse(char *buf, struct term_gfx_cmd *cmd){
+  char key;
+  long val;
+
+  memset(cmd, 0, sizeof(struct term_gfx_cmd));
+  cmd->a = 't';
+  cmd->t = 'd';
+  cmd->d = 'a';
+  cmd->f = 32;
+
+  while(*buf != '\0' && *buf != ';'){
+    key = *buf++;
+    if(*buf++ != '='){ break; }
+
+    if((*buf >= 'a' && *buf <= 'z') || (*buf >= 'A' && *buf <= 'Z')){
+      val = *buf++;
+    } else {
+      val = strtol(buf, &buf, 10);
+    }
+
+    switch(key){
+      case 'a': cmd->a = val; break;
+      case 't': cmd->t = val; break;
+      case 'o': cmd->o = val; break;
+      case 'd': cmd->d = val; break;
+      case 'f': cmd->f = val; break;
+      case 's': cmd->s = val; break;
+      case 'v': cmd->v = val; break;
+      case 'S': cmd->S = val; break;
+      case 'O': cmd->O = val; break;
+      case 'm': cmd->m = val; break;
+      case 'q': cmd->q = val; break;
+      case 'c': cmd->c = val; break;
+      case 'r': cmd->r = val; break;
+      case 'x': cmd->x = val; break;
+      case 'y': cmd->y = val; break;
+      case 'w': cmd->w = val; break;
+      case 'h': cmd->h = val; break;
+      case 'C': cmd->C = val; break;
+      case 'i': cmd->i = val; break;
+      case 'p': cmd->p = val; break;
+    }
+
+    while(*buf != '\0' && *buf != ',' && *buf != ';'){ buf++; }
+    if(*buf == ','){ buf++; }
+  }
+
+  return (*buf == ';' ? buf+1 : buf);
+}
+
+void term_gfx_reply(struct term_gfx_cmd *cmd, const char *msg){
+  char out[256];
+  int len;
+
+  /* Only commands with an id get
+   *   replies (q=1 silences OK,
+   *   q=2 errors too)
+   */
+  if(cmd->i == 0 || cmd->q >= 2 || (cmd->q == 1 && strcmp(msg, "OK") == 0)){ return; }
+
+  if(cmd->p != 0){
+    len = snprintf(out, sizeof(out), "\x1b_Gi=%u,p=%u;%s\x1b\\", cmd->i, cmd->p, msg);
+  } else {
+    len = snprintf(out, sizeof(out), "\x1b_Gi=%u;%s\x1b\\", cmd->i, msg);
+  }
+  term_pty_write(out, len);
+}
+
+int term_gfx_find(uint32_t id){
+  int i;
+
+  for(i=0;i<gfx.images_len;i++){
+    if(gfx.images[i].id == id){ return i; }
+  }
+  return -1;
+}
+
+void term_gfx_unplace(int i){
+  struct term_placement *p = &gfx.places[i];
+
+  term_redraw_lines(p->line, p->line+p->rows-1);
+  *p = gfx.places[--gfx.places_len];
+}
+
+void term_gfx_free(int i){
+  int k;
+
+  for(k=gfx.places_len-1;k>=0;k--){
+    if(gfx.places[k].image == gfx.images[i].id){
+      term_gfx_unplace(k);
+    }
+  }
+
+  XFreePixmap(dpy, gfx.images[i].pix);
+  gfx.bytes -= (size_t)gfx.images[i].w*gfx.images[i].h*4;
+  gfx.images[i] = gfx.images[--gfx.images_len];
+}
+
+/*
+ * Drop the least recently drawn
+ * images until the cache fits
+ * its budget
+ */
+void term_gfx_evict(){
+  int i, lru;
+
+  while(gfx.bytes > IMAGE_CACHE_BYTES && gfx.images_len > 0){
+    lru = 0;
+    for(i=1;i<gfx.images_len;i++){
+      if(gfx.images[i].used < gfx.images[lru].used){ lru = i; }
+    }
+    term_gfx_free(lru);
+  }
+}
+
+/*
+ * Check a transmission, and
+ * (unless it is only a query)
+ * send the image to the X server
+ */
+const char *term_gfx_upload(struct term_gfx_cmd *cmd, const unsigned char *data, size_t len){
+  struct term_image *img;
+  XImage *ximg;
+  uint32_t *stripe, a;
+  const unsigned char *px;
+  int bpp = cmd->f/8,
+      row, rows, i, k;
+
+  if(cmd->o != 0){ return "EINVAL:compressed data is not supported"; }
+  if(cmd->f == 100){ return "EINVAL:PNG is not supported"; }
+  if(cmd->f != 24 && cmd->f != 32){ return "EINVAL:unknown format"; }
+  if(cmd->s <= 0 || cmd->v <= 0 || cmd->s > 10000 || cmd->v > 10000){ return "EINVAL:bad image size"; }
+  if(len < (size_t)cmd->s*cmd->v*bpp){ return "ENODATA:insufficient image data"; }
+  if((size_t)cmd->s*cmd->v*4 > IMAGE_CACHE_BYTES){ return "EFBIG:image too large"; }
+  if(cmd->a == 'q'){ return NULL; }
+  if(headless){ return "ENOTSUP:images are not drawn headless"; }
+
+  /* Replacing an image drops its
+   *   placements
+   */
+  if(cmd->i == 0){
+    cmd->i = gfx.next_id++;
+  } else if((i=term_gfx_find(cmd->i)) >= 0){
+    term_gfx_free(i);
+  }
+
+  if(gfx.images_len == gfx.images_cap){
+    gfx.images_cap = (gfx.images_cap > 0 ? gfx.images_cap*2 : 16);
+    gfx.images = realloc(gfx.images, gfx.images_cap*sizeof(struct term_image));
+  }
+  img = &gfx.images[gfx.images_len++];
+  img->id = cmd->i;
+  img->w = cmd->s;
+  img->h = cmd->v;
+  img->used = ++gfx.tick;
+  img->pix = XCreatePixmap(dpy, win, img->w, img->h, DefaultDepth(dpy, DefaultScreen(dpy)));
+
+  /* Converted (with alpha blended
+   *   onto the background) a stripe
+   *   at a time
+   */
+  stripe = malloc((size_t)img->w*GFX_STRIPE_ROWS*sizeof(uint32_t));
+  ximg = XCreateImage(
+    dpy,
+    DefaultVisual(dpy, DefaultScreen(dpy)),
+    DefaultDepth(dpy, DefaultScreen(dpy)),
+    ZPixmap,
+    0,
+    (char*)stripe,
+    img->w, GFX_STRIPE_ROWS,
+    32,
+    0
+  );
+
+  for(row=0;row<img->h;row+=GFX_STRIPE_ROWS){
+    rows = (img->h-row < GFX_STRIPE_ROWS ? img->h-row : GFX_STRIPE_ROWS);
+    px = &data[(size_t)row*img->w*bpp];
+    for(i=0;i<rows*img->w;i++,px+=bpp){
+      a = (bpp == 4 ? px[3] : 255);
+      stripe[i] = 0;
+      for(k=0;k<3;k++){
+        stripe[i] = (stripe[i] << 8) |
+          (((px[k]*a)+(((bg_default >> (16-(k*8))) & 0xff)*(255-a)))/255);
+      }
+    }
+    XPutImage(dpy, img->pix, DefaultGC(dpy, DefaultScreen(dpy)), ximg, 0, 0, 0, row, img->w, rows);
+  }
+
+  ximg->data = NULL;
+  XDestroyImage(ximg);
+  free(stripe);
+
+  gfx.bytes += (size_t)img->w*img->h*4;
+  term_gfx_evict();
+  return NULL;
+}
+
+/*
+ * Resolve name into path, returning 0
+ * unless it is a temporary file: named
+ * as such, directly inside one of the
+ * temporary directories
+ */
+int term_gfx_temp(const char *name, char *path){
+  const char *dirs[] = { getenv("TMPDIR"), "/tmp", "/dev/shm" };
+  char dir[PATH_MAX],
+       *slash;
+  int i,
+      ok = 0;
+
+  if(realpath(name, path) == NULL){ return 0; }
+  slash = strrchr(path, '/');
+  if(strstr(slash+1, "tty-graphics-protocol") == NULL){ return 0; }
+
+  *slash = '\0';
+  for(i=0;i<3 && !ok;i++){
+    ok = (dirs[i] != NULL && realpath(dirs[i], dir) != NULL && strcmp(dir, (slash == path ? "/" : path)) == 0);
+  }
+  *slash = '/';
+  return ok;
+}
+
+/*
+ * Upload from a file, temporary
+ * file or shared memory object,
+ * straight out of a mapping of it
+ */
+const char *term_gfx_load(struct term_gfx_cmd *cmd, const char *name){
+  struct stat st;
+  unsigned char *map;
+  const char *err;
+  char path[PATH_MAX];
+  size_t size;
+  int fd;
+
+  /* Temporary files are deleted once
+   *   read, so only real ones are
+   *   accepted (and by the name they
+   *   resolve to)
+   */
+  if(cmd->t == 't'){
+    if(!term_gfx_temp(name, path)){ return "EPERM:not a temporary file"; }
+    name = path;
+  }
+
+  if(cmd->t == 's'){
+    fd = shm_open(name, O_RDONLY, 0);
+  } else {
+    fd = open(name, O_RDONLY | (cmd->t == 't' ? O_NOFOLLOW : 0));
+  }
+  if(fd < 0){ return "EBADF:cannot open"; }
+  if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || cmd->O < 0 || cmd->O >= st.st_size){
+    close(fd);
+    return "EBADF:not a regular file";
+  }
+
+  size = st.st_size-cmd->O;
+  if(cmd->S > 0 && (size_t)cmd->S < size){ size = cmd->S; }
+
+  map = mmap(NULL, cmd->O+size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED){ return "EBADF:cannot map"; }
+
+  err = term_gfx_upload(cmd, map+cmd->O, size);
+  munmap(map, cmd->O+size);
+
+  if(err == NULL && cmd->a != 'q'){
+    if(cmd->t == 't'){
+      unlink(name);
+    } else if(cmd->t == 's'){
+      shm_unlink(name);
+    }
+  }
+  return err;
+}
+
+/*
+ * Show an image at the cursor
+ * (moving the cursor past it,
+ * unless C=1)
+ */
+const char *term_gfx_place(struct term_gfx_cmd *cmd){
+  struct term_image *img;
+  struct term_placement *p;
+  int i;
+
+  if((i=term_gfx_find(cmd->i)) < 0){ return "ENOENT:no such image"; }
+  img = &gfx.images[i];
+
+  for(i=0;i<gfx.places_len;i++){
+    if(gfx.places[i].image == cmd->i && gfx.places[i].id == cmd->p){
+      term_gfx_unplace(i);
+      break;
+    }
+  }
+
+  if(gfx.places_len == gfx.places_cap){
+    gfx.places_cap = (gfx.places_cap > 0 ? gfx.places_cap*2 : 16);
+    gfx.places = realloc(gfx.places, gfx.places_cap*sizeof(struct term_placement));
+  }
+  p = &gfx.places[gfx.places_len++];
+  p->image = cmd->i;
+  p->id = cmd->p;
+  p->line = lines_total+y_next;
+  p->col = x_next;
+  p->alt = alt_screen;
+  p->x = (cmd->x < img->w ? cmd->x : 0);
+  p->y = (cmd->y < img->h ? cmd->y : 0);
+  p->w = (cmd->w > 0 && cmd->w < img->w-p->x ? cmd->w : img->w-p->x);
+  p->h = (cmd->h > 0 && cmd->h < img->h-p->y ? cmd->h : img->h-p->y);
+
+  /* Images are not scaled, only
+   *   cropped to c columns and r rows
+   */
+  if(cmd->c > 0 && cmd->c*char_w < p->w){ p->w = cmd->c*char_w; }
+  if(cmd->r > 0 && cmd->r*char_h < p->h){ p->h = cmd->r*char_h; }
+  p->cols = (p->w+char_w-1)/char_w;
+  p->rows = (p->h+char_h-1)/char_h;
+
+  term_redraw_lines(p->line, p->line+p->rows-1);
+
+  if(cmd->C != 1){
+    for(i=1;i<p->rows;i++){
+      term_newline();
+    }
+    x_next += p->cols;
+    if(x_next >= term_width){
+      x_next = 0;
+      term_newline();
+    }
+  }
+  return NULL;
+}
+
+void term_gfx_delete(struct term_gfx_cmd *cmd){
+  int i, k;
+
+  switch(cmd->d){
+    case 'a':
+    case 'A':
+      for(k=gfx.places_len-1;k>=0;k--){
+        if(gfx.places[k].alt == alt_screen){ term_gfx_unplace(k); }
+      }
+      break;
+    case 'i':
+    case 'I':
+      for(k=gfx.places_len-1;k>=0;k--){
+        if(gfx.places[k].image == cmd->i && (cmd->p == 0 || gfx.places[k].id == cmd->p)){
+          term_gfx_unplace(k);
+        }
+      }
+      break;
+  }
+
+  /* Upper case also frees the
+   *   images left with nowhere
+   *   to be shown
+   */
+  if(cmd->d == 'A' || cmd->d == 'I'){
+    for(i=gfx.images_len-1;i>=0;i--){
+      for(k=0;k<gfx.places_len && gfx.places[k].image != gfx.images[i].id;k++);
+      if(k == gfx.places_len && (cmd->d == 'A' || gfx.images[i].id == cmd->i)){
+        term_gfx_free(i);
+      }
+    }
+  }
+}
+
+/*
+ * Delete placements starting
+ * between two absolute lines
+ */
+void term_gfx_clear(uint64_t from, uint64_t to){
+  int k;
+
+  for(k=gfx.places_len-1;k>=0;k--){
+    if(gfx.places[k].alt == alt_screen && gfx.places[k].line >= from && gfx.places[k].line <= to){
+      term_gfx_unplace(k);
+    }
+  }
+}
+
+void term_gfx_command(char *buf){
+  struct term_gfx_cmd cmd;
+  char *payload = term_gfx_parse(buf, &cmd);
+  const char *err = NULL;
+  size_t len = strlen(payload);
+  int i;
+
+  /* Later chunks of a direct
+   *   transmission only carry m
+   *   (and perhaps q)
+   */
+  if(gfx.uploading){
+    gfx.upload.m = cmd.m;
+    if(cmd.q != 0){ gfx.upload.q = cmd.q; }
+    cmd = gfx.upload;
+  } else if(cmd.m && cmd.t == 'd' && (cmd.a == 't' || cmd.a == 'T' || cmd.a == 'q')){
+    gfx.uploading = 1;
+    gfx.upload = cmd;
+    gfx.upload_err = NULL;
+    gfx.data_len = 0;
+  }
+
+  switch(cmd.a){
+    case 't':
+    case 'T':
+    case 'q':
+      if(cmd.t == 'd'){
+        if(gfx.data_len+len > IMAGE_CACHE_BYTES){
+          gfx.upload_err = "EFBIG:image too large";
+        }
+        if(gfx.upload_err == NULL){
+          if(gfx.data_len+len > gfx.data_cap){
+            while(gfx.data_len+len > gfx.data_cap){
+              gfx.data_cap = (gfx.data_cap > 0 ? gfx.data_cap*2 : 4096);
+            }
+            if(gfx.data_cap > IMAGE_CACHE_BYTES){ gfx.data_cap = IMAGE_CACHE_BYTES; }
+            gfx.data = realloc(gfx.data, gfx.data_cap);
+          }
+          gfx.data_len += term_gfx_b64(payload, len, gfx.data+gfx.data_len);
+        }
+        if(cmd.m){ return; }
+
+        err = (gfx.upload_err != NULL ? gfx.upload_err : term_gfx_upload(&cmd, gfx.data, gfx.data_len));
+        gfx.uploading = 0;
+        gfx.upload_err = NULL;
+        gfx.data_len = 0;
+      } else if(cmd.t == 'f' || cmd.t == 't' || cmd.t == 's'){
+        /* The payload is the name,
+         *   decoded in place
+         */
+        len = term_gfx_b64(payload, len, (unsigned char*)payload);
+        payload[len] = '\0';
+        err = term_gfx_load(&cmd, payload);
+      } else {
+        err = "EINVAL:unknown transmission medium";
+      }
+
+      if(err == NULL && cmd.a == 'T'){
+        err = term_gfx_place(&cmd);
+      }
+      break;
+    case 'p':
+      err = term_gfx_place(&cmd);
+      break;
+    case 'd':
+      term_gfx_delete(&cmd);
+      return;
+    default:
+      err = "EINVAL:unknown action";
+      break;
+  }
+
+  /* Ids handed out here are not
+   *   the client's to hear about
+   */
+  if(cmd.i >= GFX_ID_INTERNAL){
+    cmd.i = 0;
+  }
+  term_gfx_reply(&cmd, (err != NULL ? err : "OK"));
+
+  /* Placements scrolled out of the
+   *   scrollback go too
+   */
+  for(i=gfx.places_len-1;i>=0;i--){
+    if(gfx.places[i].alt == alt_screen && gfx.places[i].line+gfx.places[i].rows <= lines_total-TERM_HIST){
+      gfx.places[i] = gfx.places[--gfx.places_len];
+    }
+  }
+}
+
+/*
+ * Copy the slices of any images
+ * placed on a row onto the window
+ */
+void term_gfx_draw_row(int line){
+  struct term_placement *p;
+  uint64_t abs = lines_total+line;
+  int i, img, off, h;
+
+  for(i=0;i<gfx.places_len;i++){
+    p = &gfx.places[i];
+    if(p->alt != alt_screen || abs < p->line || abs >= p->line+p->rows){ continue; }
+    if((img=term_gfx_find(p->image)) < 0){ continue; }
+
+    off = (abs-p->line)*char_h;
+    h = (p->h-off < char_h ? p->h-off : char_h);
+    term_x_copy(
+      gfx.images[img].pix,
+      p->x, p->y+off,
+      p->w, h,
+      (p->col*char_w)+LEFTMOST, (line+viewport)*char_h
+    );
+    term_shadow_damage(p->col, line+viewport, (p->w+char_w-1)/char_w, 1);
+    gfx.images[img].used = ++gfx.tick;
+  }
+}
+
+//////////////////////////////
+// OSC SEQUENCES
+//
+// Operating system commands set
+// the window's title (0 and 2),
+// palette entries (4) and the
+// default colors (10 and 11),
+// which "?" asks for instead, and
+// the clipboard (52). A clipboard
+// can be far larger than the
+// string buffer, so its base64 is
+// decoded whenever that fills.
+//
+/*
+ * Parse an X color specification
+ * (rgb:r/g/b with 1 to 4 hex digits
+ * each, #rgb to #rrrrggggbbbb, or,
+ * given an X server, a name)
+ */
+int term_osc_color(char *spec, uint32_t *out){
+  XColor color;
+  unsigned long v;
+  char *end,
+       part[5];
+  int c[3],
+      digits, i;
+
+  if(strncmp(spec, "rgb:", 4) == 0){
+    spec += 4;
+    for(i=0;i<3;i++){
+      if(!isxdigit((unsigned char)*spec)){ return 0; }
+      v = strtoul(spec, &end, 16);
+      digits = end-spec;
+      if(digits > 4 || *end != (i < 2 ? '/' : '\0')){ return 0; }
+      c[i] = (v*255)/((1UL << (digits*4))-1);
+      spec = end+1;
+    }
+  } else if(spec[0] == '#'){
+    digits = strlen(++spec);
+    if(digits == 0 || digits > 12 || digits % 3 != 0 ||
+       (int)strspn(spec, "0123456789abcdefABCDEF") != digits){
+      return 0;
+    }
+    digits /= 3;
+    for(i=0;i<3;i++){
+      memcpy(part, spec+(i*digits), digits);
+      part[digits] = '\0';
+      v = strtoul(part, NULL, 16);
+      c[i] = (digits == 1 ? v << 4 : v >> ((digits-2)*4));
+    }
+  } else if(!headless && XParseColor(dpy, DefaultColormap(dpy, DefaultScreen(dpy)), spec, &color)){
+    c[0] = color.red >> 8;
+    c[1] = color.green >> 8;
+    c[2] = color.blue >> 8;
+  } else {
+    return 0;
+  }
+
+  *out = (c[0] << 16) | (c[1] << 8) | c[2];
+  return 1;
+}
+
+/*
+ * Answer a query for a color,
+ * ended as the query was (by
+ * ST or BEL)
+ */
+void term_osc_reply(char *name, uint32_t color, int st){
+  char out[64];
+  int len;
+
+  len = snprintf(
+    out, sizeof(out), "\x1b]%s;rgb:%04x/%04x/%04x%s",
+    name,
+    ((color >> 16) & 0xff)*0x101,
+    ((color >> 8) & 0xff)*0x101,
+    (color & 0xff)*0x101,
+    (st ? "\x1b\\" : "\a")
+  );
+  term_pty_write(out, len);
+}
+
+void term_osc_title(char *text){
+  size_t len = strlen(text);
+
+  /* Not cut partway through a character */
+  if(len > TITLE_MAX-1){
+    for(len=TITLE_MAX-1;len>0 && (text[len] & 0xc0) == 0x80;len--);
+  }
+  memcpy(osc.title, text, len);
+  osc.title[len] = '\0';
+  osc.title_pending = 1;
+}
+
+/*
+ * Send the title, once a frame (so
+ * a shell setting it at every
+ * prompt costs a request at most,
+ * and none if it is unchanged)
+ */
+void term_osc_flush(){
+  if(!osc.title_pending){ return; }
+  osc.title_pending = 0;
+
+  if(headless || strcmp(osc.title, osc.title_shown) == 0){ return; }
+  strcpy(osc.title_shown, osc.title);
+
+  term_x_atoms();
+  XStoreName(dpy, win, osc.title);
+  XChangeProperty(dpy, win, atoms[ATOM_NET_WM_NAME], atoms[ATOM_UTF8_STRING], 8, PropModeReplace, (unsigned char*)osc.title, strlen(osc.title));
+}
+
+/*
+ * OSC 4: index;color pairs (any
+ * number of them), the first 16
+ * of which are also the 8 and
+ * bright 8 colors
+ */
+void term_osc_palette(char *arg, int st){
+  char *spec, *next,
+       name[16];
+  uint32_t color;
+  long i;
+
+  while(*arg != '\0'){
+    i = strtol(arg, &spec, 10);
+    if(spec == arg || *spec != ';' || i < 0 || i > 255){ return; }
+    spec++;
+    if((next=strchr(spec, ';')) != NULL){
+      *next++ = '\0';
+    } else {
+      next = spec+strlen(spec);
+    }
+    arg = next;
+
+    if(strcmp(spec, "?") == 0){
+      snprintf(name, sizeof(name), "4;%ld", i);
+      term_osc_reply(name, (i < 8 ? esc_palette_8[i] : (i < 16 ? esc_palette_8_bright[i-8] : esc_palette_256[i])), st);
+    } else if(term_osc_color(spec, &color)){
+      esc_palette_256[i] = color;
+      if(i < 8){
+        esc_palette_8[i] = color;
+      } else if(i < 16){
+        esc_palette_8_bright[i-8] = color;
+      }
+    }
+  }
+}
+
+void term_osc_recolor(uint128_t *cells, size_t len, int shift, uint32_t from, uint32_t to){
+  uint128_t mask = (uint128_t)0xffffff << shift;
+  size_t i;
+
+  for(i=0;i<len;i++){
+    if(cells[i] != 0 && ((uint32_t)(cells[i] >> shift) & 0xffffff) == from){
+      cells[i] = (cells[i] & ~mask) | ((uint128_t)to << shift);
+    }
+  }
+}
+
+/*
+ * OSC 10 and 11: the default fore-
+ * ground or background, which text
+ * already written in it (kept as a
+ * color like any other) follows
+ */
+void term_osc_default(int num, char *spec, int st){
+  uint32_t *def = (num == 10 ? &fg_default : &bg_default),
+           *pen = (num == 10 ? &fg : &bg),
+           *saved = (num == 10 ? &fg_saved : &bg_saved),
+           color, old;
+  int shift = (num == 10 ? 32 : 56);
+
+  if(strcmp(spec, "?") == 0){
+    term_osc_reply((num == 10 ? "10" : "11"), *def, st);
+    return;
+  }
+  if(!term_osc_color(spec, &color) || color == *def){ return; }
+
+  old = *def;
+  *def = color;
+  if(*pen == old){ *pen = color; }
+  if(*saved == old){ *saved = color; }
+
+  term_osc_recolor(screen_buf, (size_t)buf_rows*term_width, shift, old, color);
+  if(grid_other.buf != NULL){
+    term_osc_recolor(grid_other.buf, (size_t)grid_other.rows*term_width, shift, old, color);
+  }
+
+  /* Blank cells show the window's
+   *   background, so it all goes
+   */
+  if(num == 11){
+    if(!headless){ XSetWindowBackground(dpy, win, color); }
+    term_x_clear(0, 0, 0, 0);
+    term_shadow_damage(0, 0, term_width, term_height);
+  }
+  term_redraw();
+}
+
+/*
+ * Where an OSC 52 sequence's base64
+ * starts (after "52;selections;"),
+ * or NULL for any other OSC
+ */
+char *term_osc_clip_data(struct esc_string *seq){
+  char *semi;
+
+  if(seq->len < 3 || strncmp(seq->buf, "52;", 3) != 0){ return NULL; }
+  semi = memchr(seq->buf+3, ';', seq->len-3);
+  return (semi == NULL ? NULL : semi+1);
+}
+
+/*
+ * Decode base64 onto the clipboard,
+ * returning how much of it was used:
+ * whole groups of four, unless it
+ * is the last of it
+ */
+size_t term_osc_decode(char *data, size_t len, int last){
+  size_t used = len,
+         need, i;
+  int n = 0;
+
+  if(!last){
+    for(used=0,i=0;i<len;i++){
+      if(isalnum((unsigned char)data[i]) || data[i] == '+' || data[i] == '/' || data[i] == '='){
+        if(++n % 4 == 0){ used = i+1; }
+      }
+    }
+  }
+
+  need = osc.clip_len+((used/4)*3)+3;
+  if(osc.clip_lost || need > CLIPBOARD_MAX){
+    osc.clip_lost = 1;
+    return used;
+  }
+  if(need > (size_t)osc.clip_cap){
+    osc.clip_cap = (need > (size_t)osc.clip_cap*2 ? need : (size_t)osc.clip_cap*2);
+    if(osc.clip_cap > CLIPBOARD_MAX){ osc.clip_cap = CLIPBOARD_MAX; }
+    osc.clip = realloc(osc.clip, osc.clip_cap);
+  }
+  osc.clip_len += term_gfx_b64(data, used, (unsigned char*)osc.clip+osc.clip_len);
+  return used;
+}
+
+/*
+ * Called as the string buffer fills:
+ * an OSC 52 payload is decoded and
+ * moved out of the way, so that it
+ * never overflows
+ */
+void term_osc_stream(struct esc_string *seq){
+  char *data;
+  size_t len, used;
+
+  if(seq->type != ESC_STR_OSC || (data=term_osc_clip_data(seq)) == NULL){ return; }
+
+  len = seq->len-(data-seq->buf);
+  used = term_osc_decode(data, len, 0);
+  memmove(data, data+used, len-used);
+  seq->len -= used;
+}
+
+/*
+ * OSC 52: set the clipboard (or, if
+ * only p or s is named, the primary
+ * selection). Programs are never
+ * given it back
+ */
+void term_osc_clipboard(struct esc_string *seq){
+  struct term_sel_range *r;
+  char *data = term_osc_clip_data(seq),
+       max[16];
+  int primary;
+
+  if(data == NULL || headless || strcmp(data, "?") == 0){ return; }
+
+  term_osc_decode(data, strlen(data), 1);
+  if(osc.clip_lost){
+    snprintf(max, sizeof(max), "%i", CLIPBOARD_MAX);
+    log_warn(TERM_WARN_CLIPBOARD, max);
+    return;
+  }
+
+  data[-1] = '\0';
+  primary = (strchr(seq->buf+3, 'c') == NULL && strpbrk(seq->buf+3, "ps") != NULL);
+  r = (primary ? &sel.primary : &sel.clipboard);
+
+  term_sel_drop(r);
+  r->set = (osc.clip_len > 0);
+  if(!r->set){ return; }
+
+  r->text = malloc(osc.clip_len);
+  memcpy(r->text, osc.clip, osc.clip_len);
+  r->text_len = osc.clip_len;
+  r->start.line = r->start.col = 0;
+  r->end = r->start;
+
+  if(primary && sel.shown){
+    sel.shown = 0;
+    term_redraw_lines(sel.range.start.line, sel.range.end.line);
+  }
+
+  term_x_atoms();
+  XSetSelectionOwner(dpy, (primary ? XA_PRIMARY : atoms[ATOM_CLIPBOARD]), win, CurrentTime);
+}
+
+/*
+ * Handle a complete OSC sequence
+ * (others, such as the shell's
+ * directory, are ignored)
+ */
+void term_osc(struct esc_string *seq){
+  char *arg;
+  long num = strtol(seq->buf, &arg, 10);
+
+  if(arg == seq->buf || (*arg != ';' && *arg != '\0')){ return; }
+  if(*arg == ';'){ arg++; }
+
+  switch(num){
+    case 0:
+    case 2:
+      term_osc_title(arg);
+      break;
+    case 4:
+      term_osc_palette(arg, seq->esc);
+      break;
+    case 10:
+    case 11:
+      term_osc_default(num, arg, seq->esc);
+      break;
+    case 52:
+      term_osc_clipboard(seq);
+      break;
+  }
+}
+
+//////////////////////////////
+// TERM CORE
+//
+double term_elapsed(struct timespec *since){
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return ((now.tv_sec - since->tv_sec) * 1000.0) +
+         ((now.tv_nsec - since->tv_nsec) / 1000000.0);
+}
+
+/*
+ * Look up FONT_STRING's cell
+ * metrics (and its glyphs' width,
+ * if they share one) in the on-disk
+ * cache, returning 1 on a hit (in which
+ * case the font set itself can
+ * be loaded lazily). The grid's size
+ * when it was last closed is taken
+ * too, setting *sized, if it is known
+ */
+int term_metrics_load(int *sized){
+  FILE *fp;
+  char path[1024],
+       line[1024];
+  int w, h, a, adv, cols, rows, off;
+
+  *sized = 0;
+  snprintf(path, sizeof(path), "%s/" METRICS_CACHE, getenv("HOME") ? getenv("HOME") : ".");
+  if((fp=fopen(path, "r")) == NULL){
+    return 0;
+  }
+
+  while(fgets(line, sizeof(line), fp) != NULL){
+    line[strcspn(line, "\n")] = '\0';
+    if(sscanf(line, "%i %i %i %i %i %i %n", &w, &h, &a, &adv, &cols, &rows, &off) == 6 &&
+       strcmp(line+off, FONT_STRING) == 0 &&
+       w > 0 && h > 0){
+      char_w = w;
+      char_h = h;
+      char_ascent = a;
+      fonts.chain[0].advance = adv;
+      if(cols > 0 && rows > 0){
+        term_width = cols;
+        term_height = rows;
+        *sized = 1;
+      }
+      fclose(fp);
+      return 1;
+    }
+  }
+
+  fclose(fp);
+  return 0;
+}
+
+/*
+ * Whether a line of the cache is
+ * FONT_STRING's (in any format)
+ */
+int term_metrics_ours(const char *line){
+  size_t len = strcspn(line, "\n"),
+         font = strlen(FONT_STRING);
+
+  return (len > font && line[len-font-1] == ' ' && strncmp(line+len-font, FONT_STRING, font) == 0);
+}
+
+/*
+ * Store FONT_STRING's metrics (and, if
+ * sized is set, the grid's size) in
+ * place of its old entry, through a
+ * temporary file renamed over the cache
+ */
+void term_metrics_store(int sized){
+  FILE *in,
+       *out;
+  char path[1024],
+       tmp[1040],
+       line[1024],
+       *slash;
+
+  snprintf(path, sizeof(path), "%s/" METRICS_CACHE, getenv("HOME") ? getenv("HOME") : ".");
+  for(slash=strchr(path+1, '/');slash!=NULL;slash=strchr(slash+1, '/')){
+    *slash = '\0';
+    mkdir(path, 0755);
+    *slash = '/';
+  }
+
+  snprintf(tmp, sizeof(tmp), "%s.%i", path, (int)getpid());
+  if((out=fopen(tmp, "w")) == NULL){ return; }
+
+  /* Other fonts' entries are kept */
+  if((in=fopen(path, "r")) != NULL){
+    while(fgets(line, sizeof(line), in) != NULL){
+      if(!term_metrics_ours(line)){ fputs(line, out); }
+    }
+    fclose(in);
+  }
+  fprintf(
+    out, "%i %i %i %i %i %i %s\n",
+    char_w, char_h, char_ascent, fonts.chain[0].advance,
+    (sized ? term_width : 0), (sized ? term_height : 0), FONT_STRING
+  );
+
+  if(fclose(out) != 0 || rename(tmp, path) != 0){
+    unlink(tmp);
+  }
+}
+
+/*
+ * Start the shell on a new pty, telling
+ * it the grid's size right away if it is
+ * known (sized), or once it settles
+ */
+void term_shell(int sized){
+  struct winsize ws;
+
+  if(openpty(&pty_m, &pty_s, NULL, NULL, NULL)
+      != 0){
+    log_error(TERM_ERR_PTY);
+  }
+
+  if(sized){
+    ws.ws_col = term_width;
+    ws.ws_row = term_height;
+    ioctl(pty_m, TIOCSWINSZ, &ws);
+  } else {
+    geom.winch = 1;
+    clock_gettime(CLOCK_MONOTONIC, &geom.changed);
+  }
+
+  if((shell_pid=fork()) == 0){
+    close(pty_m);
+    setsid();
+    if(ioctl(pty_s, TIOCSCTTY, NULL) == -1){
+      log_error(TERM_ERR_TTY);
+    }
+
+    dup2(pty_s, STDIN_FILENO);
+    dup2(pty_s, STDOUT_FILENO);
+    dup2(pty_s, STDERR_FILENO);
+    close(pty_s);
+
+    if(replay != NULL){
+      term_cast_play();
+    }
+    execvp(SHELL, NULL);
+  } else {
+    close(pty_s);
+  }
+
+  /* Writes are queued rather than
+   *   blocking on a busy shell
+   */
+  fcntl(pty_m, F_SETFL, fcntl(pty_m, F_GETFL) | O_NONBLOCK);
+}
+
+void term_init(){
+  XSetWindowAttributes attrs;
+  int loaded = 0,
+      sized = 0;
+  struct timespec start;
+
+  clock_gettime(CLOCK_MONOTONIC, &time_start);
+  cursor_blink = time_start;
+
+  log_info(TERM_LOG_STARTUP);
+
+  /* Locale */
+  setlocale(LC_ALL, "");
+
+  /* The shell is started first so that
+   *   its startup overlaps with
+   *   connecting to the X server
+   *   (headless, there is no shell,
+   *   and whatever it is sent is
+   *   dropped). Metrics are looked up
+   *   first, since the cache may say
+   *   how big the grid will be
+   */
+  if(headless){
+    pty_m = open("/dev/null", O_WRONLY);
+  } else {
+    loaded = term_metrics_load(&sized);
+    term_shell(sized);
+  }
+
+  /* Screen buffer */
+  buf_rows = term_height+SCROLLBACK_LINES;
+  screen_buf = calloc((size_t)buf_rows*term_width, sizeof(uint128_t));
+  term_shadow_resize();
+  term_hint_init();
+
+  if(headless){
+    char_w = FB_CHAR_W;
+    char_h = FB_CHAR_H;
+    char_ascent = FB_ASCENT;
+    fonts.chain[0].advance = FB_CHAR_W;
+    term_fb_resize();
+    return;
+  }
+
+  if(spill_dir != NULL){
+    term_spill_open(spill_dir);
+  }
+  if(rec.path != NULL){
+    term_rec_open(rec.path);
+  }
+  if(snap.on){
+    term_snap_restore();
+    clock_gettime(CLOCK_MONOTONIC, &snap.last);
+  }
+
+  /* X */
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  dpy = XOpenDisplay(NULL);
+  if(dpy == NULL){
+    log_error(TERM_ERR_DISPLAY);
+  }
+
+  attrs.background_pixel = BG_DEFAULT;
+  attrs.event_mask = term_x_events();
+
+  win = XCreateWindow(
+    dpy,
+    DefaultRootWindow(dpy),
+    0, 0,
+    (sized ? (term_width*char_w)+LEFTMOST : term_width), (sized ? term_height*char_h : term_height),
+    0,
+    DefaultDepth(dpy, DefaultScreen(dpy)),
+    InputOutput,
+    DefaultVisual(dpy, DefaultScreen(dpy)),
+    CWBackPixel|CWEventMask,
+    &attrs
+  );
+  XMapWindow(dpy, win);
+  x_error_default = XSetErrorHandler(term_x_error);
+
+  /* Font (only measured up front when
+   *   its metrics are not yet cached)
+   */
+  term_x_init(!loaded);
+  XFlush(dpy);
+
+  time_x = term_elapsed(&start);
+
+  if(!loaded){
+    term_font_query(0);
+  }
+}
+
+//
+// Drawing is diffed against a shadow
+// of what the window shows, so that
+// programs repainting the whole screen
+// (tmux, htop) only cost the cells
+// which actually changed
+//
+/*
+ * Size the shadow grid to the
+ * window, which has just been
+ * cleared (or never drawn to)
+ */
+void term_shadow_resize(){
+  free(shadow.cells);
+  free(shadow.hash);
+  shadow.width = term_width;
+  shadow.height = term_height;
+  shadow.cells = calloc((size_t)term_width*term_height, sizeof(uint128_t));
+  shadow.hash = calloc(term_height, sizeof(uint64_t));
+}
+
+/*
+ * Forget what is shown in an
+ * area (in screen cells), which
+ * has been drawn over
+ */
+void term_shadow_damage(int pos_x, int pos_y, int w, int h){
+  int x_i, y_i;
+
+  if(pos_x < 0){ w += pos_x; pos_x = 0; }
+  if(pos_y < 0){ h += pos_y; pos_y = 0; }
+  if(pos_x+w > term_width){ w = term_width-pos_x; }
+  if(pos_y+h > term_height){ h = term_height-pos_y; }
+
+  for(y_i=pos_y;y_i<pos_y+h;y_i++){
+    for(x_i=pos_x;x_i<pos_x+w;x_i++){
+      shadow.cells[((size_t)y_i*term_width)+x_i] = SHADOW_DIRTY;
+    }
+    shadow.hash[y_i] = 0;
+  }
+}
+
+/*
+ * What drawing a cell would show:
+ * the cell itself (less its wrap
+ * flag, and with any hint label
+ * in place of its text) with any
+ * highlight in the spare flag
+ * bits, or 0 if it is just
+ * background
+ */
+uint128_t term_shadow_key(uint128_t *row, int pos_x, int pos_y){
+  uint128_t cell = row[pos_x];
+  int hit = (search.matches_len > 0 ? term_search_hit(pos_x, pos_y) : 0),
+      selected = (sel.shown ? term_sel_hit(pos_x, pos_y) : 0),
+      hinted = (hint.active || hint.hover.len > 0 ? term_hint_hit(pos_x, pos_y) : 0);
+
+  if(CELL_CHAR(cell) == 0 && !(CELL_FLAGS(cell) & TERM_CELL_DUMMY) && !hit && !selected && !hinted){
+    return 0;
+  }
+
+  /* A hint's label replaces its text */
+  if(hinted >= 2){
+    cell = (cell & ~(((uint128_t)0xffffffff << 96) | 0xffffffff)) | (uint128_t)('a'+hinted-2);
+  }
+  return (cell & ~((uint128_t)TERM_CELL_WRAP << 88)) |
+         ((uint128_t)(((hinted == 1) << 3) | ((hinted >= 2) << 4) | (hit << 5) | (selected << 7)) << 88);
+}
+
+void term_draw(int pos_x, int pos_y){
+  uint128_t *row,
+            *shown,
+            cell,
+            key,
+            was;
+  uint32_t text[POOL_CLUSTER_MAX],
+           back;
+  wchar_t c;
+  int len, hinted, hit, selected, i;
+
+  if(pos_y+viewport < 0 || pos_y+viewport >= term_height){ return; }
+  if(pos_x < 0 || pos_x >= term_width){ return; }
+  if(search.active && pos_y+viewport == term_height-1){ return; }
+
+  row = term_row(pos_y);
+  key = term_shadow_key(row, pos_x, pos_y);
+  shown = &shadow.cells[((size_t)(pos_y+viewport)*term_width)+pos_x];
+  if(key == *shown){ return; }
+
+  /* The right half of a double-width
+   *   character is drawn with its left
+   */
+  cell = row[pos_x];
+  if(CELL_FLAGS(cell) & TERM_CELL_DUMMY && pos_x > 0 && CELL_FLAGS(row[pos_x-1]) & TERM_CELL_WIDE){
+    shown[-1] = SHADOW_DIRTY;
+    term_draw(pos_x-1, pos_y);
+    return;
+  }
+
+  was = *shown;
+  *shown = key;
+  shadow.hash[pos_y+viewport] = 0;
+
+  if(key == 0 || CELL_FLAGS(cell) & TERM_CELL_DUMMY){
+    if(LOW_BANDWIDTH && was == 0){ return; }
+    term_x_color(bg_default);
+    term_x_fill(
+      (pos_x*char_w)+LEFTMOST, (pos_y+viewport)*char_h,
+      char_w, char_h
     );
-    XSetForeground(
-      dpy,
-      DefaultGC(dpy, DefaultScreen(dpy)),
-      (cell >> 32) & 0xffffff
+    return;
+  }
+
+  len = term_cell_text(key, text);
+  hinted = (CELL_FLAGS(key) >> 3) & 3;
+  hit = (CELL_FLAGS(key) >> 5) & 3;
+  selected = CELL_FLAGS(key) >> 7;
+
+  back = (hinted == 2 ? HINT_BG : (hit ? (hit == 2 ? SEARCH_CURRENT_BG : SEARCH_BG) : (selected ? SELECTION_BG : CELL_BG(cell))));
+
+  /* Over cells showing nothing but the
+   *   default background, the background
+   *   need not be drawn again
+   */
+  if(!LOW_BANDWIDTH || back != bg_default || was != 0 ||
+     (CELL_FLAGS(cell) & TERM_CELL_WIDE && pos_x+1 < term_width && shown[1] != 0)){
+    term_x_color(back);
+    term_x_fill(
+      (pos_x*char_w)+LEFTMOST, (pos_y+viewport)*char_h,
+      (CELL_FLAGS(cell) & TERM_CELL_WIDE ? 2 : 1) * char_w, char_h
+    );
+  }
+  term_x_color(
+    (hinted == 2 ? HINT_FG : (hit ? SEARCH_FG : (selected ? SELECTION_FG : CELL_FG(cell))))
+  );
+
+  /* Combining marks are drawn over the
+   *   base character, at the same origin
+   *   (core fonts cannot compose anything
+   *   joined by a ZWJ, so drawing stops
+   *   there)
+   */
+  for(i=0;i<len && text[i] != POOL_ZWJ;i++){
+    c = text[i];
+    term_x_text(
+      (pos_x*char_w)+LEFTMOST, ((pos_y+viewport)*char_h)+char_ascent,
+      &c,
+      1
     );
-    XmbDrawString(
-      dpy,
-      win,
-      fnt,
-      DefaultGC(dpy, DefaultScreen(dpy)),
-      (pos_x*CHAR_W)+LEFTMOST, ((pos_y-viewport)*CHAR_H)+TOPMOST,
-      (char*)&c,
-      (c <= 0xff ? 1 : (c <= 0xffff ? 2 : (c <= 0xffffff ? 3 : 4)))
+  }
+
+  if(hinted == 1){
+    term_x_fill(
+      (pos_x*char_w)+LEFTMOST, ((pos_y+viewport+1)*char_h)-1,
+      (CELL_FLAGS(cell) & TERM_CELL_WIDE ? 2 : 1) * char_w, 1
     );
   }
 
-  XFlush(dpy);
+  if(CELL_FLAGS(cell) & TERM_CELL_WIDE && pos_x+1 < term_width){
+    shown[1] = term_shadow_key(row, pos_x+1, pos_y);
+  }
+}
+
+/*
+ * Draw the cursor over the cell
+ * it is on, once per pass of
+ * term_loop (rather than after
+ * every character printed), only
+ * touching the screen when it has
+ * moved or blinked
+ */
+void term_draw_cursor(){
+  uint128_t *at = NULL;
+  int show;
+
+  /* Moving restarts the blink */
+  if(x_next != x_cur_prev || y_next != y_cur_prev){
+    cursor_phase = 1;
+    clock_gettime(CLOCK_MONOTONIC, &cursor_blink);
+  } else if(cursor_style & TERM_CURSOR_BLINK && term_cursor_wait() == 0){
+    cursor_phase = !cursor_phase;
+    clock_gettime(CLOCK_MONOTONIC, &cursor_blink);
+  }
+
+  if(x_next >= 0 && x_next < term_width &&
+     y_next+viewport >= 0 && y_next+viewport < term_height &&
+     !(search.active && y_next+viewport == term_height-1)){
+    at = &shadow.cells[((size_t)(y_next+viewport)*term_width)+x_next];
+  }
+  show = (at != NULL &&
+          !(cursor_style & TERM_CURSOR_NONE) &&
+          (cursor_phase || !(cursor_style & TERM_CURSOR_BLINK)));
+
+  /* Still as it was */
+  if(x_next == x_cur_prev && y_next == y_cur_prev &&
+     show == (at != NULL && *at == SHADOW_CURSOR)){
+    return;
+  }
+
+  term_draw(x_cur_prev, y_cur_prev);
+  x_cur_prev = x_next;
+  y_cur_prev = y_next;
+
+  if(!show){ return; }
+
+  term_x_color(fg);
+  switch(cursor_style & ~(TERM_CURSOR_NONE | TERM_CURSOR_BLINK)){
+    case TERM_CURSOR_BLOCK:
+      term_x_fill(
+        (x_next*char_w)+LEFTMOST, (y_next+viewport)*char_h,
+        char_w, char_h
+      );
+      break;
+    case TERM_CURSOR_UNDERLINE:
+      term_x_fill(
+        (x_next*char_w)+LEFTMOST, ((y_next+viewport+1)*char_h)-2,
+        char_w, 2
+      );
+      break;
+    case TERM_CURSOR_LINE:
+      term_x_fill(
+        (x_next*char_w)+LEFTMOST, (y_next+viewport)*char_h,
+        2, char_h
+      );
+      break;
+  }
+
+  *at = SHADOW_CURSOR;
+  shadow.hash[y_next+viewport] = 0;
+}
+
+/*
+ * Milliseconds until the cursor
+ * next blinks
+ */
+int term_cursor_wait(){
+  double left = CURSOR_BLINK_MS-term_elapsed(&cursor_blink);
+
+  return (left > 0 ? (int)left+1 : 0);
+}
+
+/*
+ * Bring a row on screen up to
+ * date, skipping it entirely if
+ * its hash shows it unchanged
+ */
+void term_redraw_line(int line){
+  uint128_t *row,
+            key;
+  uint64_t h = 0xcbf29ce484222325;
+  int x_i;
+
+  if(line+viewport < 0 || line+viewport >= term_height){ return; }
+
+  if(search.active && line+viewport == term_height-1){
+    term_search_status();
+    return;
+  }
+
+  row = term_row(line);
+  for(x_i=0;x_i<term_width;x_i++){
+    key = term_shadow_key(row, x_i, line);
+    h = (h ^ (uint64_t)key) * 0x100000001b3;
+    h = (h ^ (uint64_t)(key >> 64)) * 0x100000001b3;
+  }
+  if(h == 0){ h = 1; }
+
+  if(h != shadow.hash[line+viewport]){
+    for(x_i=0;x_i<term_width;x_i++){
+      term_draw(x_i, line);
+    }
+    shadow.hash[line+viewport] = h;
+  }
+
+  if(gfx.places_len > 0){
+    term_gfx_draw_row(line);
+  }
+}
+
+/*
+ * Redraw the visible rows
+ * between two absolute lines
+ */
+void term_redraw_lines(uint64_t from, uint64_t to){
+  int64_t row = (int64_t)(from-lines_total),
+          last = (int64_t)(to-lines_total);
+
+  if(row < -viewport){ row = -viewport; }
+  if(last > term_height-1-viewport){ last = term_height-1-viewport; }
+  for(;row<=last;row++){
+    term_redraw_line(row);
+  }
+}
+
+void term_redraw(){
+  int y_i;
+
+  for(y_i=-viewport;y_i<term_height-viewport;y_i++){
+    term_redraw_line(y_i);
+  }
+}
+
+/*
+ * Scroll the screen up by one
+ * line, pushing the top row
+ * into the scrollback
+ */
+void term_scroll(){
+  /* The ring is full, so its oldest
+   *   row is about to be recycled
+   */
+  if(spill.on && !alt_screen && hist_len == buf_rows-term_height){
+    term_spill_push(TERM_ROW(-hist_len));
+  }
+
+  buf_top = (buf_top+1) % buf_rows;
+  lines_total++;
+  if(hist_len < buf_rows-term_height){
+    hist_len++;
+  }
+  memset(TERM_ROW(term_height-1), 0, term_width*sizeof(uint128_t));
+  term_hint_touch(term_height-1, term_height-1);
+
+  /* A scrolled-back view stays put
+   *   unless its top was just recycled
+   */
+  if(viewport > 0){
+    if(viewport < TERM_HIST){
+      viewport++;
+    } else {
+      term_redraw();
+    }
+    return;
+  }
+
+  term_x_copy(
+    win,
+    0, char_h,
+    (term_width*char_w)+LEFTMOST, (term_height-1)*char_h,
+    0, 0
+  );
+  memmove(shadow.cells, shadow.cells+term_width, (size_t)(term_height-1)*term_width*sizeof(uint128_t));
+  memmove(shadow.hash, shadow.hash+1, (term_height-1)*sizeof(uint64_t));
+
+  /* The new bottom row is blank, and
+   *   cheaper cleared as one area than
+   *   diffed a cell at a time
+   */
+  term_x_clear(
+    0, (term_height-1)*char_h,
+    (term_width*char_w)+LEFTMOST, char_h
+  );
+  memset(&shadow.cells[(size_t)(term_height-1)*term_width], 0, term_width*sizeof(uint128_t));
+  shadow.hash[term_height-1] = 0;
+  y_cur_prev--;
+  term_redraw_line(term_height-1);
+}
+
+void term_newline(){
+  if(++y_next >= term_height){
+    y_next = term_height-1;
+    term_scroll();
+  }
+}
+
+/*
+ * Move the view into (positive)
+ * or out of the scrollback
+ */
+void term_scroll_view(int lines){
+  int prev = viewport;
+
+  viewport += lines;
+  if(viewport > TERM_HIST){ viewport = TERM_HIST; }
+  if(viewport < 0){ viewport = 0; }
+
+  if(viewport != prev){
+    hint.stale = 1;
+    term_redraw();
+  }
+}
+
+/*
+ * Swap the showing grid with
+ * the other one
+ */
+void term_grid_swap(){
+  struct term_grid cur = { screen_buf, buf_rows, buf_top, hist_len, lines_total };
+
+  screen_buf = grid_other.buf;
+  buf_rows = grid_other.rows;
+  buf_top = grid_other.top;
+  hist_len = grid_other.hist;
+  lines_total = grid_other.lines;
+  grid_other = cur;
+}
+
+/*
+ * Switch to (or back from) the
+ * alternate screen, which has
+ * no scrollback of its own
+ */
+void term_alt_screen(int enable, int clear){
+  if(enable == alt_screen){ return; }
+
+  if(grid_other.buf == NULL){
+    grid_other.buf = calloc((size_t)term_height*term_width, sizeof(uint128_t));
+    grid_other.rows = term_height;
+  }
+
+  term_grid_swap();
+  alt_screen = enable;
+  viewport = 0;
+
+  if(clear){
+    memset(screen_buf, 0, (size_t)buf_rows*term_width*sizeof(uint128_t));
+    term_gfx_clear(lines_total, lines_total+term_height-1);
+  }
+
+  /* Matches were found in the other grid */
+  term_hint_forget();
+  hint.hover.len = 0;
+  hint.active = 0;
+  hint.stale = 1;
+  if(search.active){
+    term_search_stop();
+  } else {
+    term_redraw();
+  }
 }
 
-void term_draw_cursor(){
-  if(cursor_style & TERM_CURSOR_NONE == 1){ return; }
- 
-  if(x_next > 0){ /* TODO: Hack for lingering cursor when printing empty line */
-    term_draw(x_cur_prev, y_cur_prev);
-
-    switch(cursor_style & ~TERM_CURSOR_NONE){
-      case TERM_CURSOR_BLOCK:
-        XSetForeground(
-          dpy,
-          DefaultGC(dpy, DefaultScreen(dpy)),
-          fg
-        );
-        XFillRectangle(
-          dpy,
-          win,
-          DefaultGC(dpy, DefaultScreen(dpy)),
-          (x_next*CHAR_W)+LEFTMOST, y_next*CHAR_H,
-          CHAR_W, CHAR_H
-        );
-        break;
-      case TERM_CURSOR_LINE:
-        XSetForeground(
-          dpy,
-          DefaultGC(dpy, DefaultScreen(dpy)),
-          fg
-        );
-        XFillRectangle(
-          dpy,
-          win,
-          DefaultGC(dpy, DefaultScreen(dpy)),
-          (x_next*CHAR_W)+LEFTMOST, y_next*CHAR_H,
-          2, CHAR_H
-        );
-        break;
+/*
+ * Re-lay out the showing grid
+ * for a new size, keeping *row
+ * on screen by pushing the rows
+ * above it into the scrollback
+ */
+void term_grid_fit(int width, int height, int scrollback, int *row){
+  uint128_t *buf,
+            *src;
+  int rows, hist, shift, i;
+
+  shift = (*row >= height ? *row-height+1 : 0);
+  hist = hist_len+shift;
+  if(hist > scrollback){ hist = scrollback; }
+
+  /* Rows no longer fitting in the
+   *   ring are spilled (from the
+   *   primary screen)
+   */
+  if(spill.on && scrollback > 0){
+    for(i=-hist_len;i<shift-hist;i++){
+      term_spill_push(TERM_ROW(i));
     }
+  }
 
-    x_cur_prev = x_next;
-    y_cur_prev = y_next;
+  rows = height+scrollback;
+  buf = calloc((size_t)rows*width, sizeof(uint128_t));
 
-    XFlush(dpy);
+  for(i=-hist;i<height && shift+i<term_height;i++){
+    src = TERM_ROW(shift+i);
+    memcpy(
+      &buf[(size_t)(i+hist)*width],
+      src,
+      (width < term_width ? width : term_width)*sizeof(uint128_t)
+    );
+    if(CELL_FLAGS(src[term_width-1]) & TERM_CELL_WRAP){
+      buf[((size_t)(i+hist)*width)+width-1] |= (uint128_t)TERM_CELL_WRAP << 88;
+    }
   }
+
+  free(screen_buf);
+  screen_buf = buf;
+  buf_rows = rows;
+  buf_top = hist;
+  hist_len = hist;
+  lines_total += shift;
+
+  *row -= shift;
 }
 
-void term_redraw_line(int line){
-  int x_i;
+void term_resize(int width, int height){
+  int row = 0;
 
-  XClearArea(
-    dpy,
-    win,
-    0, ((line-viewport)*CHAR_H),
-    term_width*CHAR_W, CHAR_H,
-    False
-  );
+  if(width < 1){ width = 1; }
+  if(height < 1){ height = 1; }
 
-  for(x_i=0;x_i<term_width;x_i++){
-    term_draw(x_i, line);
+  if(width != term_width || height != term_height){
+    snap.full = 1;
   }
+  snap.pending = 1;
 
-  term_draw_cursor();
-}
+  /* Keep the cursor's row on screen (and
+   *   the primary screen's saved one, if
+   *   it is the grid not showing)
+   */
+  term_grid_fit(width, height, (alt_screen ? 0 : SCROLLBACK_LINES), &y_next);
+  if(grid_other.buf != NULL){
+    term_grid_swap();
+    term_grid_fit(width, height, (alt_screen ? SCROLLBACK_LINES : 0), (alt_screen ? &y_saved : &row));
+    term_grid_swap();
+  }
 
-void term_redraw(){
-  int y_i;
+  term_width = width;
+  term_height = height;
+  viewport = 0;
 
-  XClearWindow(
-    dpy,
-    win
-  );
+  /* Hints found at the old width no
+   *   longer line up
+   */
+  term_hint_forget();
+  hint.hover.len = 0;
+  hint.active = 0;
+  hint.stale = 1;
 
-  for(y_i=viewport;y_i<term_height+viewport;y_i++){
-    term_redraw_line(y_i);
+  if(x_next >= width){ x_next = width-1; }
+  if(x >= width){ x = width-1; }
+  if(y >= height){ y = height-1; }
+  if(x_saved >= width){ x_saved = width-1; }
+
+  if(rec.on){
+    term_rec_resize();
+  }
+
+  /* The shell hears of it once the
+   *   size settles
+   */
+  geom.winch = 1;
+  clock_gettime(CLOCK_MONOTONIC, &geom.changed);
+
+  term_x_clear(0, 0, 0, 0);
+  term_shadow_resize();
+  term_redraw();
+}
+
+/*
+ * Apply the last size the window was
+ * given (once per pass of term_loop,
+ * however many ConfigureNotify events
+ * came in), unless it is the same
+ * number of cells
+ */
+void term_resize_apply(){
+  geom.pending = 0;
+  if(geom.width == term_width && geom.height == term_height){
+    term_redraw();
+    return;
   }
+  term_resize(geom.width, geom.height);
 }
 
-void term_resize(){
+/*
+ * Tell the shell the grid's size once
+ * it has held for RESIZE_SETTLE_MS,
+ * returning the milliseconds until
+ * then (-1 if there is nothing to
+ * tell it)
+ */
+int term_resize_settle(){
   struct winsize ws;
+  double left;
+
+  if(!geom.winch){ return -1; }
 
-  screen_buf = realloc(screen_buf, term_width*term_height*SCROLLBACK_SIZE*sizeof(uint128_t));
+  left = RESIZE_SETTLE_MS-term_elapsed(&geom.changed);
+  if(left > 0){ return (int)left+1; }
 
   ws.ws_col = term_width;
   ws.ws_row = term_height;
   ioctl(pty_m, TIOCSWINSZ, &ws);
+  geom.winch = 0;
+  return -1;
+}
 
-  term_redraw();
+/*
+ * Write to the shell without
+ * blocking, queueing whatever
+ * it cannot take yet
+ */
+/*
+ * Make room in q for len
+ * more bytes
+ */
+void term_queue_grow(struct term_queue *q, size_t len){
+  if(q->len+len > q->cap && q->off > 0){
+    memmove(q->buf, q->buf+q->off, q->len-q->off);
+    q->len -= q->off;
+    q->off = 0;
+  }
+  if(q->len+len > q->cap){
+    while(q->len+len > q->cap){
+      q->cap = (q->cap > 0 ? q->cap*2 : 4096);
+    }
+    q->buf = realloc(q->buf, q->cap);
+  }
+}
+
+void term_pty_write(const char *buf, size_t len){
+  ssize_t n = 0;
+
+  /* With io_uring, everything goes
+   *   through the queue (and out with
+   *   the next wait)
+   */
+  if(pty_out.off == pty_out.len && !ring_on){
+    pty_out.off = pty_out.len = 0;
+    if((n=write(pty_m, buf, len)) < 0){ n = 0; }
+  }
+  if((size_t)n == len){ return; }
+
+  term_queue_grow(&pty_out, len-n);
+  memcpy(pty_out.buf+pty_out.len, buf+n, len-n);
+  pty_out.len += len-n;
+}
+
+size_t term_pty_queued(){
+  return (pty_out.len-pty_out.off)+(pty_sending.len-pty_sending.off);
+}
+
+/*
+ * Called once queued bytes have
+ * gone to the shell
+ */
+void term_pty_written(){
+  if(pty_out.off == pty_out.len){
+    pty_out.off = pty_out.len = 0;
+  }
+
+  if(paste.waiting && term_pty_queued() < PASTE_QUEUE_MAX){
+    paste.waiting = 0;
+    XDeleteProperty(dpy, win, atoms[ATOM_PASTE]);
+  }
+}
+
+void term_pty_flush(){
+  ssize_t n = write(pty_m, pty_out.buf+pty_out.off, pty_out.len-pty_out.off);
+
+  if(n > 0){
+    pty_out.off += n;
+  }
+  term_pty_written();
+}
+
+/*
+ * Handle output from the shell,
+ * returning 0 if term should
+ * stop (when benchmarking startup)
+ */
+int term_pty_input(char *buf, int len){
+  if(rec.on){
+    term_rec_output(buf, len);
+  }
+  term_write(buf, len);
+  hint.stale = 1;
+  hint.busy = 1;
+
+  if(time_prompt == 0){
+    term_x_flush();
+    XFlush(dpy);
+    time_prompt = term_elapsed(&time_start);
+    log_info(TERM_LOG_STARTUP_TIME, time_prompt, time_x, time_font);
+    if(startup_bench){ return 0; }
+  }
+  return 1;
+}
+
+#ifdef TERM_URING
+/*
+ * Set up io_uring, if the kernel
+ * allows it (otherwise select()
+ * is used)
+ */
+void term_uring_init(){
+  if(uring_init(&ring, 64) != 0){ return; }
+  if(uring_bufs(&ring, URING_BUFS, URING_BUF_SIZE) != 0){
+    uring_free(&ring);
+    return;
+  }
+
+  uring_read(&ring, pty_m, URING_PTY_READ);
+  uring_poll(&ring, ConnectionNumber(dpy), POLLIN, 1, URING_X_POLL);
+  ring_on = 1;
+
+  /* Once the writer has caught up, the
+   *   recording is written alongside
+   *   the shell's input
+   */
+  if(rec.on){
+    term_rec_stop();
+    rec.ring = 1;
+  }
+}
+
+/*
+ * Write everything queued since the
+ * last write to fd in the next one,
+ * from a buffer (sending) left alone
+ * until it completes
+ */
+void term_uring_send(int fd, struct term_queue *queue, struct term_queue *sending, int *writing, uint64_t tag){
+  struct term_queue swap;
+
+  if(*writing){ return; }
+  if(sending->off == sending->len && queue->len > queue->off){
+    swap = *sending;
+    *sending = *queue;
+    *queue = swap;
+    queue->off = queue->len = 0;
+  }
+  if(sending->len > sending->off){
+    uring_write(&ring, fd, sending->buf+sending->off, sending->len-sending->off, tag);
+    *writing = 1;
+  }
+}
+
+/*
+ * Note how much of the recording was
+ * written, dropping the rest of the
+ * buffer if the write failed
+ */
+void term_uring_rec_written(int res){
+  rec.writing = 0;
+  if(res == -EINTR){
+    /* Tried again with the next wait */
+    return;
+  }
+  if(res <= 0){
+    rec.failed = 1;
+  }
+  rec.sending.off = (res > 0 ? rec.sending.off+res : rec.sending.len);
+  if(rec.sending.off == rec.sending.len){
+    rec.sending.off = rec.sending.len = 0;
+  }
+}
+
+/*
+ * Wait until the recording is all
+ * written (anything else completing
+ * meanwhile is dropped, as this is
+ * only done on the way out)
+ */
+void term_uring_rec_drain(){
+  struct io_uring_cqe *cqe;
+  uint64_t tag;
+  int res;
+
+  for(;;){
+    term_uring_send(rec.fd, &rec.out, &rec.sending, &rec.writing, URING_REC_WRITE);
+    if(!rec.writing){ break; }
+    if(uring_wait(&ring, -1) < 0 && errno != EINTR){ break; }
+
+    while((cqe=uring_cqe(&ring)) != NULL){
+      tag = cqe->user_data;
+      res = cqe->res;
+      uring_cqe_seen(&ring);
+      if(tag == URING_REC_WRITE){
+        term_uring_rec_written(res);
+      }
+    }
+  }
+}
+
+/*
+ * Write whatever has been queued
+ * for the shell, then wait up to
+ * ms (or forever, if negative)
+ * for the shell or the X server,
+ * returning 0 if the shell is gone
+ */
+int term_uring_wait(int ms, int *x_ready){
+  struct io_uring_cqe *cqe;
+  uint64_t tag;
+  unsigned bid;
+  int res,
+      more,
+      ok = 1;
+
+  /* The shell's input and the recording
+   *   go out in the same submission as
+   *   the wait
+   */
+  term_uring_send(pty_m, &pty_out, &pty_sending, &ring_writing, URING_PTY_WRITE);
+  if(rec.ring){
+    term_uring_send(rec.fd, &rec.out, &rec.sending, &rec.writing, URING_REC_WRITE);
+  }
+
+  if(uring_wait(&ring, ms) < 0){ return 0; }
+
+  while(ok && (cqe=uring_cqe(&ring)) != NULL){
+    tag = cqe->user_data;
+    res = cqe->res;
+    more = cqe->flags & IORING_CQE_F_MORE;
+    bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    uring_cqe_seen(&ring);
+
+    switch(tag){
+      case URING_PTY_READ:
+        if(res > 0){
+          ok = term_pty_input(uring_buf(&ring, bid), res);
+          uring_buf_return(&ring, bid);
+        } else if(res != -ENOBUFS && res != -EAGAIN && res != -EINTR){
+          /* The shell has exited */
+          return 0;
+        }
+        if(!more){
+          uring_read(&ring, pty_m, URING_PTY_READ);
+        }
+        break;
+      case URING_PTY_WRITE:
+        ring_writing = 0;
+        if(res == -EAGAIN){
+          uring_poll(&ring, pty_m, POLLOUT, 0, URING_PTY_POLL);
+          ring_writing = 1;
+          break;
+        }
+        if(res == -EINTR){
+          /* Tried again with the next wait */
+          break;
+        }
+        pty_sending.off = (res > 0 ? pty_sending.off+res : pty_sending.len);
+        if(pty_sending.off == pty_sending.len){
+          pty_sending.off = pty_sending.len = 0;
+        }
+        term_pty_written();
+        break;
+      case URING_PTY_POLL:
+        ring_writing = 0;
+        break;
+      case URING_X_POLL:
+        *x_ready = 1;
+        if(!more){
+          uring_poll(&ring, ConnectionNumber(dpy), POLLIN, 1, URING_X_POLL);
+        }
+        break;
+      case URING_REC_WRITE:
+        term_uring_rec_written(res);
+        break;
+    }
+  }
+
+  return ok;
 }
+#endif
 
 void term_key(XKeyEvent key){
   char buf[32];
@@ -543,27 +6868,159 @@ void term_key(XKeyEvent key){
   KeySym ksym;
 
   num = XLookupString(&key, buf, sizeof(buf), &ksym, 0);
+
+  if(search.active){
+    term_search_key(ksym, buf, num);
+    return;
+  }
+  if(hint.active){
+    term_hint_key(ksym);
+    return;
+  }
+  if((key.state & (ControlMask|ShiftMask)) == (ControlMask|ShiftMask)){
+    switch(ksym){
+      case XK_F:
+      case XK_f:
+        term_search_start();
+        return;
+      case XK_U:
+      case XK_u:
+        term_hint_start();
+        return;
+      case XK_C:
+      case XK_c:
+        term_sel_copy(key.time);
+        return;
+      case XK_V:
+      case XK_v:
+        term_paste(atoms[ATOM_CLIPBOARD], key.time);
+        return;
+    }
+  }
+  if(key.state & ShiftMask && ksym == XK_Insert){
+    term_paste(XA_PRIMARY, key.time);
+    return;
+  }
+  if(key.state & ShiftMask && (ksym == XK_Prior || ksym == XK_Next)){
+    term_scroll_view((ksym == XK_Prior ? 1 : -1) * (term_height/2));
+    return;
+  }
+  if(viewport > 0){
+    term_scroll_view(-viewport);
+  }
+
   switch(ksym){
     case XK_Left:
-      write(pty_m, "\x1b[D", 3);
+      term_pty_write("\x1b[D", 3);
       break;
     case XK_Right:
-      write(pty_m, "\x1b[C", 3);
+      term_pty_write("\x1b[C", 3);
       break;
     case XK_Up:
-      write(pty_m, "\x1b[A", 3);
+      term_pty_write("\x1b[A", 3);
       break;
     case XK_Down:
-      write(pty_m, "\x1b[B", 3);
+      term_pty_write("\x1b[B", 3);
       break;
     default:
-      write(pty_m, buf, num);
+      term_pty_write(buf, num);
       break;
     }
 }
 
+/*
+ * Attach a zero-width (combining)
+ * character to the most recently
+ * printed cell
+ */
+void term_combine(wchar_t wc){
+  int pos_x = x_next-1,
+      pos_y = y_next,
+      len;
+  uint128_t *cell;
+  uint32_t text[POOL_CLUSTER_MAX];
+
+  join_next = 0;
+
+  if(pos_x < 0){
+    if(pos_y == 0){ return; }
+    pos_x = term_width-1;
+    pos_y--;
+  }
+
+  cell = &TERM_ROW(pos_y)[pos_x];
+  if(CELL_FLAGS(*cell) & TERM_CELL_DUMMY && pos_x > 0){
+    cell--;
+    pos_x--;
+  }
+
+  if(CELL_CHAR(*cell) == 0){ return; }
+
+  /* The first mark fits in the cell itself,
+   *   anything longer moves to the pool
+   */
+  if(!CELL_IS_CLUSTER(*cell) && CELL_COMB(*cell) == 0){
+    CELL_SET_COMB(*cell, wc);
+  } else {
+    len = term_cell_text(*cell, text);
+    if(len == POOL_CLUSTER_MAX){ return; }
+    text[len++] = wc;
+
+    *cell = (CELL_ATTRS(*cell) | ((uint128_t)CELL_FLAGS(*cell) << 88)) |
+            (POOL_TAG | pool_intern(text, len));
+  }
+
+  join_next = (wc == POOL_ZWJ);
+  term_hint_touch(pos_y, pos_y);
+  term_draw(pos_x, pos_y);
+}
+
+/*
+ * Blank the other half of any
+ * double-width character which
+ * is about to be partially
+ * overwritten
+ */
+void term_split_wide(int pos_x, int pos_y, int width){
+  uint128_t *cell = &TERM_ROW(pos_y)[pos_x];
+
+  if(CELL_FLAGS(cell[0]) & TERM_CELL_DUMMY && pos_x > 0){
+    cell[-1] = CELL_ATTRS(cell[-1]) | ' ';
+    term_draw(pos_x-1, pos_y);
+  }
+  if(CELL_FLAGS(cell[width-1]) & TERM_CELL_WIDE && pos_x+width < term_width){
+    cell[width] = CELL_ATTRS(cell[width]) | ' ';
+    term_draw(pos_x+width, pos_y);
+  }
+}
+
 void term_putchar(wchar_t wc){
-  int redraw = 1;
+  int redraw = 1,
+      width, len, esc, i;
+  uint128_t *cell;
+  char enc[4];
+
+  /* Inside a string sequence (which
+   *   ESC followed by anything but a
+   *   backslash also ends, starting
+   *   another escape sequence)
+   */
+  if(esc_ind == -3){
+    esc = esc_str.esc;
+    len = utf8_encode(wc, enc);
+    for(i=0;i<len && !esc_string_put(&esc_str, enc[i]);i++){
+      if(esc_str.len == ESC_STRING_MAX-1){ term_osc_stream(&esc_str); }
+    }
+    if(i < len){
+      esc_ind = -2;
+      term_esc_string(&esc_str);
+      if(esc && wc != '\\'){
+        esc_ind = -1;
+        term_putchar(wc);
+      }
+    }
+    return;
+  }
 
   switch(wc){
     case '\a':
@@ -577,10 +7034,11 @@ void term_putchar(wchar_t wc){
     case '\b':
       x_next--;
       if(x_next < 0){
-        x_next = term_width-1;
-        y_next--;
+        x_next = (y_next > 0 ? term_width-1 : 0);
+        y_next = (y_next > 0 ? y_next-1 : 0);
       }
-      screen_buf[(y_next*term_width)+x_next] = 0;
+      TERM_ROW(y_next)[x_next] = 0;
+      term_hint_touch(y_next, y_next);
       term_redraw_line(TERM_CURRENT_Y);
       break;
     case '\r':
@@ -588,20 +7046,26 @@ void term_putchar(wchar_t wc){
       redraw = 0;
       break;
     case '\n':
-      y_next++;
-/*      if(y_next > term_height){
-        viewport++;
-        term_redraw();
-      } else {
-*/        term_redraw_line(TERM_CURRENT_Y);
-//      }
+      term_newline();
+      term_redraw_line(TERM_CURRENT_Y);
       redraw = 0;
       break;
     case '\t':
       x_next += TABWIDTH - (x_next % TABWIDTH);
       break;
     default:
-      if(esc_ind >= 0){
+      if(esc_ind >= (int)sizeof(esc_seq)-1){
+        /* Longer than any real sequence, so
+         *   the rest of it is dropped up to
+         *   its final character
+         */
+        if(ESC_IS_FUNCTION(wc)){
+          esc_seq[esc_ind] = '\0';
+          log_warn(TERM_WARN_ESC, esc_seq);
+          esc_ind = -2;
+        }
+        redraw = 0;
+      } else if(esc_ind >= 0){
         esc_seq[esc_ind++] = wc;
         if(ESC_IS_FUNCTION(wc)){
           esc_seq[esc_ind] = '\0';
@@ -612,28 +7076,48 @@ void term_putchar(wchar_t wc){
         }
         redraw = 0;
       } else if(esc_ind == -2){
+        width = cell_width(wc);
+        if(width == 0 || (join_next && width == 2)){
+          term_combine(wc);
+          redraw = 0;
+          break;
+        }
+        join_next = 0;
+        if(x_next+width > term_width){
+          TERM_ROW(y_next)[term_width-1] |= (uint128_t)TERM_CELL_WRAP << 88;
+          term_hint_touch(y_next, y_next);
+          x_next = 0;
+          term_newline();
+        }
+
         x = x_next;
         y = y_next;
+        cell = &TERM_ROW(y)[x];
 
-        /* This could be optimized by compressing it into a one-liner
-         *   (which was the case initially), but this would require
-         *   changing mod, fg, and bg to uint128_t, using more memory
-         *   than necessary.  Also, this is (slightly) clearer than
-         *   the one-liner at first glance.
-         */
-        screen_buf[((y*term_width)+x)] = mod;
-        screen_buf[((y*term_width)+x)] <<= 24;
-        screen_buf[((y*term_width)+x)] |= bg;
-        screen_buf[((y*term_width)+x)] <<= 24;
-        screen_buf[((y*term_width)+x)] |= fg;
-        screen_buf[((y*term_width)+x)] <<= 32;
-        screen_buf[((y*term_width)+x)] |= wc;
-
-        x_next++;
+        if(CELL_FLAGS(cell[0]) | CELL_FLAGS(cell[width-1])){
+          term_split_wide(x, y, width);
+        }
+
+        cell_put(cell, wc, width, fg, bg, mod);
+        term_hint_touch(y, y);
+
+        x_next += width;
         if(x_next >= term_width){
+          /* Drawn before wrapping, since
+           *   wrapping may scroll it away
+           */
+          cell[width-1] |= (uint128_t)TERM_CELL_WRAP << 88;
+          term_draw(x, y);
           x_next = 0;
-          y_next++;
+          term_newline();
+          redraw = 0;
         }
+      } else if(esc_ind == -1 && ESC_IS_STRING(wc)){
+        esc_string_start(&esc_str, wc);
+        osc.clip_len = 0;
+        osc.clip_lost = 0;
+        esc_ind = -3;
+        redraw = 0;
       } else {
         esc_ind++;
         redraw = 0;
@@ -643,86 +7127,261 @@ void term_putchar(wchar_t wc){
 
   if(redraw){
     term_draw(TERM_CURRENT_X, TERM_CURRENT_Y);
-    term_draw_cursor();
   }
 }
 
 void term_write(char *buf, int len){
-  int n = 0;
-  wchar_t wc;
+  int n, i;
 
-  for(n=0;n<len;){
-    wc = 0;
-    if((buf[n] & 0xf0) == 0xf0){        /* 4-byte sequence */
-      UTF8_PUSH_BYTE(3);
-      UTF8_PUSH_BYTE(2);
-      UTF8_PUSH_BYTE(1);
-      UTF8_PUSH_BYTE_END(4);
-    } else if((buf[n] & 0xe0) == 0xe0){ /* 3-byte sequence */
-      UTF8_PUSH_BYTE(2);
-      UTF8_PUSH_BYTE(1);
-      UTF8_PUSH_BYTE_END(3);
-    } else if((buf[n] & 0xc0) == 0xc0){ /* 2-byte sequence */
-      UTF8_PUSH_BYTE(1);
-      UTF8_PUSH_BYTE_END(2);
-    } else {                            /* 1-byte sequence */
-      UTF8_PUSH_BYTE_END(1);
-    }
+  if(len+1 > write_cap){
+    write_cap = len+1;
+    write_buf = realloc(write_buf, write_cap*sizeof(uint32_t));
+  }
 
-    term_putchar(wc);
+  n = utf8_decode(&utf8_dec, buf, len, write_buf);
+  for(i=0;i<n;i++){
+    term_putchar(write_buf[i]);
   }
+  snap.pending = 1;
 }
 
 void term_loop(){
   XEvent evt;
-  fd_set set;
+  fd_set set,
+         wset;
+  struct timeval poll;
   int maxfd,
-      pty_len;
+      pty_len,
+      x_ready,
+      wait,
+      ms;
   char pty_buf[ESC_MAX];
 
   maxfd = (pty_m > ConnectionNumber(dpy) ? pty_m : ConnectionNumber(dpy));
 
+#ifdef TERM_URING
+  term_uring_init();
+#endif
+
   while(run){
-    FD_ZERO(&set);
-    FD_SET(pty_m, &set);
-    FD_SET(ConnectionNumber(dpy), &set);
+    /* Everything drawn since the last pass
+     *   goes out in one write, before
+     *   blocking
+     */
+    term_mouse_flush();
+    term_draw_cursor();
+    term_osc_flush();
+    term_x_frame();
+
+    /* Poll while a search is scanning, and
+     *   wake up for the next snapshot
+     */
+    ms = -1;
+    if(!search.done){
+      ms = 0;
+    } else if(snap.on && snap.pending && !alt_screen){
+      ms = term_snap_wait();
+    }
+    if(cursor_style & TERM_CURSOR_BLINK && !(cursor_style & TERM_CURSOR_NONE)){
+      wait = term_cursor_wait();
+      if(ms < 0 || wait < ms){ ms = wait; }
+    }
+    if((wait=term_resize_settle()) >= 0 && (ms < 0 || wait < ms)){
+      ms = wait;
+    }
+
+    /* Scan for hints once the shell has
+     *   been quiet for a while
+     */
+    if(hint.stale && hint.ok){
+      if(ms < 0 || HINT_IDLE_MS < ms){ ms = HINT_IDLE_MS; }
+      hint.busy = 0;
+    }
+
+    x_ready = 0;
+#ifdef TERM_URING
+    if(ring_on){
+      if(!term_uring_wait(ms, &x_ready)){ return; }
+    } else
+#endif
+    {
+      FD_ZERO(&set);
+      FD_SET(pty_m, &set);
+      FD_SET(ConnectionNumber(dpy), &set);
+      FD_ZERO(&wset);
+      if(pty_out.len > pty_out.off){
+        FD_SET(pty_m, &wset);
+      }
 
-    select(maxfd+1, &set, NULL, NULL, NULL);
+      poll.tv_sec = ms / 1000;
+      poll.tv_usec = (ms % 1000) * 1000;
+      select(maxfd+1, &set, &wset, NULL, (ms < 0 ? NULL : &poll));
 
-    if(FD_ISSET(pty_m, &set)){
-      if((pty_len=read(pty_m, pty_buf, ESC_MAX)) <= 0) { return; }
+      if(FD_ISSET(pty_m, &wset)){
+        term_pty_flush();
+      }
 
-      term_write(pty_buf, pty_len);
+      if(FD_ISSET(pty_m, &set)){
+        if((pty_len=read(pty_m, pty_buf, ESC_MAX)) <= 0){
+          if(pty_len < 0 && errno == EAGAIN){ continue; }
+          return;
+        }
+        if(!term_pty_input(pty_buf, pty_len)){ return; }
+      }
 
-      memset(pty_buf, 0, pty_len);
+      x_ready = FD_ISSET(ConnectionNumber(dpy), &set);
     }
 
-    if(FD_ISSET(ConnectionNumber(dpy), &set)){
+    if(x_ready){
+      term_x_atoms();
       while(XPending(dpy)){
         XNextEvent(dpy, &evt);
         switch(evt.type){
           case ButtonPress:
+            if(term_mouse_button(&evt.xbutton, 1) || term_hint_click(&evt.xbutton)){
+              break;
+            }
+            if(evt.xbutton.button == Button1){
+              term_sel_press(&evt.xbutton);
+            } else if(evt.xbutton.button == Button2){
+              term_paste(XA_PRIMARY, evt.xbutton.time);
+            } else if(evt.xbutton.button == Button4){
+              term_scroll_view(3);
+            } else if(evt.xbutton.button == Button5){
+              term_scroll_view(-3);
+            }
+            break;
+          case ButtonRelease:
+            if(!sel.dragging && term_mouse_button(&evt.xbutton, 0)){
+              break;
+            }
+            if(evt.xbutton.button == Button1){
+              term_sel_release(&evt.xbutton);
+            }
+            break;
+          case MotionNotify:
+            /* Only the latest position matters */
+            while(XCheckTypedWindowEvent(dpy, win, MotionNotify, &evt));
+            if(!term_mouse_motion(&evt.xmotion)){
+              term_sel_motion(&evt.xmotion);
+              term_hint_motion((sel.dragging ? -1 : evt.xmotion.x), evt.xmotion.y);
+            }
+            break;
+          case LeaveNotify:
+            term_hint_motion(-1, 0);
+            break;
+          case SelectionRequest:
+            term_sel_request(&evt.xselectionrequest);
+            break;
+          case SelectionClear:
+            term_sel_clear(&evt.xselectionclear);
+            break;
+          case SelectionNotify:
+            term_paste_notify(&evt.xselection);
+            break;
+          case PropertyNotify:
+            term_paste_chunk(&evt.xproperty);
+            term_sel_send(&evt.xproperty);
             break;
           case KeyPress:
             term_key(evt.xkey);
             break;
+          case Expose:
+            term_shadow_damage(
+              evt.xexpose.x/char_w, evt.xexpose.y/char_h,
+              (evt.xexpose.width/char_w)+2, (evt.xexpose.height/char_h)+2
+            );
+            if(evt.xexpose.count == 0 && !geom.pending){
+              term_redraw();
+            }
+            break;
           case ConfigureNotify:
-            term_width = (evt.xconfigure.width / CHAR_W);
-            term_height = (evt.xconfigure.height / CHAR_H) - 1; /* TODO: More robust solution using TOPMOST and CHAR_H */
-            term_resize();
+            /* Only the last size matters */
+            geom.pending = 1;
+            geom.width = (evt.xconfigure.width < char_w ? 1 : evt.xconfigure.width / char_w);
+            geom.height = (evt.xconfigure.height < char_h ? 1 : evt.xconfigure.height / char_h);
             break;
         }
       }
+
+      if(geom.pending){
+        term_resize_apply();
+      }
+    }
+
+    if(!search.done){
+      term_search_step();
+    }
+
+    if(hint.stale && hint.ok && !hint.busy){
+      term_hint_step();
+    }
+    if(hint.moved){
+      term_hint_hover();
+    }
+
+    if(snap.on){
+      term_snap_tick();
     }
   }
 }
 
 void term_shutdown(){
+  /* The next window starts this size */
+  if(!headless && char_h > 0){
+    term_metrics_store(1);
+  }
+  if(snap.on){
+    term_snap_close();
+  }
+  if(rec.on){
+    term_rec_close();
+  }
+  term_spill_close();
   free(screen_buf);
+  free(grid_other.buf);
+  free(shadow.cells);
+  free(shadow.hash);
+  free(pool.arena);
+  free(pool.ents);
+  free(search.matches);
+  free(search.line_buf);
+  free(search.line_map);
+  if(hint.ok){
+    dfa_free(&hint.dfa);
+  }
+  free(hint.text);
+  free(hint.map);
+  free(hint.rows);
+  free(write_buf);
+  free(pty_out.buf);
+  free(pty_sending.buf);
+#ifdef TERM_URING
+  if(ring_on){
+    uring_free(&ring);
+  }
+#endif
+  gfx.places_len = 0;
+  while(gfx.images_len > 0){
+    term_gfx_free(gfx.images_len-1);
+  }
+  free(gfx.images);
+  free(gfx.places);
+  free(gfx.data);
+  free(fb.pix);
 
+  if(batch.report && !headless){
+    log_info(
+      TERM_LOG_X_BYTES,
+      batch.frames,
+      (batch.frames > 0 ? (double)batch.bytes_total/batch.frames : 0.0),
+      batch.bytes_max
+    );
+  }
   log_info(TERM_LOG_SHUTDOWN);
 
-  XFreeFontSet(dpy, fnt);
+  if(headless){ return; }
+  term_x_free();
   XUnmapWindow(dpy, win);
   XCloseDisplay(dpy);
 }
@@ -730,9 +7389,56 @@ void term_shutdown(){
 //////////////////////////////
 // MAIN
 //
-int main(){
+int main(int argc, char **argv){
+  int opt;
+
+  while((opt=getopt(argc, argv, "TbS:s:r:p:P:H:o:g:")) != -1){
+    switch(opt){
+      case 'T':
+        startup_bench = 1;
+        break;
+      case 'b':
+        batch.report = 1;
+        break;
+      case 'H':
+        headless = optarg;
+        break;
+      case 'o':
+        headless_out = optarg;
+        break;
+      case 'g':
+        if(sscanf(optarg, "%ix%i", &term_width, &term_height) != 2 || term_width < 1 || term_height < 1){
+          term_width = term_height = 100;
+        }
+        break;
+      case 'S':
+        spill_dir = optarg;
+        break;
+      case 's':
+        snap.on = 1;
+        snap.path = optarg;
+        break;
+      case 'r':
+        rec.path = optarg;
+        break;
+      case 'P':
+        replay_fast = 1;
+        /* Fall through */
+      case 'p':
+        replay = optarg;
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-T] [-b] [-S spill_dir] [-s snapshot] [-r recording] [-p|-P recording] [-H input [-o frame.ppm] [-g COLSxROWS]]\n", argv[0]);
+        return 1;
+    }
+  }
+
   term_init();
-  term_loop();
+  if(headless){
+    term_headless_run();
+  } else {
+    term_loop();
+  }
   term_shutdown();
   return 0;
 }
@@ -0,0 +1,496 @@
+/*
+ * bench.c: Microbenchmarks for esc.h, utf8.h and grid cell writes
+ *
+ * Usage: ./bench [-b baseline] [-t threshold] [-w output]
+ *
+ *   -b  Compare against a baseline written by -w, exiting
+ *         with failure if any benchmark is more than
+ *         threshold percent (default 15) slower
+ *   -w  Write the results to a baseline file
+ *
+ * Every corpus is generated from a fixed seed, so
+ *   results are comparable between runs.
+ *
+ * Floods of shell output through a pty are also read
+ *   the way term does (with select() and read(), and
+ *   with io_uring where available), reporting the
+ *   system calls each needs (these are not compared
+ *   against the baseline, since they depend on the
+ *   scheduler as much as on term).
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <termios.h>
+#include <sys/select.h>
+#include <sys/wait.h>
+
+#include "../config.h"
+#include "../width.h"
+#include "../cell.h"
+#include "../utf8.h"
+#ifdef __linux__
+#  include "../uring.h"
+#endif
+
+static void esc_handler(char func, int args[256], int num, char *str);
+
+#define ESC_EXEC esc_handler
+#include "../esc.h"
+
+#define BENCH_SEED  0x5eed1234u
+#define BENCH_RUNS  5
+#define BENCH_MIN_NS 50000000.0
+#define BENCH_MAX   32
+#define CORPUS_SIZE (1 << 16)
+#define GRID_WIDTH  80
+#define UTF8_CHUNK  4096
+#define FLOOD_BYTES (64 << 20)
+#define FLOOD_READ  256 /* term's read() size, ESC_MAX */
+
+struct bench_result {
+  char name[64];
+  double ns;
+};
+
+static volatile uint64_t sink;
+static uint32_t rng = BENCH_SEED;
+static struct bench_result results[BENCH_MAX];
+static int results_len = 0;
+
+void esc_handler(char func, int args[ESC_MAX], int num, char *str){
+  sink += func + num + (num > 0 ? args[0] : 0);
+}
+
+uint32_t bench_rand(){
+  rng ^= rng << 13;
+  rng ^= rng >> 17;
+  rng ^= rng << 5;
+  return rng;
+}
+
+double bench_now(){
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ts.tv_sec*1e9)+ts.tv_nsec;
+}
+
+/*
+ * Run fn (which performs ops operations
+ * per call) until enough time has passed
+ * to be measurable, keeping the fastest
+ * of BENCH_RUNS runs
+ */
+void bench_run(const char *name, void (*fn)(), long ops){
+  double start, elapsed, best = 0;
+  long calls;
+  int run;
+
+  for(run=0;run<BENCH_RUNS;run++){
+    calls = 0;
+    start = bench_now();
+    do {
+      fn();
+      calls++;
+    } while((elapsed=bench_now()-start) < BENCH_MIN_NS/BENCH_RUNS);
+
+    elapsed /= (double)calls*ops;
+    if(run == 0 || elapsed < best){
+      best = elapsed;
+    }
+  }
+
+  snprintf(results[results_len].name, sizeof(results[0].name), "%s", name);
+  results[results_len++].ns = best;
+  printf("%-24s %10.3f ns/op\n", name, best);
+}
+
+//////////////////////////////
+// esc_parse
+//
+#define CSI_COUNT 1024
+static char csi_corpus[CSI_COUNT][32];
+
+void corpus_csi(){
+  static const char *fmts[] = {
+    "%i;%iH", "%iA", "%iB", "%iC", "%iD", "%iG", "K", "2J", "?25h", "?2004l"
+  };
+  int i;
+
+  for(i=0;i<CSI_COUNT;i++){
+    snprintf(csi_corpus[i], sizeof(csi_corpus[i]), fmts[bench_rand() % 10], (int)(bench_rand() % 200)+1, (int)(bench_rand() % 80)+1);
+  }
+}
+
+void bench_esc_parse(){
+  int i;
+
+  for(i=0;i<CSI_COUNT;i++){
+    esc_parse(csi_corpus[i]);
+  }
+}
+
+//////////////////////////////
+// esc_parse_gfx
+//
+#define SGR_COUNT 1024
+static int sgr_args[3][SGR_COUNT][5];
+static int sgr_num[3] = { 1, 3, 5 };
+
+void corpus_sgr(){
+  int i;
+
+  for(i=0;i<SGR_COUNT;i++){
+    /* 8-color */
+    sgr_args[0][i][0] = (bench_rand() & 1 ? 30 : 40) + (bench_rand() % 8);
+
+    /* 256-color */
+    sgr_args[1][i][0] = (bench_rand() & 1 ? 38 : 48);
+    sgr_args[1][i][1] = 5;
+    sgr_args[1][i][2] = bench_rand() % 256;
+
+    /* Truecolor */
+    sgr_args[2][i][0] = (bench_rand() & 1 ? 38 : 48);
+    sgr_args[2][i][1] = 2;
+    sgr_args[2][i][2] = bench_rand() % 256;
+    sgr_args[2][i][3] = bench_rand() % 256;
+    sgr_args[2][i][4] = bench_rand() % 256;
+  }
+}
+
+void bench_gfx(int kind){
+  int args[ESC_MAX],
+      i;
+
+  for(i=0;i<SGR_COUNT;i++){
+    memcpy(args, sgr_args[kind][i], sizeof(sgr_args[kind][i]));
+    esc_parse_gfx('m', args, sgr_num[kind], "");
+  }
+}
+
+void bench_gfx_8(){ bench_gfx(0); }
+void bench_gfx_256(){ bench_gfx(1); }
+void bench_gfx_truecolor(){ bench_gfx(2); }
+
+//////////////////////////////
+// UTF-8 decoding
+//
+static char utf8_corpus[5][CORPUS_SIZE+4];
+static int utf8_len[5],
+           utf8_count[5];
+
+void corpus_utf8(){
+  /* Ranges producing 1-, 2-, 3- and 4-byte sequences,
+   *   then CJK log output (with some ASCII mixed in)
+   */
+  static const uint32_t lo[5] = { 0x20, 0x80, 0x4e00, 0x1f300, 0x4e00 },
+                        hi[5] = { 0x7e, 0x7ff, 0x9fff, 0x1f5ff, 0x9fff };
+  uint32_t cp;
+  char *out;
+  int k;
+
+  for(k=0;k<5;k++){
+    out = utf8_corpus[k];
+    while(out-utf8_corpus[k] < CORPUS_SIZE-4){
+      cp = lo[k]+(bench_rand() % (hi[k]-lo[k]+1));
+      if(k == 4 && bench_rand() % 8 == 0){
+        cp = 0x20+(bench_rand() % 0x5f);
+      }
+      if(cp < 0x80){
+        *out++ = cp;
+      } else if(cp < 0x800){
+        *out++ = 0xc0|(cp>>6);
+        *out++ = 0x80|(cp&0x3f);
+      } else if(cp < 0x10000){
+        *out++ = 0xe0|(cp>>12);
+        *out++ = 0x80|((cp>>6)&0x3f);
+        *out++ = 0x80|(cp&0x3f);
+      } else {
+        *out++ = 0xf0|(cp>>18);
+        *out++ = 0x80|((cp>>12)&0x3f);
+        *out++ = 0x80|((cp>>6)&0x3f);
+        *out++ = 0x80|(cp&0x3f);
+      }
+      utf8_count[k]++;
+    }
+    utf8_len[k] = out-utf8_corpus[k];
+  }
+}
+
+/* Decodes in read()-sized chunks, like term_write() */
+void bench_utf8(int k){
+  struct utf8_decoder dec = { 0 };
+  static uint32_t out[UTF8_CHUNK+1];
+  int n;
+
+  for(n=0;n<utf8_len[k];n+=UTF8_CHUNK){
+    sink += out[utf8_decode(&dec, utf8_corpus[k]+n, (utf8_len[k]-n < UTF8_CHUNK ? utf8_len[k]-n : UTF8_CHUNK), out)-1];
+  }
+}
+
+void bench_utf8_1(){ bench_utf8(0); }
+void bench_utf8_2(){ bench_utf8(1); }
+void bench_utf8_3(){ bench_utf8(2); }
+void bench_utf8_4(){ bench_utf8(3); }
+void bench_utf8_cjk(){ bench_utf8(4); }
+
+//////////////////////////////
+// Grid cell writes
+//
+static uint32_t grid_text[2][CORPUS_SIZE];
+static uint128_t grid[GRID_WIDTH*2];
+
+void corpus_grid(){
+  int i;
+
+  for(i=0;i<CORPUS_SIZE;i++){
+    grid_text[0][i] = 0x20+(bench_rand() % 0x5f);
+    grid_text[1][i] = (bench_rand() & 1 ? 0x20+(bench_rand() % 0x5f) : 0x4e00+(bench_rand() % 0x5200));
+  }
+}
+
+/*
+ * Write cells through cell.h, as
+ * term_putchar() does, wrapping
+ * at the end of the row
+ */
+void bench_grid(int k){
+  uint32_t wc;
+  int i, x = 0, width;
+
+  for(i=0;i<CORPUS_SIZE;i++){
+    wc = grid_text[k][i];
+    width = cell_width(wc);
+    if(x+width > GRID_WIDTH){
+      x = 0;
+    }
+
+    cell_put(&grid[x], wc, width, FG_DEFAULT, BG_DEFAULT, 0);
+    x += width;
+  }
+  sink += CELL_CHAR(grid[0]);
+}
+
+void bench_grid_ascii(){ bench_grid(0); }
+void bench_grid_mixed(){ bench_grid(1); }
+
+//////////////////////////////
+// Shell output floods
+//
+static pid_t flood_pid;
+
+/*
+ * Start a child writing FLOOD_BYTES
+ * to a pty, returning its master
+ * (non-blocking, like term's)
+ */
+int flood_start(){
+  struct termios tio;
+  char buf[4096];
+  int master, slave;
+  long i;
+
+  master = posix_openpt(O_RDWR|O_NOCTTY);
+  if(master < 0 || grantpt(master) != 0 || unlockpt(master) != 0 ||
+      (slave=open(ptsname(master), O_RDWR|O_NOCTTY)) < 0){
+    return -1;
+  }
+  tcgetattr(slave, &tio);
+  cfmakeraw(&tio);
+  tcsetattr(slave, TCSANOW, &tio);
+
+  if((flood_pid=fork()) == 0){
+    close(master);
+    memset(buf, 'x', sizeof(buf));
+    for(i=0;i<FLOOD_BYTES;i+=sizeof(buf)){
+      buf[sizeof(buf)-1] = '\n';
+      if(write(slave, buf, sizeof(buf)) < 0){ break; }
+    }
+    _exit(0);
+  }
+  close(slave);
+
+  fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+  return master;
+}
+
+void flood_report(const char *name, double start, long bytes, long calls){
+  double s = (bench_now()-start)/1e9;
+
+  waitpid(flood_pid, NULL, 0);
+  printf("%-24s %10.1f MB/s %8.1f syscalls/MB\n", name, (bytes/1048576.0)/s, calls/(bytes/1048576.0));
+}
+
+void bench_flood_select(){
+  fd_set set;
+  char buf[FLOOD_READ];
+  double start = bench_now();
+  long bytes = 0,
+       calls = 0;
+  int fd = flood_start(),
+      n;
+
+  if(fd < 0){ return; }
+
+  for(;;){
+    FD_ZERO(&set);
+    FD_SET(fd, &set);
+    select(fd+1, &set, NULL, NULL, NULL);
+    calls += 2;
+    if((n=read(fd, buf, sizeof(buf))) <= 0){
+      if(n < 0 && errno == EAGAIN){ continue; }
+      break;
+    }
+    bytes += n;
+  }
+
+  close(fd);
+  flood_report("pty_flood_select", start, bytes, calls);
+}
+
+#ifdef __linux__
+void bench_flood_uring(){
+  struct uring r;
+  struct io_uring_cqe *cqe;
+  double start;
+  long bytes = 0;
+  int fd, res, more, done = 0;
+
+  if(uring_init(&r, 64) != 0){
+    printf("%-24s unavailable\n", "pty_flood_io_uring");
+    return;
+  }
+  if(uring_bufs(&r, 16, 4096) != 0 || (fd=flood_start()) < 0){
+    uring_free(&r);
+    return;
+  }
+
+  start = bench_now();
+  uring_read(&r, fd, 1);
+  while(!done && uring_wait(&r, -1) >= 0){
+    while((cqe=uring_cqe(&r)) != NULL){
+      res = cqe->res;
+      more = cqe->flags & IORING_CQE_F_MORE;
+      if(res > 0){
+        bytes += res;
+        uring_buf_return(&r, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+      } else if(res != -ENOBUFS && res != -EAGAIN && res != -EINTR){
+        done = 1;
+      }
+      uring_cqe_seen(&r);
+      if(!more && !done){
+        uring_read(&r, fd, 1);
+      }
+    }
+  }
+
+  close(fd);
+  flood_report("pty_flood_io_uring", start, bytes, (long)r.calls);
+  uring_free(&r);
+}
+#endif
+
+//////////////////////////////
+// Baselines
+//
+int bench_compare(const char *path, double threshold){
+  FILE *fp;
+  char name[64];
+  double ns;
+  int i, failed = 0;
+
+  if((fp=fopen(path, "r")) == NULL){
+    printf("No baseline at %s, skipping comparison.\n", path);
+    return 0;
+  }
+
+  while(fscanf(fp, "%63s %lf ns/op", name, &ns) == 2){
+    for(i=0;i<results_len;i++){
+      if(strcmp(results[i].name, name) == 0 &&
+         results[i].ns > ns*(1.0+(threshold/100.0))){
+        printf("REGRESSION %-24s %10.3f -> %.3f ns/op (+%.1f%%)\n", name, ns, results[i].ns, ((results[i].ns/ns)-1.0)*100.0);
+        failed = 1;
+      }
+    }
+  }
+
+  fclose(fp);
+  return failed;
+}
+
+void bench_write(const char *path){
+  FILE *fp;
+  int i;
+
+  if((fp=fopen(path, "w")) == NULL){
+    perror(path);
+    return;
+  }
+  for(i=0;i<results_len;i++){
+    fprintf(fp, "%-24s %10.3f ns/op\n", results[i].name, results[i].ns);
+  }
+  fclose(fp);
+}
+
+int main(int argc, char **argv){
+  char *baseline = NULL,
+       *output = NULL;
+  double threshold = 15;
+  int opt;
+
+  while((opt=getopt(argc, argv, "b:t:w:")) != -1){
+    switch(opt){
+      case 'b':
+        baseline = optarg;
+        break;
+      case 't':
+        threshold = atof(optarg);
+        break;
+      case 'w':
+        output = optarg;
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-b baseline] [-t threshold] [-w output]\n", argv[0]);
+        return 2;
+    }
+  }
+
+  corpus_csi();
+  corpus_sgr();
+  corpus_utf8();
+  corpus_grid();
+
+  bench_run("esc_parse", bench_esc_parse, CSI_COUNT);
+  bench_run("esc_parse_gfx_8", bench_gfx_8, SGR_COUNT);
+  bench_run("esc_parse_gfx_256", bench_gfx_256, SGR_COUNT);
+  bench_run("esc_parse_gfx_truecolor", bench_gfx_truecolor, SGR_COUNT);
+  bench_run("utf8_decode_1byte", bench_utf8_1, utf8_count[0]);
+  bench_run("utf8_decode_2byte", bench_utf8_2, utf8_count[1]);
+  bench_run("utf8_decode_3byte", bench_utf8_3, utf8_count[2]);
+  bench_run("utf8_decode_4byte", bench_utf8_4, utf8_count[3]);
+  bench_run("utf8_decode_cjk_log", bench_utf8_cjk, utf8_count[4]);
+  bench_run("grid_write_ascii", bench_grid_ascii, CORPUS_SIZE);
+  bench_run("grid_write_mixed", bench_grid_mixed, CORPUS_SIZE);
+
+  bench_flood_select();
+#ifdef __linux__
+  bench_flood_uring();
+#endif
+
+  if(output != NULL){
+    bench_write(output);
+  }
+  if(baseline != NULL){
+    return bench_compare(baseline, threshold);
+  }
+  return 0;
+}
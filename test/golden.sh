@@ -0,0 +1,94 @@
+#!/bin/sh
+#
+# golden.sh: Render fixed input headlessly (../term -H) and
+#   check each final frame against its hash in golden.hashes
+#
+# Usage: ./golden.sh [-u]
+#   (-u records the current hashes instead, after a deliberate
+#    change to what is drawn; frames which do not match are
+#    left in golden-NAME.ppm)
+#
+
+GEOMETRY=40x12
+HASHES=golden.hashes
+CASES="sgr wide scroll erase alt cast osc"
+
+sgr(){
+  printf 'plain \033[1mbold\033[0m \033[7mreverse\033[0m\r\n'
+  for i in 0 1 2 3 4 5 6 7; do printf '\033[3%im%i\033[4%im %i\033[0m' $i $i $i $i; done
+  printf '\r\n\033[38;5;208m256\033[48;5;22m color\033[0m\r\n'
+  printf '\033[38;2;255;128;0mtrue\033[48;2;0;64;128mcolor\033[0m\r\n'
+}
+
+wide(){
+  printf '\344\270\255\346\226\207 wide and e\314\201 combining\r\n'
+  printf '0123456789012345678901234567890123456789\344\270\255\r\n'
+  printf '\360\237\221\215\360\237\217\275 \360\237\221\250\342\200\215\360\237\221\251 clusters\r\n'
+}
+
+scroll(){
+  for i in $(seq 100); do printf 'line %i\r\n' "$i"; done
+  printf '\033[2;5r\033[5;0H'
+  for i in $(seq 6); do printf 'region %i\r\n' "$i"; done
+  printf '\033[r'
+}
+
+erase(){
+  for i in $(seq 12); do printf 'xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx'; done
+  printf '\033[3;3H\033[K\033[6;10H\033[1K\033[8;0H\033[J\033[0;0Hover\033[2;20H\033[3X'
+}
+
+alt(){
+  printf 'primary screen\r\n$ '
+  printf '\033[?1049h\033[2J\033[0;0Hfull-screen program'
+  printf '\033[?1049l'
+}
+
+cast(){
+  printf '{"version": 2, "width": 40, "height": 12}\n'
+  printf '[0.1, "o", "\\u001b[1mrecorded\\u001b[0m \\"quoted\\" \\u4e2d\\ud83d\\udc4d\\r\\n"]\n'
+  printf '[0.2, "i", "ignored"]\n'
+  printf '[0.3, "o", "second\\tevent\\r\\n"]\n'
+}
+
+osc(){
+  printf '\033]0;title\007\033]2;title \342\200\224 again\033\\no garbage\r\n'
+  printf '\033]4;1;#00ff00;2;rgb:0/8/ffff\007\033[31mpalette\033[32m set\033[0m\r\n'
+  printf '\033]11;#102030\007\033]10;rgb:ff/ff/ff\007default colors\r\n'
+  printf '\033]52;c;%s\007clipboard\r\n' "$(head -c 30000 /dev/zero | tr '\0' x | base64 | tr -d '\n')"
+  printf '\033[%s1mlong sequence\r\n' "$(printf '1;%.0s' $(seq 200))"
+}
+
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+failed=0
+[ "$1" = "-u" ] && : > "$TMP/hashes"
+
+echo "Testing headless frames:"
+for name in $CASES; do
+  "$name" > "$TMP/$name.in"
+  out=$(../term -H "$TMP/$name.in" -g "$GEOMETRY" -o "$TMP/$name.ppm" | grep "^Headless:")
+  hash=$(echo "$out" | sed 's/.*frame hash \([0-9a-f]*\)\./\1/')
+
+  if [ "$1" = "-u" ]; then
+    echo "$name $hash" >> "$TMP/hashes"
+    continue
+  fi
+
+  echo "  Test: $name ($(echo "$out" | sed 's/^Headless: \(.*\), frame hash.*/\1/'))"
+  expect=$(awk -v name="$name" '$1 == name { print $2 }' "$HASHES")
+  if [ "$hash" != "$expect" ]; then
+    echo "    Test failed (frame hash $hash, expected $expect, see golden-$name.ppm)."
+    cp "$TMP/$name.ppm" "golden-$name.ppm"
+    failed=$((failed+1))
+  fi
+done
+
+if [ "$1" = "-u" ]; then
+  cp "$TMP/hashes" "$HASHES"
+  echo "  Recorded $HASHES."
+elif [ "$failed" -gt 0 ]; then
+  echo "  $failed test(s) failed."
+  exit 1
+fi
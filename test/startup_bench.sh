@@ -0,0 +1,25 @@
+#!/bin/sh
+#
+# startup_bench.sh: Measure term's time to first prompt
+#
+# Usage: ./startup_bench.sh [runs]
+#   (requires a running X server, e.g. ../xephyr/run.sh)
+#
+
+RUNS=${1:-10}
+
+for i in $(seq "$RUNS"); do
+  ../term -T | grep "^Startup:"
+done | awk '
+  {
+    ms = $5; sub("ms", "", ms);
+    sum += ms;
+    if(NR == 1 || ms < min){ min = ms; }
+    if(ms > max){ max = ms; }
+  }
+  END {
+    if(NR > 0){
+      printf("runs: %i  mean: %.3fms  min: %.3fms  max: %.3fms\n", NR, sum/NR, min, max);
+    }
+  }
+'
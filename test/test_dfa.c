@@ -0,0 +1,93 @@
+/*
+ * test_dfa.c: Test for dfa.h
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../dfa.h"
+
+static int failed = 0;
+
+/*
+ * Match the longest prefix of in,
+ * checking its length and which
+ * pattern matched it
+ */
+void test(struct dfa *d, const char *in, int expect_len, int expect_pattern){
+  int len, pattern;
+
+  printf("  Test: \"%s\"\n", in);
+
+  len = dfa_match(d, (const uint8_t*)in, strlen(in), &pattern);
+  if(len != expect_len || (len > 0 && pattern != expect_pattern)){
+    printf("    Test failed (matched %i with pattern %i, expected %i with pattern %i).\n", len, pattern, expect_len, expect_pattern);
+    failed++;
+  }
+}
+
+void test_syntax(const char *pattern, int expect){
+  struct dfa d;
+  int ret;
+
+  printf("  Test: syntax of \"%s\"\n", pattern);
+
+  ret = dfa_compile(&d, &pattern, 1);
+  if(ret != expect){
+    printf("    Test failed (returned %i, expected %i).\n", ret, expect);
+    failed++;
+  }
+  if(ret == DFA_SUCCESS){ dfa_free(&d); }
+}
+
+int main(int argc, char **argv){
+  const char *patterns[] = {
+    "(https?|ftp)://[^ \t<>\"']+",
+    "[A-Za-z0-9_./-]+\\.[a-z]+:[0-9]+(:[0-9]+)?",
+    "[A-Z][A-Z0-9]+-[0-9]+",
+    "a(b|c)*d?"
+  };
+  struct dfa d;
+  uint8_t other[] = { 'h', 't', 't', 'p', ':', '/', '/', 'x', DFA_OTHER, 'y', ' ' };
+  int len, pattern;
+
+  printf("Testing DFA:\n");
+
+  if(dfa_compile(&d, patterns, 4) != DFA_SUCCESS){
+    printf("  Failed to compile patterns.\n");
+    return 1;
+  }
+
+  test(&d, "https://example.com/a?b=c done", 25, 0);
+  test(&d, "ftp://host\tx", 10, 0);
+  test(&d, "http:/x", 0, -1);
+  test(&d, "src/term.c:1024: error", 15, 1);
+  test(&d, "src/term.c:10:5 note", 15, 1);
+  test(&d, "term.c:", 0, -1);
+  test(&d, "PROJ-123 fixed", 8, 2);
+  test(&d, "P-1", 0, -1);
+  test(&d, "abcbcd!", 6, 3);
+  test(&d, "a", 1, 3);
+  test(&d, "", 0, -1);
+
+  printf("  Test: non-ASCII symbol\n");
+  len = dfa_match(&d, other, sizeof(other), &pattern);
+  if(len != sizeof(other)-1 || pattern != 0){
+    printf("    Test failed (matched %i, expected %i).\n", len, (int)sizeof(other)-1);
+    failed++;
+  }
+
+  dfa_free(&d);
+
+  test_syntax("[a-z", DFA_FAIL_SYNTAX);
+  test_syntax("(ab", DFA_FAIL_SYNTAX);
+  test_syntax("ab)", DFA_FAIL_SYNTAX);
+  test_syntax("a\\", DFA_FAIL_SYNTAX);
+  test_syntax("[]a]+|x*", DFA_SUCCESS);
+
+  if(failed){
+    printf("  %i test(s) failed.\n", failed);
+  }
+
+  return (failed != 0);
+}
@@ -19,6 +19,10 @@ void esc_handler(char func, int args[5], int num, char *str){
 }
 
 int main(int argc, char **argv){
+  static struct esc_string seq;
+  const char apc[] = "Ga=q,i=1;AAAA\x1b\\";
+  int i;
+
   printf("Testing escape sequence parser:\n");
 
   printf("  Test 1: Basic escape sequence\n");
@@ -27,5 +31,10 @@ int main(int argc, char **argv){
   printf("  Test 2: Graphics sequence\n");
   if(esc_parse("32;8;128;255;0m")) printf("    Test failed.\n");
 
+  printf("  Test 3: String sequence\n");
+  esc_string_start(&seq, ESC_STR_APC);
+  for(i=0;i<(int)sizeof(apc)-1 && !esc_string_put(&seq, apc[i]);i++);
+  if(i != sizeof(apc)-2 || strcmp(seq.buf, "Ga=q,i=1;AAAA") != 0) printf("    Test failed.\n");
+
   return 0;
 }
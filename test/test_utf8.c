@@ -0,0 +1,240 @@
+/*
+ * test_utf8.c: Test for utf8.h
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../utf8.h"
+
+static int failed = 0;
+
+/*
+ * Decode in chunks of every size from 1 to
+ * len, checking each result against expect
+ */
+void test(const char *name, const char *in, int len, const uint32_t *expect, int expect_len){
+  struct utf8_decoder dec;
+  uint32_t out[256];
+  int chunk, n, i, got;
+
+  printf("  Test: %s\n", name);
+
+  for(chunk=1;chunk<=len;chunk++){
+    dec.carry_len = 0;
+    got = 0;
+    for(n=0;n<len;n+=chunk){
+      got += utf8_decode(&dec, in+n, (len-n < chunk ? len-n : chunk), out+got);
+    }
+
+    if(got != expect_len){
+      printf("    Test failed (chunk %i: %i code points, expected %i).\n", chunk, got, expect_len);
+      failed++;
+      return;
+    }
+    for(i=0;i<got;i++){
+      if(out[i] != expect[i]){
+        printf("    Test failed (chunk %i: U+%04X at %i, expected U+%04X).\n", chunk, out[i], i, expect[i]);
+        failed++;
+        return;
+      }
+    }
+  }
+}
+
+/*
+ * Decode a sequence at a time with
+ * utf8_decode_one(), to check the
+ * block decoders against
+ */
+int reference(const unsigned char *in, int len, uint32_t *out){
+  int n = 0,
+      got = 0,
+      r;
+
+  while(n < len && (r=utf8_decode_one(in+n, len-n, &out[got])) > 0){
+    n += r;
+    got++;
+  }
+  return got;
+}
+
+/*
+ * Random text mixing sequences of
+ * every length, with some bytes
+ * corrupted, decoded in two pieces
+ */
+void test_mixed(){
+  static const uint32_t lo[] = { 0x20, 0x80, 0x800, 0x4e00, 0x10000, 0x1f300 },
+                        hi[] = { 0x7e, 0x7ff, 0xffff, 0x9fff, 0x10ffff, 0x1f5ff };
+  static unsigned char in[4096+4];
+  static uint32_t out[4096+1], expect[4096+1];
+  struct utf8_decoder dec;
+  uint32_t rng = 0x5eed, cp;
+  int round, len, split, got, want, i;
+
+  printf("  Test: Mixed-length text\n");
+
+  for(round=0;round<2000;round++){
+    for(len=0;len<4096;){
+      rng ^= rng << 13; rng ^= rng >> 17; rng ^= rng << 5;
+      i = rng % 6;
+      cp = lo[i]+((rng >> 8) % (hi[i]-lo[i]+1));
+      if(cp >= 0xd800 && cp <= 0xdfff){ continue; }
+      len += utf8_encode(cp, (char*)in+len);
+    }
+    len = 4096;
+
+    /* Later rounds get a few bad bytes */
+    for(i=0;i<round%4;i++){
+      rng ^= rng << 13; rng ^= rng >> 17; rng ^= rng << 5;
+      in[rng % len] = rng >> 24;
+    }
+
+    want = reference(in, len, expect);
+    split = rng % len;
+    dec.carry_len = 0;
+    got = utf8_decode(&dec, (char*)in, split, out);
+    got += utf8_decode(&dec, (char*)in+split, len-split, out+got);
+
+    for(i=0;i<got && i<want && out[i] == expect[i];i++);
+    if(got != want || i < got){
+      printf("    Test failed (round %i: %i code points, expected %i, first difference at %i).\n", round, got, want, i);
+      failed++;
+      return;
+    }
+  }
+}
+
+#ifdef UTF8_SIMD
+/*
+ * Random text for the SSSE3 decoder
+ * alone: sequences of every length,
+ * runs of ASCII and stray bytes, whose
+ * output must match decoding the bytes
+ * it used one sequence at a time
+ */
+void test_simd(){
+  static const uint32_t lo[] = { 0x20, 0x80, 0x800, 0x10000 },
+                        hi[] = { 0x7e, 0x7ff, 0xffff, 0x10ffff };
+  static unsigned char in[1024+4];
+  static uint32_t out[1024+16], expect[1024+1];
+  uint32_t rng = 0x51d, cp;
+  int round, len, used, got, want, i;
+
+  printf("  Test: SSSE3 decoder against utf8_decode_one()\n");
+  if(!__builtin_cpu_supports("ssse3")){ return; }
+  utf8_mixed_init();
+
+  for(round=0;round<20000;round++){
+    for(len=0;len<1024;){
+      rng ^= rng << 13; rng ^= rng >> 17; rng ^= rng << 5;
+      if(rng % 16 == 0){
+        /* A run of ASCII, as long as a block */
+        for(i=0;i<16;i++){ in[len++] = 'a'+i; }
+        continue;
+      }
+      if(rng % 16 == 1){
+        in[len++] = 0x80+((rng >> 8) & 0x7f);
+        continue;
+      }
+      i = (rng >> 4) % 4;
+      cp = lo[i]+((rng >> 8) % (hi[i]-lo[i]+1));
+      if(cp >= 0xd800 && cp <= 0xdfff){ continue; }
+      len += utf8_encode(cp, (char*)in+len);
+    }
+    len = 1024;
+
+    got = utf8_mixed_ssse3(in, len, out, &used);
+    want = reference(in, used, expect);
+
+    for(i=0;i<got && i<want && out[i] == expect[i];i++);
+    if(got != want || i < got){
+      printf("    Test failed (round %i: %i code points from %i bytes, expected %i, first difference at %i).\n", round, got, used, want, i);
+      failed++;
+      return;
+    }
+  }
+}
+#endif
+
+int main(int argc, char **argv){
+  static char cjk[3*64+1], cyr[2*64+1], ascii[100];
+  static uint32_t cjk_cp[64], cyr_cp[64], ascii_cp[100];
+  struct utf8_decoder dec = { 0 };
+  uint32_t cp, dec_cp[5];
+  char enc[4];
+  int i, len;
+
+  printf("Testing UTF-8 decoder:\n");
+
+  test("Valid 1- to 4-byte sequences", "A\xc3\xa9\xe4\xb8\x80\xf0\x9f\x98\x80", 10,
+       (uint32_t[]){ 'A', 0xe9, 0x4e00, 0x1f600 }, 4);
+  test("Overlong forms", "\xc0\xaf\xe0\x80\xaf", 5,
+       (uint32_t[]){ 0xfffd, 0xfffd, 0xfffd, 0xfffd, 0xfffd }, 5);
+  test("Surrogates", "\xed\xa0\x80", 3,
+       (uint32_t[]){ 0xfffd, 0xfffd, 0xfffd }, 3);
+  test("Past U+10FFFF", "\xf4\x90\x80\x80", 4,
+       (uint32_t[]){ 0xfffd, 0xfffd, 0xfffd, 0xfffd }, 4);
+  test("Truncated sequence", "\xe4\xb8" "A", 3,
+       (uint32_t[]){ 0xfffd, 'A' }, 2);
+  test("Stray continuation bytes", "\x80" "A\xbf", 3,
+       (uint32_t[]){ 0xfffd, 'A', 0xfffd }, 3);
+  test("Stray continuation byte after an ASCII block",
+       "\xc3\xa9\xc3\xa9\xc3\xa9\xc3\xa9" "aaaaaaaaaaaaaaaa" "\x80"
+       "bbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbb", 85,
+       (uint32_t[]){ 0xe9, 0xe9, 0xe9, 0xe9,
+                     'a', 'a', 'a', 'a', 'a', 'a', 'a', 'a', 'a', 'a', 'a', 'a', 'a', 'a', 'a', 'a',
+                     0xfffd,
+                     'b', 'b', 'b', 'b', 'b', 'b', 'b', 'b', 'b', 'b', 'b', 'b', 'b', 'b', 'b', 'b', 'b', 'b', 'b', 'b',
+                     'b', 'b', 'b', 'b', 'b', 'b', 'b', 'b', 'b', 'b', 'b', 'b', 'b', 'b', 'b', 'b', 'b', 'b', 'b', 'b',
+                     'b', 'b', 'b', 'b', 'b', 'b', 'b', 'b', 'b', 'b', 'b', 'b', 'b', 'b', 'b', 'b', 'b', 'b', 'b', 'b' }, 81);
+
+  for(i=0;i<100;i++){
+    ascii[i] = 0x20+(i % 0x5f);
+    ascii_cp[i] = ascii[i];
+  }
+  test("ASCII run", ascii, 100, ascii_cp, 100);
+
+  for(i=0;i<64;i++){
+    cjk_cp[i] = 0x4e00+(i*97);
+    cjk[i*3] = 0xe0|(cjk_cp[i]>>12);
+    cjk[(i*3)+1] = 0x80|((cjk_cp[i]>>6)&0x3f);
+    cjk[(i*3)+2] = 0x80|(cjk_cp[i]&0x3f);
+  }
+  test("3-byte run", cjk, 3*64, cjk_cp, 64);
+
+  cjk[3*20] = 0xe0;
+  cjk[(3*20)+1] = 0x80;
+  cjk_cp[20] = cjk_cp[21] = cjk_cp[22] = 0xfffd;
+  test("Overlong form in a 3-byte run", cjk, 3*21, cjk_cp, 23);
+
+  for(i=0;i<64;i++){
+    cyr_cp[i] = 0x400+(i*7);
+    cyr[i*2] = 0xc0|(cyr_cp[i]>>6);
+    cyr[(i*2)+1] = 0x80|(cyr_cp[i]&0x3f);
+  }
+  test("2-byte run", cyr, 2*64, cyr_cp, 64);
+
+  test_mixed();
+#ifdef UTF8_SIMD
+  test_simd();
+#endif
+
+  printf("  Test: Encoding round trip\n");
+  for(cp=0;cp<=0x10ffff;cp++){
+    if(cp >= 0xd800 && cp <= 0xdfff){ continue; }
+    len = utf8_encode(cp, enc);
+    if(utf8_decode(&dec, enc, len, dec_cp) != 1 || dec_cp[0] != cp){
+      printf("    Test failed (U+%04X).\n", cp);
+      failed++;
+      break;
+    }
+  }
+
+  if(failed){
+    printf("  %i test(s) failed.\n", failed);
+  }
+
+  return (failed != 0);
+}
@@ -0,0 +1,84 @@
+/*
+ * test_width.c: Test for width.h
+ *
+ * Checks the generated table against fixed
+ *   widths (which do not depend on the C library
+ *   the table was built with), then every code
+ *   point against this C library's wcwidth()
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <locale.h>
+#include <wchar.h>
+
+#include "../width.h"
+
+/* Ranges of code points and the width
+ *   each of them should have
+ */
+static const struct {
+  int first,
+      last,
+      width;
+  const char *name;
+} fixed[] = {
+  { 0x0020,  0x007e,  1, "ASCII" },
+  { 0x00ad,  0x00ad,  1, "Soft hyphen" },
+  { 0x0300,  0x036f,  0, "Combining diacritical marks" },
+  { 0x0591,  0x05bd,  0, "Hebrew points" },
+  { 0x1100,  0x115f,  2, "Hangul Jamo initial" },
+  { 0x1160,  0x11ff,  0, "Hangul Jamo medial and final" },
+  { 0x200b,  0x200b,  0, "Zero width space" },
+  { 0x200d,  0x200d,  0, "Zero width joiner" },
+  { 0x20d0,  0x20dc,  0, "Combining marks for symbols" },
+  { 0x3041,  0x3096,  2, "Hiragana" },
+  { 0x4e00,  0x9fff,  2, "CJK unified ideographs" },
+  { 0xac00,  0xd7a3,  2, "Hangul syllables" },
+  { 0xe000,  0xf8ff,  1, "Private use" },
+  { 0xfe00,  0xfe0f,  0, "Variation selectors" },
+  { 0xff01,  0xff60,  2, "Fullwidth forms" },
+  { 0x1f3fb, 0x1f3ff, 2, "Emoji modifiers" },
+  { 0x1f600, 0x1f64f, 2, "Emoticons" },
+  { 0x20000, 0x2a6df, 2, "CJK extension B" },
+  { 0xe0100, 0xe01ef, 0, "Variation selectors supplement" },
+  { 0x110000, 0x110000, 1, "Out of range" }
+};
+
+int main(int argc, char **argv){
+  int cp, w, i, bad, failed = 0;
+
+  printf("Testing width table:\n");
+
+  for(i=0;i<(int)(sizeof(fixed)/sizeof(fixed[0]));i++){
+    printf("  Test: %s\n", fixed[i].name);
+    for(bad=0,cp=fixed[i].first;cp<=fixed[i].last;cp++){
+      if(width_lookup(cp) != fixed[i].width && bad++ == 0){
+        printf("    Test failed (U+%04X: expected %i, got %i).\n", cp, fixed[i].width, width_lookup(cp));
+      }
+    }
+    failed += (bad != 0);
+  }
+
+  if(setlocale(LC_CTYPE, "C.UTF-8") == NULL){
+    printf("  Skipped wcwidth() comparison (no C.UTF-8 locale).\n");
+    return (failed != 0);
+  }
+
+  printf("  Test: wcwidth() of every code point\n");
+  for(bad=0,cp=0;cp<0x110000;cp++){
+    w = wcwidth(cp);
+    w = (w < 0 ? 1 : w);
+    if(width_lookup(cp) != w && bad++ < 10){
+      printf("    Test failed (U+%04X: expected %i, got %i).\n", cp, w, width_lookup(cp));
+    }
+  }
+  failed += (bad != 0);
+
+  if(failed){
+    printf("  %i test(s) failed.\n", failed);
+  }
+
+  return (failed != 0);
+}
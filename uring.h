@@ -0,0 +1,322 @@
+/*
+ * uring.h: a minimal io_uring wrapper, using the system calls directly
+ *
+ * Example usage:
+ *
+ *  struct uring ring;
+ *  struct io_uring_cqe *cqe;
+ *
+ *  if(uring_init(&ring, 64) == 0 && uring_bufs(&ring, 16, 4096) == 0){
+ *    uring_read(&ring, fd, MY_READ);
+ *    uring_wait(&ring, -1);               // Submits, then waits for a completion
+ *    while((cqe=uring_cqe(&ring)) != NULL){
+ *      // cqe->user_data == MY_READ, cqe->res bytes are in
+ *      //   uring_buf(&ring, cqe->flags >> IORING_CQE_BUFFER_SHIFT)
+ *      uring_cqe_seen(&ring);
+ *    }
+ *  }
+ *
+ * Reads take their buffers from a ring of provided buffers (handed
+ *   back with uring_buf_return()), and stay armed where the kernel
+ *   supports multishot reads (IORING_CQE_F_MORE is then set).
+ */
+
+#ifndef __URING_H
+#define __URING_H
+
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* Newer than some headers (Linux 6.7) */
+#define URING_OP_READ_MULTISHOT 49
+
+/* The buffer group reads select from */
+#define URING_BGID 0
+
+struct uring {
+  int fd,
+      multishot;   /* Reads stay armed */
+
+  /* Submission queue */
+  unsigned *sq_head,
+           *sq_tail,
+           *sq_mask,
+           *sq_array,
+           sq_queued;  /* Filled since the last uring_wait() */
+  struct io_uring_sqe *sqes;
+
+  /* Completion queue */
+  unsigned *cq_head,
+           *cq_tail,
+           *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  void *sq_map,
+       *cq_map;
+  size_t sq_map_len,
+         cq_map_len,
+         sqes_len;
+
+  /* Provided buffers */
+  struct io_uring_buf_ring *br;
+  char *bufs;
+  unsigned bufs_len,
+           buf_size;
+  size_t br_len;
+
+  /* System calls made (io_uring_enter and
+   *   io_uring_register), for benchmarking
+   */
+  uint64_t calls;
+};
+
+int uring_init(struct uring *r, unsigned entries);
+void uring_free(struct uring *r);
+int uring_bufs(struct uring *r, unsigned count, unsigned size);
+void uring_buf_return(struct uring *r, unsigned bid);
+struct io_uring_sqe *uring_sqe(struct uring *r);
+void uring_read(struct uring *r, int fd, uint64_t tag);
+void uring_poll(struct uring *r, int fd, short events, int multishot, uint64_t tag);
+void uring_write(struct uring *r, int fd, const void *buf, unsigned len, uint64_t tag);
+int uring_wait(struct uring *r, int ms);
+struct io_uring_cqe *uring_cqe(struct uring *r);
+void uring_cqe_seen(struct uring *r);
+
+#define uring_buf(r, bid) ((r)->bufs+((size_t)(bid)*(r)->buf_size))
+
+/*
+ * Set up a ring, returning -1
+ * (with errno set) if the kernel
+ * does not allow it
+ */
+int uring_init(struct uring *r, unsigned entries){
+  struct io_uring_params p;
+  struct io_uring_probe *probe;
+  size_t probe_len = sizeof(struct io_uring_probe)+(256*sizeof(struct io_uring_probe_op));
+
+  memset(r, 0, sizeof(struct uring));
+  memset(&p, 0, sizeof(p));
+
+  if((r->fd=syscall(__NR_io_uring_setup, entries, &p)) < 0){ return -1; }
+
+  /* Both queues share one mapping since
+   *   Linux 5.4, and the timed waits
+   *   below need 5.11
+   */
+  if(!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG)){
+    close(r->fd);
+    errno = ENOSYS;
+    return -1;
+  }
+
+  r->sq_map_len = p.sq_off.array+(p.sq_entries*sizeof(unsigned));
+  r->cq_map_len = p.cq_off.cqes+(p.cq_entries*sizeof(struct io_uring_cqe));
+  if(r->cq_map_len > r->sq_map_len){ r->sq_map_len = r->cq_map_len; }
+  r->cq_map_len = r->sq_map_len;
+  r->sqes_len = p.sq_entries*sizeof(struct io_uring_sqe);
+
+  r->sq_map = mmap(NULL, r->sq_map_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  r->sqes = mmap(NULL, r->sqes_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if(r->sq_map == MAP_FAILED || r->sqes == MAP_FAILED){
+    if(r->sq_map != MAP_FAILED){ munmap(r->sq_map, r->sq_map_len); }
+    close(r->fd);
+    return -1;
+  }
+  r->cq_map = r->sq_map;
+
+  r->sq_head  = (unsigned*)((char*)r->sq_map+p.sq_off.head);
+  r->sq_tail  = (unsigned*)((char*)r->sq_map+p.sq_off.tail);
+  r->sq_mask  = (unsigned*)((char*)r->sq_map+p.sq_off.ring_mask);
+  r->sq_array = (unsigned*)((char*)r->sq_map+p.sq_off.array);
+  r->cq_head  = (unsigned*)((char*)r->cq_map+p.cq_off.head);
+  r->cq_tail  = (unsigned*)((char*)r->cq_map+p.cq_off.tail);
+  r->cq_mask  = (unsigned*)((char*)r->cq_map+p.cq_off.ring_mask);
+  r->cqes     = (struct io_uring_cqe*)((char*)r->cq_map+p.cq_off.cqes);
+
+  /* Multishot reads need Linux 6.7 */
+  if((probe=calloc(1, probe_len)) != NULL){
+    r->calls++;
+    if(syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+        probe->last_op >= URING_OP_READ_MULTISHOT &&
+        probe->ops[URING_OP_READ_MULTISHOT].flags & IO_URING_OP_SUPPORTED){
+      r->multishot = 1;
+    }
+    free(probe);
+  }
+
+  return 0;
+}
+
+void uring_free(struct uring *r){
+  if(r->br != NULL){ munmap(r->br, r->br_len); }
+  free(r->bufs);
+  munmap(r->sqes, r->sqes_len);
+  munmap(r->sq_map, r->sq_map_len);
+  close(r->fd);
+}
+
+/*
+ * Hand the kernel count buffers of
+ * size bytes for reads to fill
+ * (count must be a power of two)
+ */
+int uring_bufs(struct uring *r, unsigned count, unsigned size){
+  struct io_uring_buf_reg reg;
+  unsigned i;
+
+  r->br_len = count*sizeof(struct io_uring_buf);
+  r->br = mmap(NULL, r->br_len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if(r->br == MAP_FAILED){
+    r->br = NULL;
+    return -1;
+  }
+  if((r->bufs=malloc((size_t)count*size)) == NULL){ return -1; }
+  r->bufs_len = count;
+  r->buf_size = size;
+
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uintptr_t)r->br;
+  reg.ring_entries = count;
+  reg.bgid = URING_BGID;
+  r->calls++;
+  if(syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0){ return -1; }
+
+  for(i=0;i<count;i++){
+    r->br->bufs[i].addr = (uintptr_t)uring_buf(r, i);
+    r->br->bufs[i].len = size;
+    r->br->bufs[i].bid = i;
+  }
+  __atomic_store_n(&r->br->tail, count, __ATOMIC_RELEASE);
+
+  return 0;
+}
+
+void uring_buf_return(struct uring *r, unsigned bid){
+  unsigned short tail = r->br->tail;
+  struct io_uring_buf *buf = &r->br->bufs[tail & (r->bufs_len-1)];
+
+  buf->addr = (uintptr_t)uring_buf(r, bid);
+  buf->len = r->buf_size;
+  buf->bid = bid;
+  __atomic_store_n(&r->br->tail, tail+1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Return a cleared submission
+ * entry, or NULL if the queue
+ * is full
+ */
+struct io_uring_sqe *uring_sqe(struct uring *r){
+  unsigned tail = *r->sq_tail,
+           idx;
+  struct io_uring_sqe *sqe;
+
+  if(tail-__atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) > *r->sq_mask){ return NULL; }
+
+  idx = tail & *r->sq_mask;
+  sqe = &r->sqes[idx];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  r->sq_array[idx] = idx;
+  __atomic_store_n(r->sq_tail, tail+1, __ATOMIC_RELEASE);
+  r->sq_queued++;
+
+  return sqe;
+}
+
+void uring_read(struct uring *r, int fd, uint64_t tag){
+  struct io_uring_sqe *sqe = uring_sqe(r);
+
+  if(sqe == NULL){ return; }
+  sqe->opcode = (r->multishot ? URING_OP_READ_MULTISHOT : IORING_OP_READ);
+  sqe->fd = fd;
+  sqe->off = -1;
+  sqe->len = (r->multishot ? 0 : r->buf_size);
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BGID;
+  sqe->user_data = tag;
+}
+
+/*
+ * Wait for events on fd, once or
+ * (with multishot) until removed
+ */
+void uring_poll(struct uring *r, int fd, short events, int multishot, uint64_t tag){
+  struct io_uring_sqe *sqe = uring_sqe(r);
+
+  if(sqe == NULL){ return; }
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = events;
+  sqe->len = (multishot ? IORING_POLL_ADD_MULTI : 0);
+  sqe->user_data = tag;
+}
+
+void uring_write(struct uring *r, int fd, const void *buf, unsigned len, uint64_t tag){
+  struct io_uring_sqe *sqe = uring_sqe(r);
+
+  if(sqe == NULL){ return; }
+  sqe->opcode = IORING_OP_WRITE;
+  sqe->fd = fd;
+  sqe->off = -1;
+  sqe->addr = (uintptr_t)buf;
+  sqe->len = len;
+  sqe->user_data = tag;
+}
+
+/*
+ * Submit whatever has been queued
+ * and wait up to ms (or forever,
+ * if negative) for a completion,
+ * all in one system call
+ */
+int uring_wait(struct uring *r, int ms){
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+  unsigned flags = IORING_ENTER_EXT_ARG;
+  int ret;
+
+  if(*r->cq_head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)){
+    flags |= IORING_ENTER_GETEVENTS;
+  }
+
+  memset(&arg, 0, sizeof(arg));
+  if(ms >= 0){
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000L;
+    arg.ts = (uintptr_t)&ts;
+  }
+
+  r->calls++;
+  ret = syscall(__NR_io_uring_enter, r->fd, r->sq_queued, (flags & IORING_ENTER_GETEVENTS ? 1 : 0), flags, &arg, sizeof(arg));
+  if(ret >= 0){
+    r->sq_queued -= ret;
+  } else if(errno == ETIME || errno == EINTR){
+    ret = 0;
+  }
+  return ret;
+}
+
+/*
+ * Return the next completion,
+ * or NULL if there is none
+ */
+struct io_uring_cqe *uring_cqe(struct uring *r){
+  unsigned head = *r->cq_head;
+
+  if(head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)){ return NULL; }
+  return &r->cqes[head & *r->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *r){
+  __atomic_store_n(r->cq_head, *r->cq_head+1, __ATOMIC_RELEASE);
+}
+
+#endif
@@ -0,0 +1,543 @@
+/*
+ * utf8.h: a streaming, validating UTF-8 decoder
+ *
+ * Example usage:
+ *
+ *  struct utf8_decoder dec = { 0 };
+ *  uint32_t out[sizeof(buf)+1];
+ *
+ *  while((len=read(fd, buf, sizeof(buf))) > 0){
+ *    n = utf8_decode(&dec, buf, len, out); // out now holds n code points
+ *    ...
+ *  }
+ *
+ * Sequences split between two calls are carried
+ *   over to the next one, and invalid input
+ *   (overlong forms, surrogates, stray or missing
+ *   continuation bytes) decodes to U+FFFD, one per
+ *   maximal invalid subpart as recommended by the
+ *   Unicode standard.
+ *
+ * On x86, runs of ASCII are widened 16 bytes at a
+ *   time with SSE2. When the CPU supports SSSE3,
+ *   runs of 2- and 3-byte sequences (Cyrillic, CJK,
+ *   ...) are decoded eight and four at a time, and
+ *   other text (CJK mixed with ASCII, emoji, ...) up
+ *   to four sequences of any length at a time,
+ *   shuffled into place by a table indexed by where
+ *   sequences start in each 16-byte block.
+ *
+ * utf8_encode() goes the other way, for text
+ *   copied out of the grid.
+ */
+
+#ifndef __UTF8_H
+#define __UTF8_H
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#  define UTF8_SIMD
+#  include <emmintrin.h>
+#  include <tmmintrin.h>
+#endif
+
+#define UTF8_REPLACEMENT 0xfffd
+
+struct utf8_decoder {
+  unsigned char carry[4];
+  int carry_len;
+};
+
+int utf8_decode(struct utf8_decoder *dec, const char *buf, int len, uint32_t *out);
+
+/*
+ * Number of bytes in a sequence
+ * starting with lead byte c, or
+ * 0 if c cannot start one
+ */
+static inline int utf8_seq_len(unsigned char c){
+  if(c < 0x80){ return 1; }
+  if(c < 0xc2){ return 0; }
+  if(c < 0xe0){ return 2; }
+  if(c < 0xf0){ return 3; }
+  if(c < 0xf5){ return 4; }
+  return 0;
+}
+
+/*
+ * Whether c may follow lead as
+ * the first continuation byte
+ * (rejecting overlong forms,
+ * surrogates and values past
+ * U+10FFFF)
+ */
+static inline int utf8_first_cont(unsigned char lead, unsigned char c){
+  /* Not a switch: a jump table costs an
+   *   indirect branch per sequence
+   */
+  if(lead == 0xe0){ return (c >= 0xa0 && c <= 0xbf); }
+  if(lead == 0xed){ return (c >= 0x80 && c <= 0x9f); }
+  if(lead == 0xf0){ return (c >= 0x90 && c <= 0xbf); }
+  if(lead == 0xf4){ return (c >= 0x80 && c <= 0x8f); }
+  return (c >= 0x80 && c <= 0xbf);
+}
+
+/*
+ * Decode the sequence at s (of at
+ * most avail bytes) into *cp,
+ * returning the bytes consumed,
+ * or the negated length of the
+ * valid prefix if it is cut off
+ * by the end of the input
+ */
+static inline int utf8_decode_one(const unsigned char *s, int avail, uint32_t *cp){
+  int need = utf8_seq_len(s[0]);
+
+  if(need <= 1){
+    *cp = (need == 1 ? s[0] : UTF8_REPLACEMENT);
+    return 1;
+  }
+
+  /* Checked one byte at a time so a bad
+   *   byte ends the sequence where it is
+   */
+  if(avail < 2){ return -1; }
+  if(!utf8_first_cont(s[0], s[1])){ goto invalid1; }
+  if(need == 2){
+    *cp = ((s[0] & 0x1f) << 6) | (s[1] & 0x3f);
+    return 2;
+  }
+
+  if(avail < 3){ return -2; }
+  if((s[2] & 0xc0) != 0x80){ goto invalid2; }
+  if(need == 3){
+    *cp = ((s[0] & 0x0f) << 12) | ((s[1] & 0x3f) << 6) | (s[2] & 0x3f);
+    return 3;
+  }
+
+  if(avail < 4){ return -3; }
+  if((s[3] & 0xc0) != 0x80){ goto invalid3; }
+  *cp = ((s[0] & 0x07) << 18) | ((s[1] & 0x3f) << 12) | ((s[2] & 0x3f) << 6) | (s[3] & 0x3f);
+  return 4;
+
+invalid1:
+  *cp = UTF8_REPLACEMENT;
+  return 1;
+invalid2:
+  *cp = UTF8_REPLACEMENT;
+  return 2;
+invalid3:
+  *cp = UTF8_REPLACEMENT;
+  return 3;
+}
+
+/*
+ * Encode cp into out (at least
+ * 4 bytes), returning the bytes
+ * written
+ */
+static inline int utf8_encode(uint32_t cp, char *out){
+  if(cp < 0x80){
+    out[0] = cp;
+    return 1;
+  }
+  if(cp < 0x800){
+    out[0] = 0xc0 | (cp >> 6);
+    out[1] = 0x80 | (cp & 0x3f);
+    return 2;
+  }
+  if(cp < 0x10000){
+    out[0] = 0xe0 | (cp >> 12);
+    out[1] = 0x80 | ((cp >> 6) & 0x3f);
+    out[2] = 0x80 | (cp & 0x3f);
+    return 3;
+  }
+  out[0] = 0xf0 | (cp >> 18);
+  out[1] = 0x80 | ((cp >> 12) & 0x3f);
+  out[2] = 0x80 | ((cp >> 6) & 0x3f);
+  out[3] = 0x80 | (cp & 0x3f);
+  return 4;
+}
+
+#ifdef UTF8_SIMD
+/*
+ * Widen up to len bytes of ASCII,
+ * returning how many were done
+ */
+static inline int utf8_ascii_sse2(const unsigned char *s, int len, uint32_t *out){
+  __m128i v, zero = _mm_setzero_si128(),
+          lo, hi;
+  int n = 0;
+
+  while(n+16 <= len){
+    v = _mm_loadu_si128((const __m128i*)(s+n));
+    if(_mm_movemask_epi8(v) != 0){ break; }
+
+    lo = _mm_unpacklo_epi8(v, zero);
+    hi = _mm_unpackhi_epi8(v, zero);
+    _mm_storeu_si128((__m128i*)(out+n),    _mm_unpacklo_epi16(lo, zero));
+    _mm_storeu_si128((__m128i*)(out+n+4),  _mm_unpackhi_epi16(lo, zero));
+    _mm_storeu_si128((__m128i*)(out+n+8),  _mm_unpacklo_epi16(hi, zero));
+    _mm_storeu_si128((__m128i*)(out+n+12), _mm_unpackhi_epi16(hi, zero));
+    n += 16;
+  }
+  return n;
+}
+
+/* Where the sequences of a 16-byte
+ *   block start (byte 0 always does),
+ *   as bits 1 to 12, index a shuffle
+ *   moving the first four which end
+ *   by byte 12 into 32-bit lanes (the
+ *   last byte lowest) and the count
+ *   and bytes of those (count | bytes
+ *   << 3). Bits 4 to 6 of each shuffle
+ *   byte, which pshufb ignores, say what
+ *   the byte must be: 0 for ASCII, 1 for
+ *   a continuation byte and 2 to 4 for
+ *   the lead of a sequence that long.
+ *   utf8_mixed_init() fills them in once
+ */
+static unsigned char utf8_mixed_shuf[4096][16],
+                     utf8_mixed_meta[4096];
+
+static inline void utf8_mixed_init(){
+  int key, pos, next, count, k;
+
+  for(key=0;key<4096;key++){
+    memset(utf8_mixed_shuf[key], 0x80, 16);
+    pos = count = 0;
+    while(count < 4){
+      for(next=pos+1;next<=12 && !(key & (1 << (next-1)));next++);
+      if(next > 12 || next-pos > 4){ break; }
+      for(k=0;k<next-pos;k++){
+        utf8_mixed_shuf[key][(count*4)+k] = (next-1-k) | ((k == next-pos-1 ? (k == 0 ? 0 : k+1) : 1) << 4);
+      }
+      pos = next;
+      count++;
+    }
+    utf8_mixed_meta[key] = count | (pos << 3);
+  }
+}
+
+/*
+ * Decode sequences of any length,
+ * setting *in to the bytes used
+ * and returning the code points
+ * written
+ */
+__attribute__((target("ssse3")))
+static inline int utf8_mixed_ssse3(const unsigned char *s, int len, uint32_t *out, int *in){
+  /* By what a byte must be: the high
+   *   bits it has (the rest are the code
+   *   point's, and the ones it must have
+   *   are these shifted left by one) and,
+   *   for leads, the least code point the
+   *   sequence may encode (a byte lower)
+   */
+  const __m128i kind_mask = _mm_setr_epi8(-128, -64, -32, -16, -8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0),
+                kind_min = _mm_setr_epi8(0, 0, -128, 0x08, 0x01, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0),
+                zero = _mm_setzero_si128();
+  __m128i v, t, shuf, kind, mask, cp, bad, lo16, hi16;
+  uint64_t starts, m;
+  int n = 0,
+      o = 0,
+      end = 0,
+      limit, pos, key, meta;
+
+  while(n+16 <= len){
+    /* Where sequences start (at bytes
+     *   other than 0x80 to 0xbf) in up to
+     *   64 bytes, found up front
+     */
+    starts = (uint16_t)_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_loadu_si128((const __m128i*)(s+n)), _mm_set1_epi8(-65)));
+    if(n+64 <= len){
+      starts |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_loadu_si128((const __m128i*)(s+n+16)), _mm_set1_epi8(-65))) << 16;
+      starts |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_loadu_si128((const __m128i*)(s+n+32)), _mm_set1_epi8(-65))) << 32;
+      starts |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_loadu_si128((const __m128i*)(s+n+48)), _mm_set1_epi8(-65))) << 48;
+      limit = 48;
+    } else {
+      limit = 0;
+    }
+    if(!(starts & 1)){ break; }
+
+    /* Groups of four sequences are found by
+     *   clearing four start bits at a time,
+     *   so moving on does not wait on the
+     *   table (unless fewer fit); bit 63
+     *   stops the walk
+     */
+    m = starts | (1ULL << 63);
+    end = 0;
+    while((pos=__builtin_ctzll(m)) <= limit){
+      v = _mm_loadu_si128((const __m128i*)(s+n+pos));
+      if(_mm_movemask_epi8(v) == 0){
+        lo16 = _mm_unpacklo_epi8(v, zero);
+        hi16 = _mm_unpackhi_epi8(v, zero);
+        _mm_storeu_si128((__m128i*)(out+o),    _mm_unpacklo_epi16(lo16, zero));
+        _mm_storeu_si128((__m128i*)(out+o+4),  _mm_unpackhi_epi16(lo16, zero));
+        _mm_storeu_si128((__m128i*)(out+o+8),  _mm_unpacklo_epi16(hi16, zero));
+        _mm_storeu_si128((__m128i*)(out+o+12), _mm_unpackhi_epi16(hi16, zero));
+        o += 16;
+        end = pos+16;
+
+        /* A continuation byte right after
+         *   is left for the scalar path
+         *   (to be replaced)
+         */
+        if(end < limit+16 && !(starts & (1ULL << end))){ goto done; }
+        m = (end < 64 ? starts & (~0ULL << end) : 0) | (1ULL << 63);
+        continue;
+      }
+
+      key = (starts >> (pos+1)) & 0xfff;
+      meta = utf8_mixed_meta[key];
+      if(meta == 0){ goto done; }
+
+      shuf = _mm_loadu_si128((const __m128i*)utf8_mixed_shuf[key]);
+      kind = _mm_and_si128(_mm_srli_epi16(shuf, 4), _mm_set1_epi8(0x0f));
+      mask = _mm_shuffle_epi8(kind_mask, kind);
+      t = _mm_shuffle_epi8(v, shuf);
+
+      /* Bytes of each lane (last lowest) are
+       *   6 bits apart in the code point
+       */
+      cp = _mm_madd_epi16(
+        _mm_maddubs_epi16(_mm_andnot_si128(mask, t), _mm_set1_epi16(0x4001)),
+        _mm_set1_epi32(0x10000001)
+      );
+
+      /* Bytes not what the table says they
+       *   must be, overlong forms, surrogates
+       *   and values past U+10FFFF
+       */
+      bad = _mm_or_si128(
+        _mm_or_si128(
+          _mm_cmpgt_epi32(_mm_srli_epi32(_mm_shuffle_epi8(kind_min, kind), 8), cp),
+          _mm_cmpgt_epi32(cp, _mm_set1_epi32(0x10ffff))
+        ),
+        _mm_cmpeq_epi32(_mm_and_si128(cp, _mm_set1_epi32(0x1ff800)), _mm_set1_epi32(0xd800))
+      );
+      if(_mm_movemask_epi8(_mm_andnot_si128(bad, _mm_cmpeq_epi8(_mm_and_si128(t, mask), _mm_add_epi8(mask, mask)))) != 0xffff){
+        goto done;
+      }
+
+      _mm_storeu_si128((__m128i*)(out+o), cp);
+      o += meta & 7;
+      end = pos+(meta >> 3);
+      if((meta & 7) == 4){
+        m &= m-1;
+        m &= m-1;
+        m &= m-1;
+        m &= m-1;
+      } else {
+        m = (starts & (~0ULL << end)) | (1ULL << 63);
+      }
+    }
+    if(end == 0){ break; }
+    n += end;
+  }
+
+  *in = n;
+  return o;
+
+done:
+  *in = n+end;
+  return o;
+}
+
+/*
+ * Decode runs of four 3-byte
+ * sequences (12 bytes) at a time,
+ * setting *in to the bytes used
+ * and returning the code points
+ * written
+ */
+__attribute__((target("ssse3")))
+static inline int utf8_three_ssse3(const unsigned char *s, int len, uint32_t *out, int *in){
+  const __m128i shuf = _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1),
+                mask = _mm_setr_epi8(-16, -64, -64, -16, -64, -64, -16, -64, -64, -16, -64, -64, 0, 0, 0, 0),
+                want = _mm_setr_epi8(-32, -128, -128, -32, -128, -128, -32, -128, -128, -32, -128, -128, 0, 0, 0, 0);
+  __m128i v, t, cp, bad;
+  int n = 0,
+      o = 0;
+
+  while(n+16 <= len){
+    v = _mm_loadu_si128((const __m128i*)(s+n));
+    if(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(v, mask), want)) != 0xffff){ break; }
+
+    t = _mm_shuffle_epi8(v, shuf);
+    cp = _mm_or_si128(
+      _mm_or_si128(
+        _mm_and_si128(t, _mm_set1_epi32(0x3f)),
+        _mm_srli_epi32(_mm_and_si128(t, _mm_set1_epi32(0x3f00)), 2)
+      ),
+      _mm_srli_epi32(_mm_and_si128(t, _mm_set1_epi32(0xf0000)), 4)
+    );
+
+    /* Overlong forms and surrogates */
+    bad = _mm_or_si128(
+      _mm_cmplt_epi32(cp, _mm_set1_epi32(0x800)),
+      _mm_cmpeq_epi32(_mm_and_si128(cp, _mm_set1_epi32(0xf800)), _mm_set1_epi32(0xd800))
+    );
+    if(_mm_movemask_epi8(bad) != 0){ break; }
+
+    _mm_storeu_si128((__m128i*)(out+o), cp);
+    n += 12;
+    o += 4;
+  }
+
+  *in = n;
+  return o;
+}
+
+/*
+ * Decode runs of eight 2-byte
+ * sequences (16 bytes) at a time
+ */
+__attribute__((target("ssse3")))
+static inline int utf8_two_ssse3(const unsigned char *s, int len, uint32_t *out){
+  const __m128i shuf_lo = _mm_setr_epi8(1, 0, -1, -1, 3, 2, -1, -1, 5, 4, -1, -1, 7, 6, -1, -1),
+                shuf_hi = _mm_setr_epi8(9, 8, -1, -1, 11, 10, -1, -1, 13, 12, -1, -1, 15, 14, -1, -1),
+                mask = _mm_set1_epi16((short)0xc0e0),
+                want = _mm_set1_epi16((short)0x80c0);
+  __m128i v, t, lo, hi, bad;
+  int n = 0;
+
+  while(n+16 <= len){
+    v = _mm_loadu_si128((const __m128i*)(s+n));
+    if(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(v, mask), want)) != 0xffff){ break; }
+
+    t = _mm_shuffle_epi8(v, shuf_lo);
+    lo = _mm_or_si128(
+      _mm_and_si128(t, _mm_set1_epi32(0x3f)),
+      _mm_srli_epi32(_mm_and_si128(t, _mm_set1_epi32(0x1f00)), 2)
+    );
+    t = _mm_shuffle_epi8(v, shuf_hi);
+    hi = _mm_or_si128(
+      _mm_and_si128(t, _mm_set1_epi32(0x3f)),
+      _mm_srli_epi32(_mm_and_si128(t, _mm_set1_epi32(0x1f00)), 2)
+    );
+
+    /* Overlong forms (C0 and C1 leads) */
+    bad = _mm_or_si128(
+      _mm_cmplt_epi32(lo, _mm_set1_epi32(0x80)),
+      _mm_cmplt_epi32(hi, _mm_set1_epi32(0x80))
+    );
+    if(_mm_movemask_epi8(bad) != 0){ break; }
+
+    _mm_storeu_si128((__m128i*)(out+(n/2)), lo);
+    _mm_storeu_si128((__m128i*)(out+(n/2)+4), hi);
+    n += 16;
+  }
+
+  return n/2;
+}
+#endif
+
+/*
+ * Decode len bytes of buf into
+ * out, which must hold len+1
+ * code points, returning how
+ * many were written
+ */
+int utf8_decode(struct utf8_decoder *dec, const char *buf, int len, uint32_t *out){
+  const unsigned char *s = (const unsigned char*)buf;
+  uint32_t *start = out;
+  int n = 0,
+      r, used;
+  unsigned char c;
+#ifdef UTF8_SIMD
+  static int ssse3 = -1;
+
+  if(ssse3 == -1){
+    /* The table is filled in before
+     *   anything may use it
+     */
+    if(__builtin_cpu_supports("ssse3")){ utf8_mixed_init(); }
+    ssse3 = __builtin_cpu_supports("ssse3");
+  }
+#endif
+
+  /* Finish a sequence left over from
+   *   the previous call (its bytes are
+   *   already known to be a valid prefix)
+   */
+  while(dec->carry_len > 0 && n < len){
+    dec->carry[dec->carry_len++] = s[n++];
+    r = utf8_decode_one(dec->carry, dec->carry_len, out);
+    if(r > 0){
+      if(r < dec->carry_len){
+        /* Invalid: the new byte starts over */
+        n--;
+      }
+      out++;
+      dec->carry_len = 0;
+    }
+  }
+
+  while(n < len){
+#ifdef UTF8_SIMD
+    if(s[n] < 0x80){
+      r = utf8_ascii_sse2(s+n, len-n, out);
+      n += r;
+      out += r;
+    } else if(ssse3 && s[n] >= 0xe0 && s[n] < 0xf0){
+      out += utf8_three_ssse3(s+n, len-n, out, &used);
+      n += used;
+    } else if(ssse3 && s[n] >= 0xc2 && s[n] < 0xe0){
+      r = utf8_two_ssse3(s+n, len-n, out);
+      n += r*2;
+      out += r;
+    }
+    if(ssse3){
+      out += utf8_mixed_ssse3(s+n, len-n, out, &used);
+      n += used;
+    }
+    if(n >= len){ break; }
+#endif
+
+    if(s[n] < 0x80){
+      *out++ = s[n++];
+      continue;
+    }
+
+    /* Complete, well-formed sequences are decoded
+     *   here; anything invalid or cut off takes
+     *   the slower, byte-at-a-time path
+     */
+    c = s[n];
+    if(c >= 0xc2 && c < 0xe0 && n+2 <= len && (s[n+1] & 0xc0) == 0x80){
+      *out++ = ((c & 0x1f) << 6) | (s[n+1] & 0x3f);
+      n += 2;
+      continue;
+    }
+    if(c >= 0xe0 && c < 0xf0 && n+3 <= len && utf8_first_cont(c, s[n+1]) &&
+       (s[n+2] & 0xc0) == 0x80){
+      *out++ = ((c & 0x0f) << 12) | ((s[n+1] & 0x3f) << 6) | (s[n+2] & 0x3f);
+      n += 3;
+      continue;
+    }
+    if(c >= 0xf0 && c < 0xf5 && n+4 <= len && utf8_first_cont(c, s[n+1]) &&
+       (s[n+2] & 0xc0) == 0x80 && (s[n+3] & 0xc0) == 0x80){
+      *out++ = ((c & 0x07) << 18) | ((s[n+1] & 0x3f) << 12) | ((s[n+2] & 0x3f) << 6) | (s[n+3] & 0x3f);
+      n += 4;
+      continue;
+    }
+
+    r = utf8_decode_one(s+n, len-n, out);
+    if(r < 0){
+      memcpy(dec->carry, s+n, -r);
+      dec->carry_len = -r;
+      break;
+    }
+    out++;
+    n += r;
+  }
+
+  return out-start;
+}
+
+#endif
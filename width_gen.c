@@ -0,0 +1,104 @@
+/*
+ * width_gen.c: generate width.h, a two-level
+ *   cell width lookup table for term
+ *
+ * The widths come from the C library's Unicode
+ *   data (via wcwidth() in a UTF-8 locale), but
+ *   are only queried here, at build time, so that
+ *   term itself never calls wcwidth() while
+ *   printing.
+ *
+ * Every 256 code point block maps (through
+ *   width_stage1) to a deduplicated row of
+ *   width_stage2, in which each code point's
+ *   width (0, 1 or 2) is packed into 2 bits.
+ *
+ * Usage: ./width_gen > width.h
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <locale.h>
+#include <wchar.h>
+
+#define WIDTH_MAX_CP  0x110000
+#define WIDTH_BLOCKS  (WIDTH_MAX_CP >> 8)
+#define WIDTH_PACKED  64
+
+static unsigned char stage1[WIDTH_BLOCKS];
+static unsigned char stage2[256][WIDTH_PACKED];
+static int stage2_len = 0;
+
+int width_of(int cp){
+  int w;
+
+  /* Surrogates and control characters never
+   *   reach the lookup, but give them (and
+   *   unassigned code points) a single cell
+   *   so that nothing can ever vanish
+   */
+  w = wcwidth(cp);
+  return (w < 0 ? 1 : (w > 2 ? 2 : w));
+}
+
+int main(){
+  unsigned char block[WIDTH_PACKED];
+  int b, i, j;
+
+  if(setlocale(LC_CTYPE, "C.UTF-8") == NULL &&
+     setlocale(LC_CTYPE, "en_US.UTF-8") == NULL){
+    fprintf(stderr, "Error: No UTF-8 locale available.\n");
+    return 1;
+  }
+
+  for(b=0;b<WIDTH_BLOCKS;b++){
+    memset(block, 0, sizeof(block));
+    for(i=0;i<256;i++){
+      block[i>>2] |= width_of((b<<8)|i) << ((i&3)*2);
+    }
+
+    for(j=0;j<stage2_len;j++){
+      if(memcmp(stage2[j], block, WIDTH_PACKED) == 0){
+        break;
+      }
+    }
+    if(j == stage2_len){
+      if(stage2_len == 256){
+        fprintf(stderr, "Error: Too many distinct width blocks.\n");
+        return 1;
+      }
+      memcpy(stage2[stage2_len++], block, WIDTH_PACKED);
+    }
+    stage1[b] = j;
+  }
+
+  printf("/*\n * width.h: generated by width_gen.c, do not edit\n */\n\n");
+  printf("#ifndef __WIDTH_H\n#define __WIDTH_H\n\n#include <stdint.h>\n\n");
+
+  printf("static const uint8_t width_stage1[%i] = {", WIDTH_BLOCKS);
+  for(b=0;b<WIDTH_BLOCKS;b++){
+    printf("%s%i,", (b % 24 == 0 ? "\n  " : " "), stage1[b]);
+  }
+  printf("\n};\n\n");
+
+  printf("static const uint8_t width_stage2[%i][%i] = {\n", stage2_len, WIDTH_PACKED);
+  for(j=0;j<stage2_len;j++){
+    printf("  {");
+    for(i=0;i<WIDTH_PACKED;i++){
+      printf("%s0x%02x,", (i % 16 == 0 ? "\n    " : " "), stage2[j][i]);
+    }
+    printf("\n  },\n");
+  }
+  printf("};\n\n");
+
+  printf("/*\n * Number of cells occupied by\n * code point cp (0, 1 or 2)\n */\n");
+  printf("static inline int width_lookup(uint32_t cp){\n");
+  printf("  cp = (cp < %#x ? cp : 0xfffd);\n", WIDTH_MAX_CP);
+  printf("  return (width_stage2[width_stage1[cp >> 8]][(cp & 0xff) >> 2] >> ((cp & 3) * 2)) & 3;\n");
+  printf("}\n\n#endif\n");
+
+  return 0;
+}